@@ -0,0 +1,286 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "compress.h"
+#include "error_stack.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+
+enum { this_error_context = fdu_context_compress };
+
+enum {
+    ZlibWindowBits  = 15,
+    ZlibMemoryLevel = 8,
+    GzipWindowBits  = ZlibWindowBits + 16,
+};
+
+struct fdu_compress_ {
+    z_stream stream;
+    bool inflate;
+    bool cpu_stats;                     // FDU_COMPRESS_CPU_STATS
+
+    unsigned int flush_bytes;
+    unsigned int unflushed;             // input since the last sync flush
+    int flushing;                       // Z_SYNC_FLUSH / Z_FINISH not completed, output was full
+
+    bool finishing;
+    bool finished;
+
+    fdu_compress_stats stats;
+};
+
+// ------------------------------------------------------------
+
+static uint64_t cpu_nsec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int deflate_mode(fdu_compress* compress, const unsigned int available, const bool flush)
+{
+    if (compress->finishing)
+        return Z_FINISH;
+    if (compress->flushing)
+        return compress->flushing;
+
+    if ((compress->unflushed || available)
+        && (flush
+            || compress->unflushed + available >= compress->flush_bytes))
+    {
+        return Z_SYNC_FLUSH;
+    }
+
+    return Z_NO_FLUSH;
+}
+
+bool fdu_compress_transform(fdu_bufio_buffer* in,
+                            fdu_bufio_buffer* out,
+                            const bool flush,
+                            void* compress_v)
+{
+    fdu_compress* compress = (fdu_compress*) compress_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!compress
+        || !in
+        || !out)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (compress->finished
+        || out->filled == out->size)
+    {
+        return fde_safe_pop_context(this_error_context, ectx);
+    }
+
+    z_stream* const z = &compress->stream;
+
+    const int mode = compress->inflate
+        ? Z_NO_FLUSH
+        : deflate_mode(compress, in->filled, flush);
+
+    if (!in->filled
+        && mode == Z_NO_FLUSH)
+    {
+        return fde_safe_pop_context(this_error_context, ectx);
+    }
+
+    z->next_in   = in->data;
+    z->avail_in  = in->filled;
+    z->next_out  = &out->data[out->filled];
+    z->avail_out = out->size - out->filled;
+
+    const uint64_t started = compress->cpu_stats ? cpu_nsec() : 0;
+
+    const int ret = compress->inflate
+        ? inflate(z, mode)
+        : deflate(z, mode);
+
+    if (compress->cpu_stats)
+        compress->stats.cpu_nsec += cpu_nsec() - started;
+
+    const unsigned int consumed = in->filled - z->avail_in;
+    const unsigned int produced = (out->size - out->filled) - z->avail_out;
+
+    out->filled += produced;
+    fdu_bufio_consume(in, consumed);
+
+    if (compress->inflate) {
+        compress->stats.compressed   += consumed;
+        compress->stats.uncompressed += produced;
+    }
+    else {
+        compress->stats.uncompressed += consumed;
+        compress->stats.compressed   += produced;
+        compress->unflushed          += consumed;
+    }
+
+    switch (ret) {
+    case Z_OK:
+    case Z_BUF_ERROR:                   // no progress possible, not fatal
+        if (mode != Z_NO_FLUSH) {
+            // A flush is complete once deflate leaves output space unused.
+            // Z_BUF_ERROR: there was nothing to flush, no new flush point.
+            if (z->avail_out) {
+                if (ret == Z_OK)
+                    ++compress->stats.flushes;
+
+                compress->flushing  = 0;
+                compress->unflushed = 0;
+            }
+            else {
+                compress->flushing = mode;
+            }
+        }
+        break;
+
+    case Z_STREAM_END:
+        if (compress->inflate) {
+            // another stream may follow
+            if (inflateReset(z) != Z_OK) {
+                fde_push_resource_failure("inflateReset");
+                return false;
+            }
+            break;
+        }
+
+        compress->flushing  = 0;
+        compress->unflushed = 0;
+        compress->finished  = true;
+        ++compress->stats.flushes;
+        break;
+
+    case Z_DATA_ERROR:
+    case Z_NEED_DICT:                   // no preset dictionaries, the peer's fault as well
+        // fails this pipeline only, see filter.h
+        fde_push_data_corruption(z->msg ? z->msg : "invalid compressed data");
+        return false;
+
+    case Z_MEM_ERROR:
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+
+    default:
+        fde_push_consistency_failure(z->msg ? z->msg : "zlib stream error");
+        return false;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+void fdu_compress_finish(fdu_compress* compress)
+{
+    if (compress
+        && !compress->inflate)
+    {
+        compress->finishing = true;
+    }
+}
+
+bool fdu_compress_is_finished(const fdu_compress* compress)
+{
+    return compress
+        && compress->finished;
+}
+
+const fdu_compress_stats* fdu_compress_get_stats(const fdu_compress* compress)
+{
+    return compress
+        ? &compress->stats
+        : 0;
+}
+
+double fdu_compress_ratio(const fdu_compress* compress)
+{
+    if (!compress
+        || !compress->stats.compressed)
+    {
+        return 0;
+    }
+
+    return (double) compress->stats.uncompressed / compress->stats.compressed;
+}
+
+// ------------------------------------------------------------
+
+fdu_compress* fdu_new_compress(const unsigned int options,
+                               const int level,
+                               const unsigned int flush_bytes)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return 0;
+    //
+    if ((options & ~(FDU_COMPRESS_INFLATE | FDU_COMPRESS_GZIP | FDU_COMPRESS_CPU_STATS))
+        || level < Z_DEFAULT_COMPRESSION
+        || level > Z_BEST_COMPRESSION)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    fdu_compress* compress = calloc(1, sizeof(fdu_compress));
+
+    if (!compress) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    compress->inflate     = (options & FDU_COMPRESS_INFLATE);
+    compress->cpu_stats   = (options & FDU_COMPRESS_CPU_STATS);
+    compress->flush_bytes = flush_bytes ? flush_bytes : UINT32_MAX;
+
+    const int window_bits = (options & FDU_COMPRESS_GZIP)
+        ? GzipWindowBits
+        : ZlibWindowBits;
+
+    const int ret = compress->inflate
+        ? inflateInit2(&compress->stream, window_bits)
+        : deflateInit2(&compress->stream, level, Z_DEFLATED,
+                       window_bits, ZlibMemoryLevel, Z_DEFAULT_STRATEGY);
+
+    if (ret != Z_OK) {
+        free(compress);
+
+        if (ret == Z_MEM_ERROR) fde_push_resource_failure_id(fde_resource_memory_allocation);
+        else                    fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+
+    if (!fde_safe_pop_context(this_error_context, ectx)) {
+        fdu_free_compress(compress);
+        return 0;
+    }
+
+    return compress;
+}
+
+void fdu_free_compress(fdu_compress* compress)
+{
+    if (!compress)
+        return;
+
+    if (compress->inflate) inflateEnd(&compress->stream);
+    else                   deflateEnd(&compress->stream);
+
+    free(compress);
+}
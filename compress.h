@@ -0,0 +1,68 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include "filter.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+  Streaming compression stage (zlib)
+
+  'fdu_compress' is a transform for fdu_filter, see filter.h:
+
+      fdu_filter_add_transform(filter, size, fdu_compress_transform, compress);
+
+  FDU_COMPRESS_DEFLATE compresses, FDU_COMPRESS_INFLATE decompresses, with
+  FDU_COMPRESS_GZIP the gzip format is used instead of the zlib one. 'level'
+  is the zlib level (-1 = default). Only the zlib and gzip formats are
+  supported, there is no zstd stage.
+
+  Deflate output is sync-flushed (a complete block the receiver can decode)
+  whenever 'flush_bytes' of input have gone in since the last flush, and on
+  every fdu_filter_flush() - use fdu_filter_set_idle_flush() for flushing on
+  idle. fdu_compress_finish() ends the stream on the next run, input after
+  that is left unconsumed. Inflate accepts concatenated streams. A corrupt
+  stream fails only the filter pipeline it is in, see filter.h.
+
+  Statistics count 'uncompressed' and 'compressed' bytes and completed sync
+  flushes. With FDU_COMPRESS_CPU_STATS also the thread CPU time spent in
+  zlib, that costs two clock_gettime() calls per run.
+*/
+
+enum {
+    FDU_COMPRESS_DEFLATE    = 0,
+    FDU_COMPRESS_INFLATE    = 1,
+
+    FDU_COMPRESS_GZIP       = 1 << 1,
+    FDU_COMPRESS_CPU_STATS  = 1 << 2,
+};
+
+typedef struct fdu_compress_ fdu_compress;
+
+typedef struct {
+    uint64_t uncompressed;
+    uint64_t compressed;
+    uint64_t cpu_nsec;
+    uint32_t flushes;
+} fdu_compress_stats;
+
+//
+
+fdu_compress* fdu_new_compress(unsigned int options, int level, unsigned int flush_bytes);
+void fdu_free_compress(fdu_compress*);
+
+bool fdu_compress_transform(fdu_bufio_buffer* in,
+                            fdu_bufio_buffer* out,
+                            bool flush,
+                            void* compress);
+
+void fdu_compress_finish(fdu_compress*);
+bool fdu_compress_is_finished(const fdu_compress*);
+
+const fdu_compress_stats* fdu_compress_get_stats(const fdu_compress*);
+double fdu_compress_ratio(const fdu_compress*);                // uncompressed / compressed
@@ -0,0 +1,99 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "../http.h"
+#include "../error_stack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Parses the same request over and over and prints the throughput. The
+ * request is copied to a scratch buffer each round, the parser modifies
+ * it in place.
+ */
+
+static const char* Request =
+    "GET /api/v1/items?page=2&sort=name HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:78.0) Gecko/20100101 Firefox/78.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/api/v1/items?page=1&sort=name\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "\r\n";
+
+static unsigned int headers = 0;
+
+static bool count_header(void* context, fdu_http_header_t id, unsigned char* name, unsigned char* value)
+{
+    (void) context;
+    (void) id;
+    (void) name;
+    (void) value;
+
+    ++headers;
+    return true;
+}
+
+static const fdu_http_ops_t ops = {
+    .parse_url     = 0,
+    .parse_version = 0,
+    .parse_header  = &count_header,
+    .parse_content = 0,
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned int rounds = (argc > 1) ? strtoul(argv[1], 0, 10) : 1000000;
+    const unsigned int size   = strlen(Request);
+
+    unsigned char buffer[1024];
+    fdu_http_request_parser_t parser;
+
+    fdu_init_http_request_parser(&parser, 0, &ops);
+
+    const double started = now();
+
+    for (unsigned int i = 0; i < rounds; ++i)
+    {
+        memcpy(buffer, Request, size);
+
+        unsigned char* start = buffer;
+        unsigned char* end   = buffer + size;
+
+        fdu_clear_http_request_parser(&parser);
+
+        if (!fdu_http_parse_request(&parser, &start, &end)) {
+            fde_print_stack(stderr);
+            return 1;
+        }
+    }
+
+    const double seconds = now() - started;
+
+    printf("%u requests, %u headers, %.3f s, %.1f MB/s, %.0f ns/request\n",
+           rounds,
+           headers,
+           seconds,
+           (double) rounds * size / seconds / 1e6,
+           seconds / rounds * 1e9);
+
+    return 0;
+}
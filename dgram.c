@@ -0,0 +1,958 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#define _GNU_SOURCE
+
+#include "dgram.h"
+#include "error_stack.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+enum { this_error_context = fdu_context_dgram };
+
+enum {
+    MaximumMessages    = 1024,
+    MaximumMessageSize = 65536,
+};
+
+enum {
+    ControlSize         = CMSG_SPACE(sizeof(int)),  // one UDP_GRO / UDP_SEGMENT cmsg
+    GroMaximumSegments  = 64,                       // per super-packet, UDP_GRO_CNT_MAX
+    GsoMaximumSegments  = 64,                       // per send, UDP_MAX_SEGMENTS
+    GsoMaximumPayload   = 65507,                    // IPv4 UDP payload limit
+};
+
+enum {  // cs = callstack
+    dgram_cs_active     = 1,
+    dgram_cs_closed     = 1 << 1,
+    dgram_cs_freed      = 1 << 2,
+};
+
+struct fdu_dgram_service_ {
+    fdu_dgram_buffer buffer;
+
+    fdd_service_input input_service;
+    fdd_service_output output_service;
+
+    void* context;
+    fdu_dgram_notify_func notify;
+    fdu_dgram_close_func close;
+
+    int close_errno;
+    unsigned int callstack;
+
+    unsigned int max_messages;
+    unsigned int message_size;
+    unsigned int options;               // FDU_DGRAM_*
+
+    // receive
+
+    fdu_dgram_message* rx_messages;
+    struct mmsghdr* rx_headers;
+    struct iovec* rx_iov;
+    struct sockaddr_storage* rx_addr;
+    unsigned char* rx_control;
+    unsigned char* rx_arena;
+
+    fdu_dgram_message* rx_views;        // GRO: super-packets split into datagrams
+    unsigned int rx_view_capacity;
+
+    // send queue, ring of 'max_messages' slots
+
+    struct mmsghdr* tx_headers;
+    struct iovec* tx_iov;
+    struct sockaddr_storage* tx_addr;
+    unsigned char* tx_arena;
+
+    unsigned int tx_head;
+    unsigned int tx_queued;
+    bool tx_waiting;                    // registered for output
+    uint64_t tx_dropped;                // to unreachable destinations
+
+    // GSO: one header per run of coalesced queue slots
+
+    struct mmsghdr* gso_headers;
+    unsigned char* gso_control;
+    unsigned int* gso_runs;
+};
+
+// ICMP errors for one destination, or reported late for an earlier one.
+// They don't make the socket unusable.
+
+static bool dgram_transient_error(int error)
+{
+    return error == ECONNREFUSED
+        || error == EHOSTUNREACH
+        || error == ENETUNREACH
+        || error == EHOSTDOWN;
+}
+
+// These errors are often ICMP errors for an earlier datagram, reported late
+// by the next send: the head of the queue wasn't sent at all. It is tried
+// once more and dropped only if the same error comes back. '*head_error' is
+// the error the head was retried after, =true: drop it.
+
+static bool dgram_head_failed(int* head_error, int error)
+{
+    if (*head_error != error) {
+        *head_error = error;
+        return false;
+    }
+
+    *head_error = 0;
+    return true;
+}
+
+// drops the datagrams at the head of the queue
+
+static void dgram_drop(fdu_dgram_service* service, unsigned int count)
+{
+    service->tx_head     = (service->tx_head + count) % service->max_messages;
+    service->tx_queued  -= count;
+    service->tx_dropped += count;
+}
+
+static void dgram_release_service(fdu_dgram_service* service)
+{
+    free(service->rx_views);
+    free(service->gso_headers);
+    free(service);
+}
+
+// ------------------------------------------------------------
+
+static void dgram_notify(fdu_dgram_service* service, bool* lazy_close)
+{
+    if (!service->notify)
+        return;
+
+    service->callstack |= dgram_cs_active;
+
+    if (!service->notify(&service->buffer, service->context)
+        || (service->callstack & (dgram_cs_closed | dgram_cs_freed)))
+    {
+        *lazy_close = true;
+    }
+
+    service->callstack &= ~(dgram_cs_active | dgram_cs_closed);
+}
+
+static unsigned int dgram_gro_segment(struct msghdr* hdr)
+{
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP
+            && cmsg->cmsg_type == UDP_GRO)
+        {
+            int segment;
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+            return (segment > 0) ? (unsigned int) segment : 0;
+        }
+    }
+
+    return 0;
+}
+
+static void dgram_deliver_segments(fdu_dgram_service* service, const unsigned int n, bool* lazy_close)
+{
+    fdu_dgram_message* const views = service->rx_views;
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < n && !*lazy_close; ++i)
+    {
+        struct mmsghdr* mh = &service->rx_headers[i];
+
+        const unsigned int size = mh->msg_len;
+        unsigned int segment = dgram_gro_segment(&mh->msg_hdr);
+
+        if (!segment
+            || segment > size)
+        {
+            segment = size;
+        }
+
+        unsigned int offset = 0;
+
+        do {
+            if (count == service->rx_view_capacity) {
+                service->buffer.count = count;
+                dgram_notify(service, lazy_close);
+                count = 0;
+
+                if (*lazy_close)
+                    break;
+            }
+
+            fdu_dgram_message* view = &views[count++];
+
+            view->data      = &service->rx_arena[i * service->message_size + offset];
+            view->size      = (size - offset < segment) ? size - offset : segment;
+            view->addr      = (const struct sockaddr*) &service->rx_addr[i];
+            view->addr_len  = mh->msg_hdr.msg_namelen;
+
+            offset += view->size;
+
+            view->truncated = ((mh->msg_hdr.msg_flags & MSG_TRUNC)
+                               && offset == size);
+        } while (offset < size);
+    }
+
+    if (count
+        && !*lazy_close)
+    {
+        service->buffer.count = count;
+        dgram_notify(service, lazy_close);
+    }
+
+    service->buffer.count = 0;
+}
+
+static bool fdu_dgram_got_input(void* service_v, int fd)
+{
+    fdu_dgram_service* service = (fdu_dgram_service*) service_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!service
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    FDE_ASSERT( fd == service->buffer.fd , "fd corrupted" , false );
+    //
+
+    const unsigned int max = service->max_messages;
+    const bool gro = (service->options & FDU_DGRAM_GRO);
+
+    for (unsigned int i = 0; i < max; ++i) {
+        struct msghdr* hdr = &service->rx_headers[i].msg_hdr;
+
+        hdr->msg_namelen    = sizeof(struct sockaddr_storage);
+        hdr->msg_controllen = gro ? ControlSize : 0;
+        hdr->msg_flags      = 0;
+        service->rx_iov[i].iov_len = service->message_size;
+    }
+
+    const int n = recvmmsg(fd, service->rx_headers, max, MSG_DONTWAIT, 0);
+
+    bool lazy_close = false;
+
+    if (n > 0 && gro) {
+        dgram_deliver_segments(service, n, &lazy_close);
+    }
+    else if (n > 0) {
+        fdu_dgram_message* const messages = service->rx_messages;
+
+        for (int i = 0; i < n; ++i) {
+            const struct mmsghdr* mh = &service->rx_headers[i];
+
+            messages[i].size      = mh->msg_len;
+            messages[i].truncated = (mh->msg_hdr.msg_flags & MSG_TRUNC);
+            messages[i].addr_len  = mh->msg_hdr.msg_namelen;
+        }
+
+        service->buffer.count = n;
+
+        dgram_notify(service, &lazy_close);
+
+        service->buffer.count = 0;
+    }
+    else if (n < 0
+             && errno != EINTR
+             && errno != EAGAIN
+             && errno != EWOULDBLOCK
+             && !dgram_transient_error(errno))
+    {
+        lazy_close = true;
+        service->close_errno = errno;
+    }
+
+    if (lazy_close)
+        fdu_dgram_close(&service->buffer);
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+static bool dgram_send_plain(fdu_dgram_service* service)
+{
+    const int fd = service->buffer.fd;
+    int head_error = 0;
+
+    while (service->tx_queued)
+    {
+        const unsigned int head       = service->tx_head;
+        const unsigned int contiguous = ((service->tx_queued < service->max_messages - head)
+                                         ? service->tx_queued
+                                         : service->max_messages - head);
+
+        const int n = sendmmsg(fd, &service->tx_headers[head], contiguous, MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN
+                || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+
+            // the first one failed, the rest may get through
+
+            if (dgram_transient_error(errno)) {
+                if (dgram_head_failed(&head_error, errno))
+                    dgram_drop(service, 1);
+                continue;
+            }
+
+            service->close_errno = errno;
+            return false;
+        }
+
+        service->tx_head    = (head + n) % service->max_messages;
+        service->tx_queued -= n;
+        head_error          = 0;
+
+        if ((unsigned int)n < contiguous)
+            break;
+    }
+
+    return true;
+}
+
+static bool dgram_same_destination(const struct msghdr* a, const struct msghdr* b)
+{
+    return a->msg_namelen == b->msg_namelen
+        && (!a->msg_namelen
+            || !memcmp(a->msg_name, b->msg_name, a->msg_namelen));
+}
+
+// Packs 'contiguous' queue slots starting from 'head' into 'gso_headers'.
+// A run shares the destination and the segment size, only its last datagram
+// may be shorter. Returns the number of headers, sets 'coalesced' if any run
+// is longer than one.
+
+static unsigned int dgram_pack_segments(fdu_dgram_service* service,
+                                        unsigned int head,
+                                        unsigned int contiguous,
+                                        bool* coalesced)
+{
+    unsigned int count = 0;
+
+    while (contiguous)
+    {
+        const struct msghdr* first = &service->tx_headers[head].msg_hdr;
+
+        const size_t segment = service->tx_iov[head].iov_len;
+        size_t total = segment;
+        unsigned int run = 1;
+
+        while (segment
+               && run < contiguous
+               && run < GsoMaximumSegments)
+        {
+            const size_t next = service->tx_iov[head + run].iov_len;
+
+            if (!next
+                || next > segment
+                || total + next > GsoMaximumPayload
+                || !dgram_same_destination(first, &service->tx_headers[head + run].msg_hdr))
+            {
+                break;
+            }
+
+            total += next;
+            ++run;
+
+            if (next < segment)
+                break;
+        }
+
+        struct msghdr* hdr = &service->gso_headers[count].msg_hdr;
+
+        hdr->msg_name    = first->msg_name;
+        hdr->msg_namelen = first->msg_namelen;
+        hdr->msg_iov     = &service->tx_iov[head];
+        hdr->msg_iovlen  = run;
+
+        if (run > 1) {
+            hdr->msg_control    = &service->gso_control[count * ControlSize];
+            hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+            const uint16_t segment_size = segment;
+
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type  = UDP_SEGMENT;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(segment_size));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+            *coalesced = true;
+        }
+        else {
+            hdr->msg_control    = 0;
+            hdr->msg_controllen = 0;
+        }
+
+        service->gso_runs[count++] = run;
+
+        head       += run;
+        contiguous -= run;
+    }
+
+    return count;
+}
+
+static bool dgram_send_segmented(fdu_dgram_service* service)
+{
+    const int fd = service->buffer.fd;
+    int head_error = 0;
+
+    while (service->tx_queued)
+    {
+        const unsigned int head       = service->tx_head;
+        const unsigned int contiguous = ((service->tx_queued < service->max_messages - head)
+                                         ? service->tx_queued
+                                         : service->max_messages - head);
+
+        bool coalesced = false;
+        const unsigned int count = dgram_pack_segments(service, head, contiguous, &coalesced);
+
+        const int n = sendmmsg(fd, service->gso_headers, count, MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN
+                || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+
+            // segment size over the path MTU, or no checksum offload on the device
+
+            if (coalesced
+                && (errno == EINVAL
+                    || errno == EIO))
+            {
+                service->options &= ~FDU_DGRAM_GSO;
+                return dgram_send_plain(service);
+            }
+
+            if (dgram_transient_error(errno)) {
+                if (dgram_head_failed(&head_error, errno))
+                    dgram_drop(service, service->gso_runs[0]);
+                continue;
+            }
+
+            service->close_errno = errno;
+            return false;
+        }
+
+        unsigned int sent = 0;
+        for (int i = 0; i < n; ++i)
+            sent += service->gso_runs[i];
+
+        service->tx_head    = (head + sent) % service->max_messages;
+        service->tx_queued -= sent;
+        head_error          = 0;
+
+        if ((unsigned int)n < count)
+            break;
+    }
+
+    return true;
+}
+
+static bool dgram_flush(fdu_dgram_service* service)
+{
+    const int fd = service->buffer.fd;
+
+    if (!((service->options & FDU_DGRAM_GSO)
+          ? dgram_send_segmented(service)
+          : dgram_send_plain(service)))
+    {
+        return false;
+    }
+
+    // wait for the socket only while something is left
+
+    if (service->tx_queued
+        && !service->tx_waiting)
+    {
+        if (!fdd_add_output(fd, &service->output_service))
+            return false;
+        service->tx_waiting = true;
+    }
+    else if (!service->tx_queued
+             && service->tx_waiting)
+    {
+        if (!fdd_remove_output(fd))
+            return false;
+        service->tx_waiting = false;
+    }
+
+    return true;
+}
+
+static bool fdu_dgram_got_output(void* service_v, int fd)
+{
+    fdu_dgram_service* service = (fdu_dgram_service*) service_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!service
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    FDE_ASSERT( fd == service->buffer.fd , "fd corrupted" , false );
+    //
+
+    if (!dgram_flush(service)) {
+        if (!service->close_errno)
+            return false;
+
+        fdu_dgram_close(&service->buffer);
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+bool fdu_dgram_send(fdu_dgram_buffer* buffer,
+                    const unsigned char* data,
+                    const unsigned int size,
+                    const struct sockaddr* addr,
+                    const socklen_t addr_len)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    fdu_dgram_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || buffer->fd < 0
+        || (!data && size)
+        || size > service->message_size
+        || (addr && addr_len > sizeof(struct sockaddr_storage)))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (service->tx_queued == service->max_messages) {
+        if (!dgram_flush(service)) {
+            if (service->close_errno)
+                fde_push_stdlib_error("sendmmsg", service->close_errno);
+            return false;
+        }
+
+        if (service->tx_queued == service->max_messages) {
+            fde_push_resource_failure_id(fde_resource_buffer_overflow);
+            return false;
+        }
+    }
+
+    const unsigned int slot = (service->tx_head + service->tx_queued) % service->max_messages;
+
+    struct msghdr* hdr = &service->tx_headers[slot].msg_hdr;
+
+    if (size)
+        memcpy(&service->tx_arena[slot * service->message_size], data, size);
+    service->tx_iov[slot].iov_len = size;
+
+    if (addr) {
+        memcpy(&service->tx_addr[slot], addr, addr_len);
+        hdr->msg_name    = &service->tx_addr[slot];
+        hdr->msg_namelen = addr_len;
+    }
+    else {
+        hdr->msg_name    = 0;
+        hdr->msg_namelen = 0;
+    }
+
+    ++service->tx_queued;
+
+    // don't wait for a full queue if the socket isn't writable anyway
+
+    if (service->tx_queued == service->max_messages
+        && !dgram_flush(service))
+    {
+        if (service->close_errno)
+            fde_push_stdlib_error("sendmmsg", service->close_errno);
+        return false;
+    }
+
+    if (!service->tx_waiting) {
+        if (!fdd_add_output(buffer->fd, &service->output_service))
+            return false;
+        service->tx_waiting = true;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_dgram_flush(fdu_dgram_buffer* buffer)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!buffer
+        || !buffer->service
+        || buffer->fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (!dgram_flush(buffer->service)) {
+        if (buffer->service->close_errno)
+            fde_push_stdlib_error("sendmmsg", buffer->service->close_errno);
+        return false;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_dgram_set_offload(fdu_dgram_buffer* buffer, const unsigned int options)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    fdu_dgram_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || buffer->fd < 0
+        || (options & ~(FDU_DGRAM_GRO | FDU_DGRAM_GSO))
+        || (service->callstack & dgram_cs_active))     // views are in use
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    const int fd = buffer->fd;
+
+    if ((options ^ service->options) & FDU_DGRAM_GRO)
+    {
+        const int value = (options & FDU_DGRAM_GRO) ? 1 : 0;
+
+        if (value && !service->rx_views)
+        {
+            const unsigned int capacity = service->max_messages * GroMaximumSegments;
+
+            if (!(service->rx_views = malloc(capacity * sizeof(fdu_dgram_message)))) {
+                fde_push_resource_failure_id(fde_resource_memory_allocation);
+                return false;
+            }
+            service->rx_view_capacity = capacity;
+        }
+
+        if (setsockopt(fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) < 0) {
+            fde_push_stdlib_error("setsockopt", errno);
+            return false;
+        }
+
+        buffer->messages = value ? service->rx_views : service->rx_messages;
+    }
+
+    if ((options & FDU_DGRAM_GSO)
+        && !(service->options & FDU_DGRAM_GSO))
+    {
+        // probe only, the segment size is given per send
+
+        int segment;
+        socklen_t length = sizeof(segment);
+
+        if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, &length) < 0) {
+            fde_push_stdlib_error("getsockopt", errno);
+            return false;
+        }
+
+        if (!service->gso_headers)
+        {
+            const unsigned int max = service->max_messages;
+
+            unsigned char* const allocated = malloc(max * (sizeof(struct mmsghdr)
+                                                           + ControlSize
+                                                           + sizeof(unsigned int)));
+            if (!allocated) {
+                fde_push_resource_failure_id(fde_resource_memory_allocation);
+                return false;
+            }
+
+            unsigned char* counter = allocated;
+
+            const fdu_memory_area
+                header_memory  = init_memory_area_cont(&counter, max * sizeof(struct mmsghdr)),
+                control_memory = init_memory_area_cont(&counter, max * ControlSize),
+                run_memory     = init_memory_area_cont(&counter, max * sizeof(unsigned int));
+
+            memset(header_memory.begin, 0, header_memory.end - header_memory.begin);
+            memset(control_memory.begin, 0, control_memory.end - control_memory.begin);
+
+            service->gso_headers = (struct mmsghdr*) header_memory.begin;
+            service->gso_control = control_memory.begin;
+            service->gso_runs    = (unsigned int*) run_memory.begin;
+        }
+    }
+
+    service->options = options;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+unsigned int fdu_dgram_queued(const fdu_dgram_buffer* buffer)
+{
+    return (buffer && buffer->service)
+        ? buffer->service->tx_queued
+        : 0;
+}
+
+uint64_t fdu_dgram_dropped(const fdu_dgram_buffer* buffer)
+{
+    return (buffer && buffer->service)
+        ? buffer->service->tx_dropped
+        : 0;
+}
+
+// ------------------------------------------------------------
+
+void fdu_dgram_close(fdu_dgram_buffer* buffer)
+{
+    fdu_dgram_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || buffer->fd < 0)      // already closed
+    {
+        return;
+    }
+
+    if (service->callstack & dgram_cs_active) {
+        service->callstack |= dgram_cs_closed;
+        return;
+    }
+
+    const int fd = buffer->fd;
+
+    buffer->fd = -1;
+
+    const fde_node_t* ectx = fde_push_context(this_error_context);
+
+    fdd_remove_input(fd);
+    if (service->tx_waiting) {
+        fdd_remove_output(fd);
+        service->tx_waiting = false;
+    }
+
+    service->tx_queued = 0;
+
+    //
+
+    service->callstack |= dgram_cs_active;
+
+    if (service->close)
+        service->close(buffer, service->context, fd, service->close_errno);
+
+    const bool lazy_free = (service->callstack & dgram_cs_freed);
+
+    service->callstack &= ~(dgram_cs_active | dgram_cs_freed);
+
+    if (lazy_free)
+        dgram_release_service(service);
+
+    if (ectx)
+        fde_safe_pop_context(this_error_context, ectx);
+}
+
+void fdu_dgram_free(fdu_dgram_buffer* buffer)
+{
+    fdu_dgram_service* service;
+
+    if (!buffer
+        || !(service = buffer->service))
+    {
+        return;
+    }
+
+    if (service->callstack & dgram_cs_active) {
+        service->callstack |= dgram_cs_freed;
+        return;
+    }
+
+    if (fdu_dgram_is_closed(buffer)) {
+        dgram_release_service(service);
+    }
+    else {
+        service->callstack |= dgram_cs_freed;
+        fdu_dgram_close(buffer);
+    }
+}
+
+// ------------------------------------------------------------
+
+fdu_dgram_buffer* fdu_new_dgram_bufio(const int fd,
+                                      const unsigned int max_messages,
+                                      const unsigned int message_size,
+                                      void* const context,
+                                      const fdu_dgram_notify_func notify_callback,
+                                      const fdu_dgram_close_func close_callback)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(this_error_context)))
+        return 0;
+    //
+    if (fd < 0
+        || !max_messages
+        || max_messages > MaximumMessages
+        || !message_size
+        || message_size > MaximumMessageSize)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    const size_t total_size = (sizeof(fdu_dgram_service)
+                               + max_messages * (sizeof(fdu_dgram_message)
+                                                 + 2 * sizeof(struct mmsghdr)
+                                                 + 2 * sizeof(struct iovec)
+                                                 + 2 * sizeof(struct sockaddr_storage)
+                                                 + ControlSize
+                                                 + 2 * message_size));
+
+    unsigned char* const allocated = malloc(total_size);
+
+    if (!allocated) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    unsigned char* counter = allocated;
+
+    const fdu_memory_area
+        service_memory  = init_memory_area_cont(&counter, sizeof(fdu_dgram_service)),
+        message_memory  = init_memory_area_cont(&counter, max_messages * sizeof(fdu_dgram_message)),
+        rx_hdr_memory   = init_memory_area_cont(&counter, max_messages * sizeof(struct mmsghdr)),
+        tx_hdr_memory   = init_memory_area_cont(&counter, max_messages * sizeof(struct mmsghdr)),
+        rx_iov_memory   = init_memory_area_cont(&counter, max_messages * sizeof(struct iovec)),
+        tx_iov_memory   = init_memory_area_cont(&counter, max_messages * sizeof(struct iovec)),
+        rx_addr_memory  = init_memory_area_cont(&counter, max_messages * sizeof(struct sockaddr_storage)),
+        tx_addr_memory  = init_memory_area_cont(&counter, max_messages * sizeof(struct sockaddr_storage)),
+        control_memory  = init_memory_area_cont(&counter, max_messages * ControlSize),
+        rx_arena_memory = init_memory_area_cont(&counter, max_messages * message_size),
+        tx_arena_memory = init_memory_area_cont(&counter, max_messages * message_size);
+
+    fdu_dgram_service* service = (fdu_dgram_service*) service_memory.begin;
+
+    memset(rx_hdr_memory.begin, 0, rx_hdr_memory.end - rx_hdr_memory.begin);
+    memset(tx_hdr_memory.begin, 0, tx_hdr_memory.end - tx_hdr_memory.begin);
+
+    service->context      = context;
+    service->notify       = notify_callback;
+    service->close        = close_callback;
+    service->close_errno  = 0;
+    service->callstack    = 0;
+    service->max_messages = max_messages;
+    service->message_size = message_size;
+    service->options      = 0;
+
+    service->rx_messages  = (fdu_dgram_message*) message_memory.begin;
+    service->rx_headers   = (struct mmsghdr*) rx_hdr_memory.begin;
+    service->rx_iov       = (struct iovec*) rx_iov_memory.begin;
+    service->rx_addr      = (struct sockaddr_storage*) rx_addr_memory.begin;
+    service->rx_control   = control_memory.begin;
+    service->rx_arena     = rx_arena_memory.begin;
+    service->rx_views     = 0;
+    service->rx_view_capacity = 0;
+
+    service->tx_headers   = (struct mmsghdr*) tx_hdr_memory.begin;
+    service->tx_iov       = (struct iovec*) tx_iov_memory.begin;
+    service->tx_addr      = (struct sockaddr_storage*) tx_addr_memory.begin;
+    service->tx_arena     = tx_arena_memory.begin;
+    service->tx_head      = 0;
+    service->tx_queued    = 0;
+    service->tx_waiting   = false;
+    service->tx_dropped   = 0;
+
+    service->gso_headers  = 0;
+    service->gso_control  = 0;
+    service->gso_runs     = 0;
+
+    service->buffer.fd       = fd;
+    service->buffer.messages = service->rx_messages;
+    service->buffer.count    = 0;
+    service->buffer.service  = service;
+
+    // headers point straight at the message slots, nothing is copied on receive
+
+    for (unsigned int i = 0; i < max_messages; ++i)
+    {
+        fdu_dgram_message* msg = &service->buffer.messages[i];
+
+        msg->data     = &service->rx_arena[i * message_size];
+        msg->size     = 0;
+        msg->addr     = (const struct sockaddr*) &service->rx_addr[i];
+        msg->addr_len = 0;
+
+        service->rx_iov[i].iov_base = msg->data;
+        service->rx_iov[i].iov_len  = message_size;
+
+        service->rx_headers[i].msg_hdr.msg_name    = &service->rx_addr[i];
+        service->rx_headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        service->rx_headers[i].msg_hdr.msg_iov     = &service->rx_iov[i];
+        service->rx_headers[i].msg_hdr.msg_iovlen  = 1;
+        service->rx_headers[i].msg_hdr.msg_control = &service->rx_control[i * ControlSize];
+
+        service->tx_iov[i].iov_base = &service->tx_arena[i * message_size];
+        service->tx_iov[i].iov_len  = 0;
+
+        service->tx_headers[i].msg_hdr.msg_iov    = &service->tx_iov[i];
+        service->tx_headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    fdd_init_service_input(&service->input_service,
+                           service,
+                           &fdu_dgram_got_input);
+    fdd_init_service_output(&service->output_service,
+                            service,
+                            &fdu_dgram_got_output);
+
+    if (fdd_add_input(fd, &service->input_service)) {
+        if (fde_pop_context(this_error_context, ectx))
+            return &service->buffer;    // <-- normal exit
+
+        fdd_remove_input(fd);
+    }
+
+    free(allocated);
+    return 0;
+}
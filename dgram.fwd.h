@@ -0,0 +1,10 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+typedef struct fdu_dgram_message_ fdu_dgram_message;
+typedef struct fdu_dgram_buffer_  fdu_dgram_buffer;
+typedef struct fdu_dgram_service_ fdu_dgram_service;
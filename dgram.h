@@ -0,0 +1,99 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include "dgram.fwd.h"
+#include "dispatcher.h"
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+  Datagram I/O service
+
+  'fdu_dgram_buffer' is created with fdu_new_dgram_bufio(). All memory is
+  allocated up front: a receive arena of 'max_messages' slots of
+  'message_size' bytes, and a send queue of the same dimensions.
+
+  RECEIVE: On every wakeup up to 'max_messages' datagrams are received with
+  one recvmmsg() call and 'notify_callback' is called once for the batch.
+  'messages' and 'count' describe the batch, each message with the address
+  it came from. The messages are valid until 'notify_callback' returns.
+
+  SEND: fdu_dgram_send() copies a datagram to the send queue. The queue is
+  flushed with sendmmsg() when it fills up, when fdu_dgram_flush() is called
+  and whenever the socket becomes writable while something is queued.
+  A datagram to an unreachable destination (ECONNREFUSED, EHOSTUNREACH,
+  ENETUNREACH, EHOSTDOWN) is dropped and counted, see fdu_dgram_dropped(),
+  the service stays open. Such an error may be a late one for an earlier
+  datagram, so the datagram is sent once more and dropped only if the same
+  error comes back. Those errors are ignored when receiving, too.
+
+  OFFLOAD: fdu_dgram_set_offload() turns on UDP_GRO and/or UDP_SEGMENT (GSO).
+  With FDU_DGRAM_GRO the kernel may hand over several datagrams of one flow
+  as a single super-packet; those are split back into individual messages
+  pointing into the receive arena, nothing is copied. 'message_size' should
+  then be 65535 so super-packets fit. With FDU_DGRAM_GSO consecutive queued
+  datagrams to the same address and of the same size (the last one may be
+  shorter) are handed to the kernel as one send.
+
+  CLOSED STATE / FREED: as with fdu_bufio_buffer, see utils.h. The user is
+  responsible for closing fd.
+*/
+
+enum {
+    FDU_DGRAM_GRO = 1 << 0,
+    FDU_DGRAM_GSO = 1 << 1,
+};
+
+struct fdu_dgram_message_ {
+    unsigned char* data;
+    unsigned int size;
+    bool truncated;
+    //
+    const struct sockaddr* addr;
+    socklen_t addr_len;
+};
+
+struct fdu_dgram_buffer_ {
+    int fd;
+    //
+    fdu_dgram_message* messages;
+    unsigned int count;
+    //
+    fdu_dgram_service* service;
+};
+
+typedef bool (*fdu_dgram_notify_func)(fdu_dgram_buffer*, void* context);
+typedef void (*fdu_dgram_close_func)(fdu_dgram_buffer*, void* context, int fd, int error);
+
+//
+
+static inline bool fdu_dgram_is_closed(fdu_dgram_buffer* dgram) { return dgram->fd < 0; }
+
+//
+
+fdu_dgram_buffer* fdu_new_dgram_bufio(int fd,
+                                      unsigned int max_messages,
+                                      unsigned int message_size,
+                                      void* context,
+                                      fdu_dgram_notify_func notify_callback,
+                                      fdu_dgram_close_func close_callback);
+
+bool fdu_dgram_set_offload(fdu_dgram_buffer*, unsigned int options);
+
+bool fdu_dgram_send(fdu_dgram_buffer*,
+                    const unsigned char* data,
+                    unsigned int size,
+                    const struct sockaddr* addr,        // 0 for connected sockets
+                    socklen_t addr_len);
+bool fdu_dgram_flush(fdu_dgram_buffer*);
+
+unsigned int fdu_dgram_queued(const fdu_dgram_buffer*);
+uint64_t fdu_dgram_dropped(const fdu_dgram_buffer*);        // unreachable destinations
+
+void fdu_dgram_close(fdu_dgram_buffer*);
+void fdu_dgram_free(fdu_dgram_buffer*);
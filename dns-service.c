@@ -4,48 +4,119 @@
  * Licensed under The MIT License, see file LICENSE.txt in this source tree.
  */
 
-#include <arpa/inet.h>
+#define _GNU_SOURCE
+
 #include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 
-enum { BufferSize = 256 };
+/* Requests and replies are frames of a 16-bit size followed by that many
+ * bytes, integers in host byte order (the driver is on the same host):
+ *
+ *   request: u32 id, u8 families (1: IPv4, 2: IPv6), name
+ *   reply:   u32 id, u8 status, u8 count,
+ *            count * (u8 family (4 or 6), u32 ttl, 16 bytes address)
+ *
+ * IPv4 addresses take the first 4 bytes. getaddrinfo() doesn't tell TTLs,
+ * they are all 0xffffffff (unknown). Requests are answered in order, one
+ * write per reply. An empty name is answered with StatusFailure; the driver
+ * sends one at startup to see that the helper is alive.
+ */
 
-static int do_name_lookup(const char* name, char* output)
+enum {
+    BufferSize      = 4096,
+    MaxName         = 1024,
+    MaxAddresses    = 16,
+    AddressSize     = 1 + 4 + 16,
+    RequestHeader   = 4 + 1,
+    ReplyHeader     = 4 + 1 + 1,
+};
+
+enum {
+    StatusOk,
+    StatusNxdomain,
+    StatusNodata,
+    StatusFailure,
+};
+
+enum {
+    FamilyIpv4  = 1 << 0,
+    FamilyIpv6  = 1 << 1,
+};
+
+static int do_name_lookup(const char* name, unsigned int families, unsigned char* output, unsigned int* count)
 {
-    struct sockaddr_in addr;
-    struct hostent* he;
-
-    if (strlen(name) < 3)
-        return -2;
+    struct addrinfo hints;
+    struct addrinfo* result;
+
+    *count = 0;
+
+    if (!*name)
+        return StatusFailure;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;    // one of each address
+    hints.ai_family   = families == FamilyIpv4 ? AF_INET
+                      : families == FamilyIpv6 ? AF_INET6
+                      : AF_UNSPEC;
+
+    const int err = getaddrinfo(name, 0, &hints, &result);
+
+    switch (err) {
+    case 0:
+        break;
+    case EAI_NONAME:
+        return StatusNxdomain;
+#ifdef EAI_NODATA
+    case EAI_NODATA:
+    case EAI_ADDRFAMILY:
+        return StatusNodata;
+#endif
+    default:
+        return StatusFailure;
+    }
 
-    if (!(he =gethostbyname(name)))
-        return h_errno;
+    for (const struct addrinfo* ai = result; ai && *count < MaxAddresses; ai = ai->ai_next)
+    {
+        unsigned char* out = output + *count * AddressSize;
+        const uint32_t ttl = 0xffffffff;
 
-    // DNS was somewhat successful
+        memset(out, 0, AddressSize);
+        memcpy(out + 1, &ttl, 4);
 
-    if (he->h_addrtype != AF_INET || he->h_length != 4)
-        return -1;
+        if (ai->ai_family == AF_INET) {
+            out[0] = 4;
+            memcpy(out + 5, &((const struct sockaddr_in*) ai->ai_addr)->sin_addr, 4);
+        }
+        else if (ai->ai_family == AF_INET6) {
+            out[0] = 6;
+            memcpy(out + 5, &((const struct sockaddr_in6*) ai->ai_addr)->sin6_addr, 16);
+        }
+        else
+            continue;
 
-    memcpy(&addr.sin_addr, he->h_addr_list[0], 4);
+        ++*count;
+    }
 
-    strcpy(output, inet_ntoa(addr.sin_addr));
-    strcat(output, "\n");
+    freeaddrinfo(result);
 
-    return 0;
+    return *count ? StatusOk : StatusNodata;
 }
 
-static int write_output(const char* buffer)
+static int write_output(const unsigned char* buffer, unsigned int len)
 {
-    const int len = strlen(buffer);
-
-    for (int written = 0; written < len; )
+    for (unsigned int written = 0; written < len; )
     {
         const int i = write(STDOUT_FILENO, &buffer[written], len-written);
 
         if (i <= 0) {
+            if (errno == EINTR)
+                continue;
             if (errno != EPIPE)
                 perror("dns-service:write");
             return -1;
@@ -57,22 +128,41 @@ static int write_output(const char* buffer)
     return 0;
 }
 
+static int answer(const unsigned char* request, unsigned int size)
+{
+    unsigned char output[2 + ReplyHeader + MaxAddresses * AddressSize];
+    char name[MaxName + 1];
+    unsigned int count;
+
+    const unsigned int name_len = size - RequestHeader;
+
+    memcpy(name, request + RequestHeader, name_len);
+    name[name_len] = 0;
+
+    const int status = do_name_lookup(name, request[4], output + 2 + ReplyHeader, &count);
+
+    const uint16_t reply_size = ReplyHeader + count * AddressSize;
+
+    memcpy(output, &reply_size, 2);
+    memcpy(output + 2, request, 4);     // id
+    output[6] = status;
+    output[7] = count;
+
+    return write_output(output, 2 + reply_size);
+}
+
 int main(void)
 {
-    char input_buffer[BufferSize];
-    int i, ilen = 0;
-    char output_buffer[BufferSize];
-    char* output_ptr;
-    char* inptr;
+    unsigned char input_buffer[BufferSize];
+    unsigned int ilen = 0;
 
     for (;;)
     {
-        if (BufferSize == ilen)
-            ilen = 0;
-
-        i = read(STDIN_FILENO, &input_buffer[ilen], BufferSize-ilen);
+        const int i = read(STDIN_FILENO, &input_buffer[ilen], BufferSize-ilen);
         if (!i) break;
         else if (i < 0) {
+            if (errno == EINTR)
+                continue;
             perror("dns-service:read");
             return 1;
         }
@@ -80,27 +170,32 @@ int main(void)
 
         //
 
-        while ((inptr =memchr(input_buffer, '\n', ilen)))
-        {
-            *inptr = 0;
-
-            if (do_name_lookup(input_buffer, output_buffer) == 0)
-                output_ptr = output_buffer;
-            else
-                output_ptr = "\n";
+        unsigned int consumed = 0;
 
-            //
+        while (ilen - consumed >= 2)
+        {
+            uint16_t size;
+            memcpy(&size, &input_buffer[consumed], 2);
 
-            if (write_output(output_ptr) != 0)
+            if (size < RequestHeader
+                || size > RequestHeader + MaxName)
+            {
+                fprintf(stderr, "dns-service: invalid request\n");
                 return 2;
+            }
+
+            if (ilen - consumed < 2u + size)
+                break;
 
-            //
+            if (answer(&input_buffer[consumed + 2], size) != 0)
+                return 3;
 
-            ++inptr;
-            ilen -= (inptr - input_buffer);
-            if (ilen)
-                memmove(input_buffer, inptr, ilen);
+            consumed += 2 + size;
         }
+
+        ilen -= consumed;
+        if (ilen)
+            memmove(input_buffer, &input_buffer[consumed], ilen);
     }
 
     return 0;
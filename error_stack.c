@@ -264,11 +264,16 @@ const char* fde_context_id_to_name(fde_context_id_t context)
     case fdu_context_aac:         return "utils auto-accept connection";
     case fdu_context_bufio:       return "utils buf-io";
     case fdu_context_can:         return "driver CANbus";
+    case fdu_context_compress:    return "utils compression";
     case fdu_context_connect:     return "utils connect";
+    case fdu_context_dgram:       return "driver datagram";
     case fdu_context_dnsserv:     return "utils dns service";
+    case fdu_context_framing:     return "utils framing";
     case fdu_context_http:        return "driver HTTP";
     case fdu_context_listen:      return "utils listen";
     case fdu_context_pidfile:     return "utils pid file";
+    case fdu_context_pool:        return "utils connection pool";
+    case fdu_context_resolver:    return "utils resolver";
     case fdu_context_s11n:        return "driver s11n";
     case fdu_context_safe:        return "utils safe functions";
     case fdu_context_signalfd:    return "utils signalfd";
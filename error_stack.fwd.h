@@ -14,11 +14,16 @@ typedef enum {
     fdu_context_aac,
     fdu_context_bufio,
     fdu_context_can,
+    fdu_context_compress,
     fdu_context_connect,
+    fdu_context_dgram,
     fdu_context_dnsserv,
+    fdu_context_framing,
     fdu_context_http,
     fdu_context_listen,
     fdu_context_pidfile,
+    fdu_context_pool,
+    fdu_context_resolver,
     fdu_context_s11n,
     fdu_context_safe,
     fdu_context_signalfd,
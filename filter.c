@@ -0,0 +1,552 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "filter.h"
+#include "error_stack.h"
+#include "generic.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+enum { this_error_context = fdb_context_filter };
+
+typedef enum {
+    filter_transform,
+    filter_inspect,
+} fdu_filter_stage_type;
+
+struct fdu_filter_stage_ {
+    fdu_filter_stage_type type;
+    fdu_filter_stage* next;
+
+    union {
+        fdu_filter_transform_func transform;
+        fdu_filter_inspect_func inspect;
+    };
+    void* context;
+
+    fdu_bufio_buffer buffer;            // transform: output, unless last in chain
+    unsigned int seen;                  // inspect: front bytes of the input already seen
+};
+
+struct fdu_filter_ {
+    fdu_bufio_buffer* source;
+    fdu_bufio_buffer* sink;
+
+    fdu_filter_stage* first_stage;
+    fdu_filter_stage* last_stage;
+
+    // stages may end up calling fdu_filter_run() or fdu_free_filter() again
+    // through the bufios, those are handled when the outer run finishes
+
+    bool running;
+    bool rerun;
+    bool reflush;
+    bool freed;
+    bool failed;                        // a stage rejected the stream
+
+    // idle flush, see fdu_filter_set_idle_flush()
+
+    unsigned int idle_msec;
+    unsigned int idle_period;           // of the running timer
+    bool idle_timer;
+    bool active;                        // ran since the last tick
+    bool dirty;                         // moved data since the last flush
+};
+
+// ------------------------------------------------------------
+
+static void release_filter(fdu_filter* filter)
+{
+    // idle timer holds a pointer, it will finish the job
+
+    if (filter->idle_timer) {
+        filter->freed = true;
+        return;
+    }
+
+    fdu_filter_stage* stage = filter->first_stage;
+
+    while (stage) {
+        fdu_filter_stage* next = stage->next;
+        free(stage);
+        stage = next;
+    }
+
+    free(filter);
+}
+
+static bool add_stage(fdu_filter* filter, fdu_filter_stage* stage)
+{
+    if (filter->running) {
+        free(stage);
+
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    stage->next = 0;
+
+    if (filter->last_stage) filter->last_stage->next = stage;
+    else                    filter->first_stage = stage;
+    filter->last_stage = stage;
+
+    return true;
+}
+
+// inspect stages in [first, end) watch a buffer that lost 'bytes' from the front
+
+static void consumed(fdu_filter_stage* first, fdu_filter_stage* end, unsigned int bytes)
+{
+    if (!bytes)
+        return;
+
+    for (fdu_filter_stage* stage = first; stage != end; stage = stage->next)
+    {
+        if (stage->type == filter_inspect)
+            stage->seen -= (bytes < stage->seen) ? bytes : stage->seen;
+    }
+}
+
+static bool run_stages(fdu_filter* filter, bool flush, bool* progress)
+{
+    fdu_bufio_buffer* in = filter->source;
+    fdu_filter_stage* watchers = filter->first_stage;       // inspect stages on 'in'
+
+    for (fdu_filter_stage* stage = filter->first_stage; stage; stage = stage->next)
+    {
+        if (stage->type == filter_inspect) {
+            if (in->filled > stage->seen) {
+                if (!stage->inspect(&in->data[stage->seen],
+                                    in->filled - stage->seen,
+                                    stage->context))
+                {
+                    return false;
+                }
+                stage->seen = in->filled;
+            }
+            continue;
+        }
+
+        // last stage writes straight into the sink
+
+        fdu_bufio_buffer* out = stage->next ? &stage->buffer : filter->sink;
+
+        const unsigned int in_before  = in->filled;
+        const unsigned int out_before = out->filled;
+
+        if (!stage->transform(in, out, flush, stage->context))
+            return false;
+
+        FDE_ASSERT( in->filled <= in_before , "transform added input" , false );
+        FDE_ASSERT( out->filled <= out->size , "transform overflow" , false );
+
+        if (in->filled != in_before
+            || out->filled != out_before)
+        {
+            *progress = true;
+        }
+
+        consumed(watchers, stage, in_before - in->filled);
+
+        in = out;
+        watchers = stage->next;
+    }
+
+    if (in != filter->sink) {
+        const unsigned int bytes = fdu_bufio_transfer(filter->sink, in);
+
+        if (bytes) {
+            *progress = true;
+            consumed(watchers, 0, bytes);
+        }
+    }
+
+    return true;
+}
+
+// Data corruption from a stage, with nothing else on the stack, means the
+// stream is invalid (corrupt compressed data, bad framing), not that the
+// process is in trouble. Only this pipeline fails, see run_filter().
+
+static bool stream_failed(const fde_node_t* ectx)
+{
+    return fde_errors() == 1
+        && fde_get_last_error(fde_node_data_corruption_b)
+        && fde_reset_context(this_error_context, ectx);
+}
+
+static bool run_filter(fdu_filter* filter, bool flush, const fde_node_t* ectx)
+{
+    if (filter->failed)
+        return true;
+
+    if (filter->running) {
+        filter->rerun    = true;
+        filter->reflush |= flush;
+        return true;
+    }
+
+    if (!filter->source
+        || !filter->sink)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    filter->running = true;
+    filter->active  = true;
+
+    bool ok;
+    bool progress;
+
+    do {
+        progress = false;
+        flush   |= filter->reflush;
+
+        filter->rerun   = false;
+        filter->reflush = false;
+
+        ok = run_stages(filter, flush, &progress);
+
+        if (flush)          filter->dirty = false;
+        else if (progress)  filter->dirty = true;
+    } while (ok
+             && !filter->freed
+             && (progress || filter->rerun));
+
+    filter->running = false;
+
+    if (!ok
+        && stream_failed(ectx))
+    {
+        filter->failed = true;
+        ok = true;
+    }
+
+    if (filter->freed) {
+        release_filter(filter);
+        return ok;
+    }
+
+    if (!ok)
+        return false;
+
+    if (filter->failed) {
+        // the close callback may free the filter
+        fdu_bufio_close_error(filter->sink, EPROTO);
+        return true;
+    }
+
+    // sink may be idle, source may have stopped reading when it got full
+
+    if (!fdu_bufio_is_closed(filter->sink)
+        && !fdu_bufio_is_empty(filter->sink)
+        && !fdu_bufio_touch(filter->sink))
+    {
+        return false;
+    }
+
+    return fdu_bufio_is_closed(filter->source)
+        || fdu_bufio_touch(filter->source);
+}
+
+static bool filter_idle_tick(void* filter_v, int UNUSED(id))
+{
+    fdu_filter* filter = (fdu_filter*) filter_v;
+
+    if (filter->freed
+        || filter->idle_msec != filter->idle_period)
+    {
+        filter->idle_timer = false;
+
+        if (filter->freed)
+            release_filter(filter);
+        else if (filter->idle_msec
+                 && fdd_add_timer(&filter_idle_tick, filter, 0,
+                                  filter->idle_msec, filter->idle_msec))
+        {
+            filter->idle_period = filter->idle_msec;
+            filter->idle_timer  = true;
+        }
+
+        fde_push_context(this_error_context);
+        fde_push_consistency_failure_id(fde_consistency_kill_recurring_timer);
+        return false;
+    }
+
+    // flushed after a full quiet period
+
+    if (filter->active) {
+        filter->active = false;
+        return true;
+    }
+
+    if (!filter->dirty
+        || filter->running
+        || !filter->source
+        || !filter->sink
+        || fdu_bufio_is_closed(filter->sink))
+    {
+        return true;
+    }
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    return run_filter(filter, true, ectx)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+fdu_filter* fdu_new_filter(void)
+{
+    fdu_filter* filter = malloc(sizeof(fdu_filter));
+
+    if (!filter) {
+        fde_push_context(this_error_context);
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    filter->source      = 0;
+    filter->sink        = 0;
+    filter->first_stage = 0;
+    filter->last_stage  = 0;
+    filter->running     = false;
+    filter->rerun       = false;
+    filter->reflush     = false;
+    filter->freed       = false;
+    filter->failed      = false;
+    filter->idle_msec   = 0;
+    filter->idle_period = 0;
+    filter->idle_timer  = false;
+    filter->active      = false;
+    filter->dirty       = false;
+
+    return filter;
+}
+
+void fdu_free_filter(fdu_filter* filter)
+{
+    if (!filter)
+        return;
+
+    if (filter->running) {
+        filter->freed = true;
+        return;
+    }
+
+    release_filter(filter);
+}
+
+bool fdu_filter_connect(fdu_filter* filter,
+                        fdu_bufio_buffer* source,
+                        fdu_bufio_buffer* sink)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter
+        || !source
+        || !sink
+        || filter->running)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    filter->source = source;
+    filter->sink   = sink;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_filter_set_idle_flush(fdu_filter* filter, const unsigned int msec)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter
+        || filter->freed)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    filter->idle_msec = msec;
+
+    // a running timer picks up the change on its next tick
+
+    if (msec
+        && !filter->idle_timer)
+    {
+        if (!fdd_add_timer(&filter_idle_tick, filter, 0, msec, msec))
+            return false;
+
+        filter->idle_period = msec;
+        filter->idle_timer  = true;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_filter_add_transform(fdu_filter* filter,
+                              const unsigned int buffer_size,
+                              const fdu_filter_transform_func transform,
+                              void* const context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter
+        || !buffer_size
+        || !transform)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    unsigned char* const allocated = malloc(sizeof(fdu_filter_stage) + buffer_size);
+
+    if (!allocated) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    unsigned char* counter = allocated;
+
+    const fdu_memory_area
+        stage_memory  = init_memory_area_cont(&counter, sizeof(fdu_filter_stage)),
+        buffer_memory = init_memory_area_cont(&counter, buffer_size);
+
+    fdu_filter_stage* stage = (fdu_filter_stage*) stage_memory.begin;
+
+    stage->type      = filter_transform;
+    stage->transform = transform;
+    stage->context   = context;
+    stage->seen      = 0;
+
+    // plain memory, not attached to any fd
+
+    stage->buffer.fd       = -1;
+    stage->buffer.can_xfer = false;
+    stage->buffer.data     = buffer_memory.begin;
+    stage->buffer.size     = buffer_size;
+    stage->buffer.filled   = 0;
+    stage->buffer.service  = 0;
+
+    return add_stage(filter, stage)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_filter_add_inspect(fdu_filter* filter,
+                            const fdu_filter_inspect_func inspect,
+                            void* const context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter
+        || !inspect)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    fdu_filter_stage* stage = malloc(sizeof(fdu_filter_stage));
+
+    if (!stage) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    stage->type    = filter_inspect;
+    stage->inspect = inspect;
+    stage->context = context;
+    stage->seen    = 0;
+
+    stage->buffer.fd       = -1;
+    stage->buffer.can_xfer = false;
+    stage->buffer.data     = 0;
+    stage->buffer.size     = 0;
+    stage->buffer.filled   = 0;
+    stage->buffer.service  = 0;
+
+    return add_stage(filter, stage)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+bool fdu_filter_run(fdu_filter* filter)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    return run_filter(filter, false, ectx)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_filter_flush(fdu_filter* filter)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    return run_filter(filter, true, ectx)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_filter_notify(fdu_bufio_buffer* UNUSED(buffer), void* filter_v)
+{
+    fdu_filter* filter = (fdu_filter*) filter_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!filter
+        || !filter->sink)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (filter->failed
+        || fdu_bufio_is_closed(filter->sink))
+    {
+        fde_safe_pop_context(this_error_context, ectx);
+        return false;
+    }
+
+    return run_filter(filter, false, ectx)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
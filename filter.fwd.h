@@ -0,0 +1,9 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+typedef struct fdu_filter_       fdu_filter;
+typedef struct fdu_filter_stage_ fdu_filter_stage;
@@ -0,0 +1,82 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include "filter.fwd.h"
+#include "utils.h"
+
+#include <stdbool.h>
+
+/*
+  Filter pipeline
+
+  'fdu_filter' moves data from a source buffer (usually an input bufio) to a
+  sink buffer (usually an output bufio) through a chain of stages:
+
+  TRANSFORM stages consume from the previous buffer with fdu_bufio_consume()
+  and produce into the free space of the next one ('data' + 'filled' up to
+  'size'). Every transform stage but the last has its own buffer of
+  'buffer_size' bytes; the last one writes straight into the sink. 'flush' is
+  set when the stage should emit everything it is holding back (compressor
+  state, partial frames).
+
+  INSPECT stages see every byte that passes at their position in the chain
+  but don't copy or change anything (checksums, meters). Each byte is seen
+  exactly once.
+
+  If there are no transform stages (or there are inspect stages after the
+  last one), data is copied to the sink with fdu_bufio_transfer().
+
+  Stages run only from fdu_filter_run(). fdu_filter_notify() is a
+  fdu_bufio_notify_func that does just that: give it to both the source and
+  the sink bufio with the filter as context and the pipeline runs whenever
+  data moves at either end. It returns false if the sink is closed.
+
+  fdu_filter_flush() runs the chain with 'flush' set, e.g. when the source
+  has closed. With fdu_filter_set_idle_flush() that is done automatically
+  once data has moved and then nothing has happened for 'msec' to 2*'msec'.
+  Data pointers must not be kept over returns from stages.
+
+  A stage that finds its input invalid pushes fde_push_data_corruption() and
+  returns false. That fails only this pipeline: the error is dropped, the
+  sink is closed with EPROTO for its close callback and the filter does
+  nothing after that (fdu_filter_notify() returns false). Other errors are
+  passed up as usual.
+
+  The filter refers to its bufios, free it (or connect it elsewhere) before
+  freeing them.
+*/
+
+typedef bool (*fdu_filter_transform_func)(fdu_bufio_buffer* in,
+                                          fdu_bufio_buffer* out,
+                                          bool flush,
+                                          void* context);
+
+typedef bool (*fdu_filter_inspect_func)(const unsigned char* data,
+                                        unsigned int size,
+                                        void* context);
+
+//
+
+fdu_filter* fdu_new_filter(void);
+void fdu_free_filter(fdu_filter*);
+
+bool fdu_filter_connect(fdu_filter*, fdu_bufio_buffer* source, fdu_bufio_buffer* sink);
+
+bool fdu_filter_set_idle_flush(fdu_filter*, unsigned int msec);     // 0 = off
+
+bool fdu_filter_add_transform(fdu_filter*,
+                              unsigned int buffer_size,
+                              fdu_filter_transform_func,
+                              void* context);
+bool fdu_filter_add_inspect(fdu_filter*,
+                            fdu_filter_inspect_func,
+                            void* context);
+
+bool fdu_filter_run(fdu_filter*);
+bool fdu_filter_flush(fdu_filter*);
+
+bool fdu_filter_notify(fdu_bufio_buffer*, void* filter);
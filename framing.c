@@ -0,0 +1,663 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "framing.h"
+#include "error_stack.h"
+#include "s11n.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
+enum { this_error_context = fdu_context_framing };
+
+enum {
+    FramingBatch      = 256,            // delimiter offsets per scan
+    VarintMaximumSize = 10,
+    DefaultMaxFrame   = 16 << 20,       // bounds the spill allocation
+};
+
+typedef enum {
+    framing_delimited,
+    framing_length,
+} fdu_framing_type;
+
+struct fdu_framing_ {
+    fdu_framing_type type;
+
+    fdu_framing_record_func record;
+    void* context;
+
+    unsigned int max_record;
+    unsigned int scanned;               // front bytes known to hold no delimiter
+
+    // delimited
+
+    unsigned char delimiter;
+    unsigned int offsets[FramingBatch];
+
+    // length-prefixed, frames that don't fit the buffer are collected in 'spill'
+
+    fdu_framing_header_t header;
+
+    unsigned char* spill;
+    unsigned int spill_size;
+    unsigned int spill_filled;
+};
+
+// ------------------------------------------------------------
+//
+// Delimiter scanning. The vector loops compare a whole register of bytes at
+// a time and walk the match mask, the tail is done byte by byte.
+
+typedef unsigned int (*scan_func)(const unsigned char*, unsigned int,
+                                  unsigned char, unsigned int*, unsigned int);
+
+static unsigned int scan_scalar(const unsigned char* data,
+                                const unsigned int size,
+                                const unsigned char delimiter,
+                                unsigned int* offsets,
+                                const unsigned int max,
+                                unsigned int i,
+                                unsigned int count)
+{
+    for (; i < size && count < max; ++i)
+    {
+        const unsigned char* p = memchr(&data[i], delimiter, size - i);
+
+        if (!p)
+            break;
+
+        i = p - data;
+        offsets[count++] = i;
+    }
+
+    return count;
+}
+
+#if defined(__x86_64__)
+
+static unsigned int scan_sse2(const unsigned char* data,
+                              const unsigned int size,
+                              const unsigned char delimiter,
+                              unsigned int* offsets,
+                              const unsigned int max)
+{
+    const __m128i needle = _mm_set1_epi8((char) delimiter);
+
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i block = _mm_loadu_si128((const __m128i*) &data[i]);
+        unsigned int mask   = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+        for (; mask; mask &= mask - 1) {
+            if (count == max)
+                return count;
+            offsets[count++] = i + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_scalar(data, size, delimiter, offsets, max, i, count);
+}
+
+__attribute__((target("avx2")))
+static unsigned int scan_avx2(const unsigned char* data,
+                              const unsigned int size,
+                              const unsigned char delimiter,
+                              unsigned int* offsets,
+                              const unsigned int max)
+{
+    const __m256i needle = _mm256_set1_epi8((char) delimiter);
+
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i block = _mm256_loadu_si256((const __m256i*) &data[i]);
+        unsigned int mask   = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+        for (; mask; mask &= mask - 1) {
+            if (count == max)
+                return count;
+            offsets[count++] = i + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_scalar(data, size, delimiter, offsets, max, i, count);
+}
+
+static scan_func select_scan(void)
+{
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2")
+        ? &scan_avx2
+        : &scan_sse2;
+}
+
+#else
+
+static unsigned int scan_generic(const unsigned char* data,
+                                 const unsigned int size,
+                                 const unsigned char delimiter,
+                                 unsigned int* offsets,
+                                 const unsigned int max)
+{
+    return scan_scalar(data, size, delimiter, offsets, max, 0, 0);
+}
+
+static scan_func select_scan(void)
+{
+    return &scan_generic;
+}
+
+#endif
+
+unsigned int fdu_framing_scan(const unsigned char* data,
+                              const unsigned int size,
+                              const unsigned char delimiter,
+                              unsigned int* offsets,
+                              const unsigned int max)
+{
+    static scan_func scan = 0;
+
+    if (!scan)
+        scan = select_scan();
+
+    if (!data
+        || !offsets)
+    {
+        return 0;
+    }
+
+    return scan(data, size, delimiter, offsets, max);
+}
+
+// ------------------------------------------------------------
+
+// Bad input is the peer's error, not ours: only this bufio is closed, with
+// EPROTO for its close callback. Nothing must touch 'framing' after this,
+// the close callback may free it.
+
+static bool reject_stream(fdu_bufio_buffer* buffer)
+{
+    fdu_bufio_close_error(buffer, EPROTO);
+    return true;
+}
+
+// fdu_bufio_reserve() that leaves nothing on the error stack: a grow that
+// fails, for any reason, only means there is no more room for this stream.
+
+static bool reserve_room(fdu_bufio_buffer* buffer, unsigned int bytes)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    const bool reserved = fdu_bufio_reserve(buffer, bytes);
+
+    if (!reserved)
+        fde_reset_context(this_error_context, ectx);
+
+    fde_pop_context(this_error_context, ectx);
+    return reserved;
+}
+
+static bool deliver_delimited(fdu_framing* framing, fdu_bufio_buffer* buffer)
+{
+    unsigned char* const data = buffer->data;
+    const unsigned int filled = buffer->filled;
+
+    unsigned int start = 0;             // of the current record
+    unsigned int from  = framing->scanned;
+
+    for (;;)
+    {
+        const unsigned int count = fdu_framing_scan(&data[from], filled - from,
+                                                    framing->delimiter,
+                                                    framing->offsets, FramingBatch);
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            const unsigned int end = from + framing->offsets[i];
+
+            if (end - start > framing->max_record)
+                return reject_stream(buffer);        // record too long
+
+            if (!framing->record(framing->context, &data[start], &data[end]))
+                return false;
+
+            start = end + 1;
+        }
+
+        if (count < FramingBatch)
+            break;
+
+        from = start;
+    }
+
+    // once per batch
+
+    if (start)
+        fdu_bufio_consume(buffer, start);
+
+    framing->scanned = buffer->filled;
+
+    if (buffer->filled > framing->max_record
+        || (buffer->filled
+            && buffer->filled == buffer->size
+            && !reserve_room(buffer, 1)))
+    {
+        return reject_stream(buffer);                // record too long
+    }
+
+    return true;
+}
+
+// =1: complete header, =0: need more data, <0: corrupted
+
+static int parse_header(const fdu_framing* framing,
+                        const unsigned char* data,
+                        const unsigned char* const end,
+                        uint64_t* length,
+                        unsigned int* header_size)
+{
+    const unsigned char* const start = data;
+
+    uint8_t  value8;
+    uint16_t value16;
+    uint32_t value32;
+
+    // sizes are checked first, s11n would push an underflow error
+
+    switch (framing->header) {
+    case fdu_framing_uint8:
+        if (end - data < 1 || !fdu_s11n_read_uint8(&value8, &data, end))
+            return 0;
+        *length = value8;
+        break;
+    case fdu_framing_uint16:
+        if (end - data < 2 || !fdu_s11n_read_uint16(&value16, &data, end))
+            return 0;
+        *length = value16;
+        break;
+    case fdu_framing_uint32:
+        if (end - data < 4 || !fdu_s11n_read_uint32(&value32, &data, end))
+            return 0;
+        *length = value32;
+        break;
+    case fdu_framing_varint:
+        {
+            const unsigned int available = end - data;
+            const unsigned int limit     = (available < VarintMaximumSize) ? available : VarintMaximumSize;
+
+            unsigned int i = 0;
+            while (i < limit && (data[i] & 0x80))
+                ++i;
+
+            if (i == limit)
+                return (limit == VarintMaximumSize) ? -1 : 0;
+
+            if (!fdu_s11n_read_varint(length, &data, end))
+                return -1;
+        }
+        break;
+    }
+
+    *header_size = data - start;
+    return 1;
+}
+
+static bool deliver_spill(fdu_framing* framing, fdu_bufio_buffer* buffer)
+{
+    const unsigned int wanted = framing->spill_size - framing->spill_filled;
+    const unsigned int bytes  = (buffer->filled < wanted) ? buffer->filled : wanted;
+
+    memcpy(&framing->spill[framing->spill_filled], buffer->data, bytes);
+    framing->spill_filled += bytes;
+
+    fdu_bufio_consume(buffer, bytes);
+
+    if (framing->spill_filled < framing->spill_size)
+        return true;
+
+    unsigned char* const spill = framing->spill;
+
+    framing->spill = 0;
+
+    const bool ok = framing->record(framing->context, spill, spill + framing->spill_size);
+
+    free(spill);
+    return ok;
+}
+
+static bool deliver_length(fdu_framing* framing, fdu_bufio_buffer* buffer)
+{
+    if (framing->spill) {
+        if (!deliver_spill(framing, buffer))
+            return false;
+        if (framing->spill)
+            return true;
+    }
+
+    unsigned char* const data = buffer->data;
+    const unsigned int filled = buffer->filled;
+
+    unsigned int start = 0;             // of the current frame
+    uint64_t length    = 0;
+    unsigned int header_size = 0;
+    int parsed;
+
+    while ((parsed = parse_header(framing, &data[start], &data[filled], &length, &header_size)) > 0)
+    {
+        if (length > framing->max_record)
+            return reject_stream(buffer);            // frame too long
+
+        if (filled - start - header_size < length)
+            break;
+
+        unsigned char* const payload = &data[start + header_size];
+
+        if (!framing->record(framing->context, payload, payload + length))
+            return false;
+
+        start += header_size + length;
+    }
+
+    if (parsed < 0)
+        return reject_stream(buffer);                // invalid frame header
+
+    // once per batch
+
+    if (start)
+        fdu_bufio_consume(buffer, start);
+
+    if (parsed == 0)
+        return true;
+
+    // incomplete frame, make sure it will fit
+
+    const uint64_t frame_size = header_size + length;
+
+    if (frame_size <= buffer->size)
+        return true;
+
+    // fails if the buffer can't grow that much, the frame is spilled then
+
+    reserve_room(buffer, frame_size - buffer->filled);
+
+    if (frame_size <= buffer->size)
+        return true;
+
+    if (!(framing->spill = malloc(length ? length : 1))) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    framing->spill_size   = length;
+    framing->spill_filled = 0;
+
+    fdu_bufio_consume(buffer, header_size);
+
+    return deliver_spill(framing, buffer);
+}
+
+bool fdu_framing_notify(fdu_bufio_buffer* buffer, void* framing_v)
+{
+    fdu_framing* framing = (fdu_framing*) framing_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!buffer
+        || !framing)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (framing->scanned > buffer->filled)      // consumed by someone else
+        framing->scanned = 0;
+
+    bool ok = false;
+
+    switch (framing->type) {
+    case framing_delimited: ok = deliver_delimited(framing, buffer); break;
+    case framing_length: ok = deliver_length(framing, buffer); break;
+    }
+
+    return ok
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+fdu_framing* fdu_new_delimited_framing(const unsigned char delimiter,
+                                       const unsigned int max_record,
+                                       const fdu_framing_record_func record_callback,
+                                       void* const context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return 0;
+    //
+    if (!record_callback) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    fdu_framing* framing = malloc(sizeof(fdu_framing));
+
+    if (!framing) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    framing->type       = framing_delimited;
+    framing->record     = record_callback;
+    framing->context    = context;
+    framing->max_record = max_record ? max_record : UINT32_MAX;
+    framing->scanned    = 0;
+    framing->delimiter  = delimiter;
+    framing->header     = fdu_framing_uint8;
+    framing->spill      = 0;
+
+    if (!fde_safe_pop_context(this_error_context, ectx)) {
+        free(framing);
+        return 0;
+    }
+
+    return framing;
+}
+
+fdu_framing* fdu_new_length_framing(const fdu_framing_header_t header,
+                                    const unsigned int max_frame,
+                                    const fdu_framing_record_func frame_callback,
+                                    void* const context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return 0;
+    //
+    if (!frame_callback
+        || (header != fdu_framing_uint8
+            && header != fdu_framing_uint16
+            && header != fdu_framing_uint32
+            && header != fdu_framing_varint))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    fdu_framing* framing = malloc(sizeof(fdu_framing));
+
+    if (!framing) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    framing->type       = framing_length;
+    framing->record     = frame_callback;
+    framing->context    = context;
+    framing->max_record = max_frame ? max_frame : DefaultMaxFrame;
+    framing->scanned    = 0;
+    framing->delimiter  = 0;
+    framing->header     = header;
+    framing->spill      = 0;
+
+    if (!fde_safe_pop_context(this_error_context, ectx)) {
+        free(framing);
+        return 0;
+    }
+
+    return framing;
+}
+
+void fdu_free_framing(fdu_framing* framing)
+{
+    if (!framing)
+        return;
+
+    free(framing->spill);
+    free(framing);
+}
+
+// ------------------------------------------------------------
+//
+// Output: the header is reserved before the payload is written and filled in
+// afterwards. A varint header takes one byte up front, longer ones move the
+// payload forward.
+
+static unsigned int reserved_header_size(fdu_framing_header_t header)
+{
+    return (header == fdu_framing_varint) ? 1 : (unsigned int) header;
+}
+
+bool fdu_framing_begin_frame(fdu_bufio_buffer* out,
+                             const fdu_framing_header_t header,
+                             unsigned int* mark)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!out
+        || !mark
+        || (header != fdu_framing_uint8
+            && header != fdu_framing_uint16
+            && header != fdu_framing_uint32
+            && header != fdu_framing_varint))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    const unsigned int size = reserved_header_size(header);
+
+    if (!fdu_bufio_reserve(out, size)
+        || out->size - out->filled < size)
+    {
+        fde_push_resource_failure_id(fde_resource_buffer_overflow);
+        return false;
+    }
+
+    *mark = out->filled;
+    out->filled += size;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_framing_end_frame(fdu_bufio_buffer* out,
+                           const fdu_framing_header_t header,
+                           const unsigned int mark)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    const unsigned int reserved = reserved_header_size(header);
+
+    if (!out
+        || mark + reserved > out->filled)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    const unsigned int length = out->filled - mark - reserved;
+
+    unsigned char* data = &out->data[mark];
+    const unsigned char* const end = &out->data[out->size];
+
+    bool ok = false;
+
+    switch (header) {
+    case fdu_framing_uint8:
+        {
+            const uint8_t value = length;
+            ok = (length <= UINT8_MAX
+                  && fdu_s11n_write_uint8(&value, &data, end));
+        }
+        break;
+    case fdu_framing_uint16:
+        {
+            const uint16_t value = length;
+            ok = (length <= UINT16_MAX
+                  && fdu_s11n_write_uint16(&value, &data, end));
+        }
+        break;
+    case fdu_framing_uint32:
+        {
+            const uint32_t value = length;
+            ok = fdu_s11n_write_uint32(&value, &data, end);
+        }
+        break;
+    case fdu_framing_varint:
+        {
+            const uint64_t value = length;
+            const unsigned int extra = fdu_s11n_varint_size(value) - reserved;
+
+            if (extra) {
+                if (!fdu_bufio_reserve(out, extra)
+                    || out->size - out->filled < extra)
+                {
+                    fde_push_resource_failure_id(fde_resource_buffer_overflow);
+                    return false;
+                }
+
+                // reserve may have moved the buffer
+                data = &out->data[mark];
+
+                memmove(data + reserved + extra, data + reserved, length);
+                out->filled += extra;
+            }
+
+            ok = fdu_s11n_write_varint(&value, &data, &out->data[out->size]);
+        }
+        break;
+    }
+
+    if (!ok) {
+        fde_push_consistency_failure("frame too long for its header");
+        return false;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
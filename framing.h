@@ -0,0 +1,84 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include "utils.h"
+
+#include <stdbool.h>
+
+/*
+  Record framing over fdu_bufio_buffer
+
+  'fdu_framing' splits the data of an input bufio into records and calls
+  'record_callback' for each complete one. fdu_framing_notify() is a
+  fdu_bufio_notify_func, create the bufio with it and the framing as
+  context. Records are passed in place, [start, end) excluding the
+  delimiter; *end may be overwritten (e.g. with 0). The buffer is compacted
+  once after all complete records of a notify have been delivered.
+
+  A record that doesn't fit in 'max_record' bytes (or in the buffer) closes
+  the bufio with EPROTO for its close callback, nothing is pushed on the
+  error stack. Returning false from 'record_callback' closes the bufio as
+  well.
+
+  fdu_framing_scan() is the delimiter search used underneath: it stores the
+  offsets of up to 'max' delimiters in 'offsets' and returns their count. It
+  uses AVX2 when the CPU has it, SSE2 otherwise.
+
+  LENGTH-PREFIXED: fdu_new_length_framing() reads frames of a length header
+  followed by that many payload bytes. The header is an unsigned integer of
+  1, 2 or 4 bytes, read with s11n (fdu_s11n_set_endianness() applies), or a
+  LEB128 varint. Each payload is passed in place, [start, end). A frame that
+  doesn't fit the buffer even after growing it is collected into a separate
+  allocation and passed from there. A frame longer than 'max_frame' (16 MiB
+  if 0 is given) or an invalid header closes the bufio with EPROTO, as
+  above.
+
+  For output, fdu_framing_begin_frame() reserves room for the header and
+  fdu_framing_end_frame() fills in the length of everything appended in
+  between. A varint header is reserved as one byte; if the length needs more,
+  the payload is moved forward.
+*/
+
+typedef struct fdu_framing_ fdu_framing;
+
+typedef enum {
+    fdu_framing_uint8  = 1,
+    fdu_framing_uint16 = 2,
+    fdu_framing_uint32 = 4,
+    fdu_framing_varint = 8,
+} fdu_framing_header_t;
+
+typedef bool (*fdu_framing_record_func)(void* context,
+                                        unsigned char* start,
+                                        unsigned char* end);
+
+//
+
+fdu_framing* fdu_new_delimited_framing(unsigned char delimiter,
+                                       unsigned int max_record,         // 0 = buffer size
+                                       fdu_framing_record_func record_callback,
+                                       void* context);
+fdu_framing* fdu_new_length_framing(fdu_framing_header_t header,
+                                    unsigned int max_frame,             // 0 = 16 MiB
+                                    fdu_framing_record_func frame_callback,
+                                    void* context);
+void fdu_free_framing(fdu_framing*);
+
+bool fdu_framing_notify(fdu_bufio_buffer*, void* framing);
+
+unsigned int fdu_framing_scan(const unsigned char* data,
+                              unsigned int size,
+                              unsigned char delimiter,
+                              unsigned int* offsets,
+                              unsigned int max);
+
+bool fdu_framing_begin_frame(fdu_bufio_buffer* out,
+                             fdu_framing_header_t header,
+                             unsigned int* mark);
+bool fdu_framing_end_frame(fdu_bufio_buffer* out,
+                           fdu_framing_header_t header,
+                           unsigned int mark);
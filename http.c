@@ -8,22 +8,44 @@
 #include "error_stack.h"
 
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
 
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
 enum { this_error_context = fdu_context_http };
 
+#ifdef FD_DEBUG
+static void check_known_headers(void);
+#endif
+
 //
 
 void fdu_init_http_request_parser(fdu_http_request_parser_t* parser,
                                   void* context,
                                   const fdu_http_ops_t* http_ops)
 {
-    parser->context  = context;
-    parser->http_ops = http_ops;
+    parser->context      = context;
+    parser->http_ops     = http_ops;
+    parser->header_index = 0;
+
+#ifdef FD_DEBUG
+    check_known_headers();
+#endif
+
+    fdu_clear_http_request_parser(parser);
+}
+
+void fdu_set_http_header_index(fdu_http_request_parser_t* parser,
+                               fdu_http_header_index_t* header_index)
+{
+    parser->header_index = header_index;
 
     fdu_clear_http_request_parser(parser);
 }
@@ -32,45 +54,177 @@ void fdu_clear_http_request_parser(fdu_http_request_parser_t* parser)
 {
     parser->parser_state.progress         = fdu_http_progress_request_line;
     parser->parser_state.content_loaded   = 0;
+    parser->parser_state.parsed           = 0;
+    parser->parser_state.chunk_left       = 0;
+    parser->parser_state.chunk_state      = 0;
+
+    if (parser->header_index) {
+        parser->header_index->count = 0;
+        memset(parser->header_index->known, 0, sizeof(parser->header_index->known));
+    }
 
     parser->message_state.method          = 0;
     parser->message_state.version         = 0;
     parser->message_state.closing         = true;
     parser->message_state.content_length  = 0;
+    parser->message_state.has_content_length = false;
+    parser->message_state.chunked         = false;
     parser->message_state.content_type[0] = 0;
 }
 
 // ------------------------------------------------------------
+//
+// Request scanning. The scanners give the offset of the first byte the
+// parser stops at: a line feed, a colon or a character not allowed in the
+// request line or headers (controls other than tab and CR, DEL), 'size' if
+// there's none. The parser tells them apart by looking at the byte.
+
+typedef unsigned int (*http_scan_func)(const unsigned char*, unsigned int);
+
+static const bool scan_event[256] = {
+    [0x00 ... 0x08] = true,             // tab
+    [0x0a ... 0x0c] = true,             // CR
+    [0x0e ... 0x1f] = true,
+    [':']           = true,
+    [0x7f]          = true,
+};
+
+static unsigned int http_scan_scalar(const unsigned char* data,
+                                     const unsigned int size,
+                                     unsigned int i)
+{
+    while (i < size
+           && !scan_event[data[i]])
+    {
+        ++i;
+    }
+
+    return i;
+}
+
+#if defined(__x86_64__)
 
-static void convert_to_lowercase(unsigned char* ptr,
-                                 const unsigned char* const end)
+// controls (LF among them) but tab and CR, colons, DEL
+
+static inline unsigned int scan_mask_sse2(const unsigned char* data)
 {
-    for (;
-         ptr < end;
-         ++ptr)
+    const __m128i block = _mm_loadu_si128((const __m128i*) data);
+
+    const __m128i control = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')),
+                                                          _mm_cmpeq_epi8(block, _mm_set1_epi8('\r'))),
+                                             _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1f)), block));
+    const __m128i events  = _mm_or_si128(control,
+                                         _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(':')),
+                                                      _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f))));
+
+    return _mm_movemask_epi8(events);
+}
+
+static unsigned int http_scan_sse2(const unsigned char* data,
+                                   const unsigned int size)
+{
+    unsigned int i = 0;
+
+    for (; i + 16 <= size; i += 16)
     {
-        if (*ptr < 'A') {
-            continue;
-        }
-        else if (*ptr <= 'Z') {
-            *ptr += 'a' - 'A';
-        }
-        else if (*ptr < 192
-                 || *ptr == 215)
-        {
-            continue;
-        }
-        else if (*ptr <= 222) {
-            *ptr += 224 - 192;
-        }
+        const unsigned int mask = scan_mask_sse2(&data[i]);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
+
+    return http_scan_scalar(data, size, i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int http_scan_avx2(const unsigned char* data,
+                                   const unsigned int size)
+{
+    unsigned int i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i block = _mm256_loadu_si256((const __m256i*) &data[i]);
+
+        const __m256i control = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t')),
+                                                                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r'))),
+                                                    _mm256_cmpeq_epi8(_mm256_min_epu8(block, _mm256_set1_epi8(0x1f)), block));
+        const __m256i events  = _mm256_or_si256(control,
+                                                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')),
+                                                                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7f))));
+
+        const unsigned int mask = _mm256_movemask_epi8(events);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    // lines end near the end of the data, keep the tail short
+
+    if (i + 16 <= size)
+    {
+        const unsigned int mask = scan_mask_sse2(&data[i]);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+
+        i += 16;
+    }
+
+    return http_scan_scalar(data, size, i);
+}
+
+static http_scan_func select_http_scan(void)
+{
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2")
+        ? &http_scan_avx2
+        : &http_scan_sse2;
+}
+
+#else
+
+static unsigned int http_scan_generic(const unsigned char* data,
+                                      const unsigned int size)
+{
+    return http_scan_scalar(data, size, 0);
+}
+
+static http_scan_func select_http_scan(void)
+{
+    return &http_scan_generic;
+}
+
+#endif
+
+// a pointer to the first event between 'start' and 'end', 'end' if none
+
+static unsigned char* http_scan(unsigned char* start,
+                                const unsigned char* const end)
+{
+    static http_scan_func scan = 0;
+
+    if (!scan)
+        scan = select_http_scan();
+
+    return start + scan(start, end - start);
+}
+
+// ------------------------------------------------------------
+
+// optional whitespace, other controls don't get past http_scan()
+
+static inline bool is_ows(unsigned char c)
+{
+    return c == ' ' || c == '\t';
 }
 
 static void strip_ws_start(unsigned char** start,
                            const unsigned char* const end)
 {
     while (*start < end
-           && isspace(**start))
+           && is_ows(**start))
     {
         ++*start;
     }
@@ -80,7 +234,7 @@ static void strip_ws_end(const unsigned char* const start,
                          unsigned char** end)
 {
     while (start < *end
-           && isspace(*(*end - 1)))
+           && is_ows(*(*end - 1)))
     {
         --*end;
     }
@@ -93,12 +247,151 @@ static void strip_ws_both(unsigned char** start, unsigned char** end)
 }
 
 // ------------------------------------------------------------
+//
+// Known header names. The hash of the length and the first and the last
+// letter is unique for all of them, HEADER() puts each in its own slot at
+// compile time: a collision would initialize a slot twice, which
+// -Woverride-init (-Wextra) turns into an error. The letters are given
+// separately because the characters of a string literal aren't constant
+// expressions; a debug build checks them, see check_known_headers().
+
+enum { HeaderTableSize = 128 };
+
+#define HEADER_HASH(length, first, last) \
+    (((length) * 6 + (first) * 31 + (last)) & (HeaderTableSize - 1))
+
+#define HEADER(id, name, first, last) \
+    [HEADER_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, fdu_http_header_##id }
+
+typedef struct {
+    const char*       name;
+    unsigned int      length;
+    fdu_http_header_t id;
+} known_header_t;
+
+static const known_header_t known_headers[HeaderTableSize] = {
+    HEADER(accept,                    "accept",                    'a', 't'),
+    HEADER(accept_charset,            "accept-charset",            'a', 't'),
+    HEADER(accept_encoding,           "accept-encoding",           'a', 'g'),
+    HEADER(accept_language,           "accept-language",           'a', 'e'),
+    HEADER(authorization,             "authorization",             'a', 'n'),
+    HEADER(cache_control,             "cache-control",             'c', 'l'),
+    HEADER(connection,                "connection",                'c', 'n'),
+    HEADER(content_length,            "content-length",            'c', 'h'),
+    HEADER(content_type,              "content-type",              'c', 'e'),
+    HEADER(cookie,                    "cookie",                    'c', 'e'),
+    HEADER(date,                      "date",                      'd', 'e'),
+    HEADER(expect,                    "expect",                    'e', 't'),
+    HEADER(forwarded,                 "forwarded",                 'f', 'd'),
+    HEADER(from,                      "from",                      'f', 'm'),
+    HEADER(host,                      "host",                      'h', 't'),
+    HEADER(if_match,                  "if-match",                  'i', 'h'),
+    HEADER(if_modified_since,         "if-modified-since",         'i', 'e'),
+    HEADER(if_none_match,             "if-none-match",             'i', 'h'),
+    HEADER(if_range,                  "if-range",                  'i', 'e'),
+    HEADER(if_unmodified_since,       "if-unmodified-since",       'i', 'e'),
+    HEADER(keep_alive,                "keep-alive",                'k', 'e'),
+    HEADER(max_forwards,              "max-forwards",              'm', 's'),
+    HEADER(origin,                    "origin",                    'o', 'n'),
+    HEADER(pragma,                    "pragma",                    'p', 'a'),
+    HEADER(range,                     "range",                     'r', 'e'),
+    HEADER(referer,                   "referer",                   'r', 'r'),
+    HEADER(te,                        "te",                        't', 'e'),
+    HEADER(trailer,                   "trailer",                   't', 'r'),
+    HEADER(transfer_encoding,         "transfer-encoding",         't', 'g'),
+    HEADER(upgrade,                   "upgrade",                   'u', 'e'),
+    HEADER(upgrade_insecure_requests, "upgrade-insecure-requests", 'u', 's'),
+    HEADER(user_agent,                "user-agent",                'u', 't'),
+    HEADER(via,                       "via",                       'v', 'a'),
+    HEADER(x_forwarded_for,           "x-forwarded-for",           'x', 'r'),
+    HEADER(x_forwarded_host,          "x-forwarded-host",          'x', 't'),
+    HEADER(x_forwarded_proto,         "x-forwarded-proto",         'x', 'o'),
+    HEADER(x_real_ip,                 "x-real-ip",                 'x', 'p'),
+    HEADER(x_requested_with,          "x-requested-with",          'x', 'h'),
+};
+
+#undef HEADER
+
+static inline unsigned char ascii_lowercase(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+fdu_http_header_t fdu_http_header_id(const unsigned char* name,
+                                     unsigned int length)
+{
+    if (!length)
+        return fdu_http_header_unknown;
+
+    const known_header_t* header = &known_headers[HEADER_HASH(length,
+                                                              ascii_lowercase(name[0]),
+                                                              ascii_lowercase(name[length - 1]))];
+
+    if (header->length != length)
+        return fdu_http_header_unknown;
+
+    for (unsigned int i = 0; i < length; ++i)
+    {
+        if (ascii_lowercase(name[i]) != (unsigned char) header->name[i])
+            return fdu_http_header_unknown;
+    }
+
+    return header->id;
+}
+
+#ifdef FD_DEBUG
+// A wrong letter puts the entry in a slot its name doesn't hash to, and the
+// header would silently be unknown.
+
+static void check_known_headers(void)
+{
+    static bool checked = false;
+
+    if (checked)
+        return;
+
+    unsigned int found = 0;
+
+    for (unsigned int i = 0; i < HeaderTableSize; ++i)
+    {
+        const known_header_t* const header = &known_headers[i];
+
+        if (!header->name)
+            continue;
+
+        if (fdu_http_header_id((const unsigned char*) header->name, header->length) != header->id)
+            abort();
+
+        ++found;
+    }
+
+    if (found != fdu_http_header_count - 1)     // all but unknown
+        abort();
+
+    checked = true;
+}
+#endif
+
+// ------------------------------------------------------------
+
+// the value is not NUL-terminated with a header index
+
+static bool value_is(const unsigned char* start,
+                     const unsigned char* end,
+                     const char* value)
+{
+    const size_t length = strlen(value);
+
+    return (size_t)(end - start) == length
+        && strncasecmp((const char*)start, value, length) == 0;
+}
 
 static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
+                                  const unsigned char* request,
                                   unsigned char* startOfName,
+                                  unsigned char* endOfName,         // the colon, from http_scan()
                                   unsigned char* endOfContent)
 {
-    unsigned char* endOfName = memchr(startOfName, ':', endOfContent-startOfName);
     if (!endOfName) {
         fde_push_http_error("Corrupted header line", 400);
         return false;
@@ -113,33 +406,49 @@ static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
         return false;
     }
 
-    *endOfName = 0;
-    convert_to_lowercase(startOfName, endOfName);
+    const fdu_http_header_t id = fdu_http_header_id(startOfName, endOfName - startOfName);
 
     strip_ws_both(&startOfContent, &endOfContent);
-    *endOfContent = 0;
-
-    switch (startOfName[0]) {
-    case 'c':
-        if (strcmp((const char*)startOfName, "connection") == 0)
-        {
-            convert_to_lowercase(startOfContent, endOfContent);
 
-            if (parser->message_state.version == fdu_http_version_1_0) {
-                if (strcmp((const char*)startOfContent, "keep-alive") == 0) {
-                    parser->message_state.closing = false;
-                }
+    switch (id) {
+    case fdu_http_header_connection:
+        if (parser->message_state.version == fdu_http_version_1_0) {
+            if (value_is(startOfContent, endOfContent, "keep-alive")) {
+                parser->message_state.closing = false;
             }
-            else if (parser->message_state.version == fdu_http_version_1_1) {
-                if (strcmp((const char*)startOfContent, "close") == 0) {
-                    parser->message_state.closing = true;
-                }
+        }
+        else if (parser->message_state.version == fdu_http_version_1_1) {
+            if (value_is(startOfContent, endOfContent, "close")) {
+                parser->message_state.closing = true;
             }
         }
-        else if (strcmp((const char*)startOfName, "content-length") == 0)
+        break;
+
+    case fdu_http_header_transfer_encoding:
+        // only "chunked", compressed content isn't supported
+
+        if (!value_is(startOfContent, endOfContent, "chunked")) {
+            fde_push_http_error("Transfer-Encoding not implemented", 501);
+            return false;
+        }
+
+        if (parser->message_state.has_content_length) {
+            fde_push_http_error("Both Content-length and Transfer-Encoding", 400);
+            return false;
+        }
+
+        parser->message_state.chunked = true;
+        break;
+
+    case fdu_http_header_content_length:
         {
             enum { TmpBufferSize = 20 };
 
+            if (parser->message_state.chunked) {
+                fde_push_http_error("Both Content-length and Transfer-Encoding", 400);
+                return false;
+            }
+
             const int input_size = endOfContent - startOfContent;
 
             if (input_size <= 0
@@ -153,7 +462,7 @@ static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
                  i < input_size;
                  ++i)
             {
-                if (!isdigit(startOfContent[input_size])) {
+                if (!isdigit(startOfContent[i])) {
                     fde_push_http_error("Corrupted \"Content-length\" header", 400);
                     return false;
                 }
@@ -176,9 +485,12 @@ static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
                 return false;
             }
 
-            parser->message_state.content_length = cl;
+            parser->message_state.content_length     = cl;
+            parser->message_state.has_content_length = true;
         }
-        else if (strcmp((const char*)startOfName, "content-type") == 0)
+        break;
+
+    case fdu_http_header_content_type:
         {
             if (endOfContent-startOfContent < 1) {
                 break;
@@ -189,12 +501,45 @@ static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
                 ct_size = ContentTypeSize - 1;
 
             memcpy(parser->message_state.content_type, startOfContent, ct_size);
+            parser->message_state.content_type[ct_size] = 0;
         }
         break;
+
+    default:
+        break;
+    }
+
+    fdu_http_header_index_t* const index = parser->header_index;
+
+    if (index)
+    {
+        if (index->count == MaxIndexedHeaders) {
+            fde_push_http_error("Too many headers", 431);
+            return false;
+        }
+
+        fdu_http_header_field_t* field = &index->fields[index->count++];
+
+        field->name         = startOfName - request;
+        field->name_length  = endOfName - startOfName;
+        field->value        = startOfContent - request;
+        field->value_length = endOfContent - startOfContent;
+        field->id           = id;
+
+        if (id != fdu_http_header_unknown
+            && !index->known[id])
+        {
+            index->known[id] = index->count;
+        }
+
+        return true;
     }
 
+    *endOfName    = 0;
+    *endOfContent = 0;
+
     if (parser->http_ops->parse_header
-        && !parser->http_ops->parse_header(parser->context, startOfName, startOfContent))
+        && !parser->http_ops->parse_header(parser->context, id, startOfName, startOfContent))
     {
         return false;
     }
@@ -202,10 +547,212 @@ static bool fdu_http_parse_header(fdu_http_request_parser_t* parser,
     return true;
 }
 
+const fdu_http_header_field_t* fdu_http_find_header(const fdu_http_header_index_t* index,
+                                                    fdu_http_header_t id)
+{
+    if (id <= fdu_http_header_unknown
+        || id >= fdu_http_header_count
+        || !index->known[id])
+    {
+        return 0;
+    }
+
+    return &index->fields[index->known[id] - 1];
+}
+
+const fdu_http_header_field_t* fdu_http_find_header_by_name(const fdu_http_header_index_t* index,
+                                                            const unsigned char* request,
+                                                            const char* name)
+{
+    const size_t length = strlen(name);
+    const fdu_http_header_t id = fdu_http_header_id((const unsigned char*) name, length);
+
+    if (id != fdu_http_header_unknown)
+        return fdu_http_find_header(index, id);
+
+    for (unsigned int i = 0; i < index->count; ++i)
+    {
+        const fdu_http_header_field_t* field = &index->fields[i];
+
+        if (field->name_length == length
+            && strncasecmp((const char*)request + field->name, name, length) == 0)
+        {
+            return field;
+        }
+    }
+
+    return 0;
+}
+
 // ------------------------------------------------------------
 
+// the line feed ending the line at 'start', 0 if it isn't there yet or if
+// there's an invalid character before it
+
+static unsigned char* find_line_end(unsigned char* start,
+                                    const unsigned char* const end,
+                                    bool* invalid)
+{
+    for (unsigned char* ptr = http_scan(start, end);
+         ptr < end;
+         ptr = http_scan(ptr + 1, end))
+    {
+        if (*ptr == '\n')
+            return ptr;
+
+        if (*ptr != ':') {
+            *invalid = true;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+/* Chunked content, as much as there is:
+ *
+ *   chunk size in hex [; extensions] CRLF
+ *   data CRLF
+ *   ...
+ *   0 [; extensions] CRLF
+ *   trailer fields CRLF, ignored
+ *   CRLF
+ *
+ * False on errors. It has more to do unless the request is done.
+ */
+
+enum {
+    ChunkSize,
+    ChunkData,
+    ChunkDataEnd,
+    ChunkTrailer,
+    //
+    MaxChunkLine = 1024,
+};
+
+static bool decode_chunks(fdu_http_request_parser_t* parser,
+                          unsigned char** start,
+                          const unsigned char* const end)
+{
+    fdu_http_parser_state_t* const state = &parser->parser_state;
+
+    while (*start < end)
+    {
+        if (state->chunk_state == ChunkData)
+        {
+            uint32_t length = state->chunk_left;
+
+            if (length > (uint32_t)(end - *start))
+                length = end - *start;
+
+            if (parser->http_ops->parse_content
+                && !parser->http_ops->parse_content(parser->context, *start, *start + length))
+            {
+                return false;
+            }
+
+            *start                += length;
+            state->content_loaded += length;
+
+            if (!(state->chunk_left -= length))
+                state->chunk_state = ChunkDataEnd;
+
+            continue;
+        }
+
+        // the rest are lines
+
+        unsigned char* eol = memchr(*start, '\n', end - *start);
+
+        if (!eol) {
+            if (end - *start > MaxChunkLine) {
+                fde_push_http_error("Corrupted chunk", 400);
+                return false;
+            }
+            break;
+        }
+
+        unsigned char* const line = *start;
+        const unsigned char* line_end = (eol > line && *(eol - 1) == '\r') ? eol - 1 : eol;
+
+        *start = eol + 1;
+
+        switch (state->chunk_state) {
+        case ChunkSize:
+            {
+                uint64_t size = 0;
+                const unsigned char* ptr = line;
+
+                for (; ptr < line_end && isxdigit(*ptr); ++ptr)
+                {
+                    size = size * 16 + (isdigit(*ptr) ? *ptr - '0' : (*ptr | 0x20) - 'a' + 10);
+
+                    if (size > UINT32_MAX) {
+                        fde_push_http_error("Too long chunk", 413);
+                        return false;
+                    }
+                }
+
+                const unsigned char* const digits_end = ptr;
+
+                while (ptr < line_end && is_ows(*ptr))
+                    ++ptr;
+
+                // only an extension may follow the size
+
+                if (digits_end == line
+                    || (ptr < line_end && *ptr != ';'))
+                {
+                    fde_push_http_error("Corrupted chunk size", 400);
+                    return false;
+                }
+
+                state->chunk_left  = size;
+                state->chunk_state = size ? ChunkData : ChunkTrailer;
+            }
+            break;
+
+        case ChunkDataEnd:
+            if (line_end != line) {
+                fde_push_http_error("Corrupted chunk", 400);
+                return false;
+            }
+
+            state->chunk_state = ChunkSize;
+            break;
+
+        case ChunkTrailer:
+            if (line_end == line) {
+                state->progress = fdu_http_progress_done;
+                return true;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+// *request moves to 'position' as parsing goes on. With a header index it
+// stays at the start of the request, also when the request is done: the
+// next call moves it past the request.
+
+static void update_request_start(fdu_http_request_parser_t* parser,
+                                 unsigned char** request,
+                                 unsigned char* position)
+{
+    if (!parser->header_index) {
+        *request = position;
+        parser->parser_state.parsed = 0;
+    }
+    else
+        parser->parser_state.parsed = position - *request;
+}
+
 bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
-                            unsigned char** start,
+                            unsigned char** request,
                             unsigned char** end)
 {
     const fde_node_t* ectx = 0;
@@ -214,13 +761,33 @@ bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
         return false;
     //
 
+    // pipelining: the next request after the last one
+
+    if (parser->parser_state.progress == fdu_http_progress_done) {
+        *request += parser->parser_state.parsed;
+        fdu_clear_http_request_parser(parser);
+    }
+
+    unsigned char* position = *request + parser->parser_state.parsed;
+    unsigned char** const start = &position;
+
     unsigned char* sol;     // start of line
     unsigned char* eol;     // end of line
 
     switch (parser->parser_state.progress) {
     case fdu_http_progress_request_line:
-        if (!(eol =memchr(*start, '\n', *end - *start)))
-            break;
+        {
+            bool invalid = false;
+
+            if (!(eol =find_line_end(*start, *end, &invalid)))
+            {
+                if (invalid) {
+                    fde_push_http_error("Invalid character in request line", 400);
+                    return false;
+                }
+                break;
+            }
+        }
         if (eol - *start < 6) { // min length
             fde_push_http_error("Too short request line", 400);
             return false;
@@ -315,44 +882,69 @@ bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
     case fdu_http_progress_headers:
         // *start:      start of header
         // *eol:        end of header
-        // sol:         where to start looking for the end of header
+        // sol:         where to continue scanning
+        // colon:       the first colon of the header
         // next_header: start of the next header
-        sol = *start;
-        while ((eol =memchr(sol, '\n', *end - sol)))
         {
-            unsigned char* next_header = eol + 1;
+            unsigned char* colon = 0;
 
-            if (eol > *start && *(eol - 1) == '\r')       // CRLF
-                --eol;
+            sol = *start;
 
-            if (*start == eol) {        // empty line
-                *start = next_header;
-                parser->parser_state.progress = fdu_http_progress_content_not_read;
-                break;
-            }
+            while ((eol =http_scan(sol, *end)) < *end)
+            {
+                if (*eol == ':') {
+                    if (!colon)
+                        colon = eol;
+                    sol = eol + 1;
+                    continue;
+                }
 
-            if (next_header >= *end)
-                break;
+                if (*eol != '\n') {
+                    fde_push_http_error("Invalid character in header", 400);
+                    return false;
+                }
 
-            if (*next_header == ' ' || *next_header == '\t')    // header continues
-            {
-                *eol++ = ' ';
-                do ++next_header;
-                while (next_header < *end
-                       && (*next_header == ' ' || *next_header == '\t'));
-                //
-                memmove(eol, next_header, *end - next_header);
-                *end -= next_header - eol;
-                //
-                sol = eol;
-                continue;
-            }
+                unsigned char* next_header = eol + 1;
 
-            if (!fdu_http_parse_header(parser, *start, eol))
-                return false;
+                if (eol > *start && *(eol - 1) == '\r')   // CRLF
+                    --eol;
+
+                if (*start == eol) {        // empty line
+                    *start = next_header;
+                    parser->parser_state.progress = fdu_http_progress_content_not_read;
+                    break;
+                }
 
-            //
-            sol = *start = next_header;
+                if (next_header >= *end)
+                    break;
+
+                if (*next_header == ' ' || *next_header == '\t')    // header continues
+                {
+                    if (parser->header_index) {
+                        fde_push_http_error("Folded header line", 400);
+                        return false;
+                    }
+
+                    *eol++ = ' ';
+                    do ++next_header;
+                    while (next_header < *end
+                           && (*next_header == ' ' || *next_header == '\t'));
+                    //
+                    memmove(eol, next_header, *end - next_header);
+                    *end -= next_header - eol;
+                    //
+                    sol = eol;
+                    continue;
+                }
+
+                if (!fdu_http_parse_header(parser, *request, *start, colon, eol))
+                    return false;
+
+                //
+                *start = next_header;
+                sol    = next_header;
+                colon  = 0;
+            }
         }
 
         if (parser->parser_state.progress != fdu_http_progress_content_not_read)
@@ -360,7 +952,10 @@ bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
         //fallthrough
 
     case fdu_http_progress_content_not_read:
-        if (!parser->message_state.content_length) {
+        if (parser->message_state.chunked) {
+            parser->parser_state.progress = fdu_http_progress_reading_content;
+        }
+        else if (!parser->message_state.content_length) {
             parser->parser_state.progress = fdu_http_progress_done;
         }
         else if (parser->message_state.content_length > MaxContentLength) {
@@ -370,11 +965,22 @@ bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
         else if ((uint32_t)(*end - *start) >= parser->message_state.content_length)
             parser->parser_state.progress = fdu_http_progress_reading_content;
 
+        if (parser->parser_state.progress == fdu_http_progress_done) {
+            update_request_start(parser, request, position);
+            return fde_safe_pop_context(this_error_context, ectx);
+        }
+
         if (parser->parser_state.progress != fdu_http_progress_reading_content)
             break;
         //fallthrough
 
     case fdu_http_progress_reading_content:
+        if (parser->message_state.chunked)
+        {
+            if (!decode_chunks(parser, start, *end))
+                return false;
+        }
+        else
         {
 
 
@@ -425,9 +1031,12 @@ bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
         //fallthrough
 
     case fdu_http_progress_done:
+        update_request_start(parser, request, position);
         return fde_safe_pop_context(this_error_context, ectx);
     }
 
+    update_request_start(parser, request, position);
+
     fde_push_resource_failure_id(fde_resource_buffer_underflow);
     return false;
 }
@@ -471,6 +1080,7 @@ static const char* get_http_error_message(uint32_t code)
     case 415: return "Unsupported Media Type";
     case 416: return "Requested Range Not Satisfiable";
     case 417: return "Expectation Failed";
+    case 431: return "Request Header Fields Too Large";
     case 500: return "Internal Server Error";
     case 501: return "Not Implemented";
     case 502: return "Bad Gateway";
@@ -631,3 +1241,264 @@ bool fdu_http_conjure_error_response(fdu_http_request_parser_t* parser,
 
     return fde_safe_pop_context(this_error_context, ectx);
 }
+
+// ------------------------------------------------------------
+
+static unsigned int hex_digits(uint32_t value)
+{
+    unsigned int digits = 1;
+
+    while (value >>= 4)
+        ++digits;
+
+    return digits;
+}
+
+uint32_t fdu_http_chunk_capacity(const unsigned char* start,
+                                 const unsigned char* end)
+{
+    // size line and CRLF after the data
+
+    if (!start
+        || end <= start)
+    {
+        return 0;
+    }
+
+    const uint64_t space = end - start;
+
+    for (unsigned int digits = 1; digits <= 8; ++digits)
+    {
+        if (space < digits + 4u)
+            return 0;
+
+        const uint64_t capacity = space - digits - 4;
+
+        if (capacity < ((uint64_t) 1 << (4 * digits)))
+            return capacity < UINT32_MAX ? capacity : UINT32_MAX;
+    }
+
+    return UINT32_MAX;
+}
+
+bool fdu_http_write_chunk(const unsigned char* data,
+                          uint32_t size,
+                          unsigned char** startp,
+                          const unsigned char* end)
+{
+    const fde_node_t* ectx = 0;
+
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    if (!data
+        || !size            // would end the content
+        || !startp
+        || !end)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (*startp > end
+        || (uint64_t)(end - *startp) < hex_digits(size) + 4u + size)
+    {
+        fde_push_resource_failure_id(fde_resource_buffer_overflow);
+        return false;
+    }
+
+    *startp += sprintf((char*)*startp, "%x\r\n", size);
+
+    memcpy(*startp, data, size);
+    *startp += size;
+
+    apply_data_to_buffer("\r\n", 2, startp, end);
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_http_write_last_chunk(unsigned char** startp,
+                               const unsigned char* end)
+{
+    const fde_node_t* ectx = 0;
+
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    if (!startp
+        || !end)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (!apply_data_to_buffer("0\r\n\r\n", 5, startp, end)) {
+        fde_push_resource_failure_id(fde_resource_buffer_overflow);
+        return false;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+// ------------------------------------------------------------
+
+void fdu_init_http_pipeline(fdu_http_pipeline_t* pipeline)
+{
+    memset(pipeline, 0, sizeof(fdu_http_pipeline_t));
+}
+
+void fdu_clear_http_pipeline(fdu_http_pipeline_t* pipeline)
+{
+    for (unsigned int i = 0; i < MaxPipelinedRequests; ++i)
+        free(pipeline->slots[i].data);
+
+    fdu_init_http_pipeline(pipeline);
+}
+
+bool fdu_http_pipeline_add_request(fdu_http_pipeline_t* pipeline,
+                                   uint32_t* id)
+{
+    const fde_node_t* ectx = 0;
+
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    if (!pipeline
+        || !id)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    // wait for responses to be written before parsing more, not an error
+
+    if (pipeline->next - pipeline->first == MaxPipelinedRequests) {
+        fde_safe_pop_context(this_error_context, ectx);
+        return false;
+    }
+
+    *id = pipeline->next++;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_http_pipeline_set_response(fdu_http_pipeline_t* pipeline,
+                                    uint32_t id,
+                                    const unsigned char* start,
+                                    const unsigned char* end,
+                                    bool closing)
+{
+    const fde_node_t* ectx = 0;
+
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    if (pipeline && pipeline->closed)     // dropped
+        return fde_safe_pop_context(this_error_context, ectx);
+
+    if (!pipeline
+        || id - pipeline->first >= pipeline->next - pipeline->first
+        || pipeline->slots[id % MaxPipelinedRequests].data
+        || !start
+        || end <= start)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    fdu_http_response_slot_t* slot = &pipeline->slots[id % MaxPipelinedRequests];
+
+    if (!(slot->data =malloc(end - start))) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    memcpy(slot->data, start, end - start);
+
+    slot->size    = end - start;
+    slot->written = 0;
+    slot->closing = closing;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_http_pipeline_write(fdu_http_pipeline_t* pipeline,
+                             unsigned char** startp,
+                             const unsigned char* end)
+{
+    const fde_node_t* ectx = 0;
+
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+
+    if (!pipeline
+        || !startp
+        || !end
+        || *startp > end)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    // the oldest ones, as long as they are ready and there's room
+
+    while (!pipeline->closed
+           && pipeline->first != pipeline->next
+           && *startp < end)
+    {
+        fdu_http_response_slot_t* slot = &pipeline->slots[pipeline->first % MaxPipelinedRequests];
+
+        if (!slot->data)
+            break;
+
+        uint32_t length = slot->size - slot->written;
+
+        if (length > (uint32_t)(end - *startp))
+            length = end - *startp;
+
+        memcpy(*startp, slot->data + slot->written, length);
+
+        *startp       += length;
+        slot->written += length;
+
+        if (slot->written < slot->size)
+            break;
+
+        pipeline->closed = slot->closing;
+
+        free(slot->data);
+        slot->data = 0;
+
+        ++pipeline->first;
+    }
+
+    // nothing after a closing response
+
+    if (pipeline->closed)
+    {
+        for (; pipeline->first != pipeline->next; ++pipeline->first)
+        {
+            fdu_http_response_slot_t* slot = &pipeline->slots[pipeline->first % MaxPipelinedRequests];
+
+            free(slot->data);
+            slot->data = 0;
+        }
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+uint32_t fdu_http_pipeline_pending(const fdu_http_pipeline_t* pipeline)
+{
+    return pipeline->next - pipeline->first;
+}
+
+bool fdu_http_pipeline_is_closed(const fdu_http_pipeline_t* pipeline)
+{
+    return pipeline->closed;
+}
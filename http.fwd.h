@@ -7,6 +7,8 @@
 
 enum { MaxContentLength = 64 * 1024 };
 enum { ContentTypeSize  = 64 };
+enum { MaxIndexedHeaders = 64 };
+enum { MaxPipelinedRequests = 16 };
 
 typedef enum {
     fdu_http_progress_request_line,
@@ -27,4 +29,50 @@ typedef enum {
     fdu_http_version_1_1,
 } fdu_http_version_t;
 
+// the request headers the parser knows by name, see fdu_http_header_id()
+
+typedef enum {
+    fdu_http_header_unknown = 0,
+    fdu_http_header_accept,
+    fdu_http_header_accept_charset,
+    fdu_http_header_accept_encoding,
+    fdu_http_header_accept_language,
+    fdu_http_header_authorization,
+    fdu_http_header_cache_control,
+    fdu_http_header_connection,
+    fdu_http_header_content_length,
+    fdu_http_header_content_type,
+    fdu_http_header_cookie,
+    fdu_http_header_date,
+    fdu_http_header_expect,
+    fdu_http_header_forwarded,
+    fdu_http_header_from,
+    fdu_http_header_host,
+    fdu_http_header_if_match,
+    fdu_http_header_if_modified_since,
+    fdu_http_header_if_none_match,
+    fdu_http_header_if_range,
+    fdu_http_header_if_unmodified_since,
+    fdu_http_header_keep_alive,
+    fdu_http_header_max_forwards,
+    fdu_http_header_origin,
+    fdu_http_header_pragma,
+    fdu_http_header_range,
+    fdu_http_header_referer,
+    fdu_http_header_te,
+    fdu_http_header_trailer,
+    fdu_http_header_transfer_encoding,
+    fdu_http_header_upgrade,
+    fdu_http_header_upgrade_insecure_requests,
+    fdu_http_header_user_agent,
+    fdu_http_header_via,
+    fdu_http_header_x_forwarded_for,
+    fdu_http_header_x_forwarded_host,
+    fdu_http_header_x_forwarded_proto,
+    fdu_http_header_x_real_ip,
+    fdu_http_header_x_requested_with,
+    //
+    fdu_http_header_count               // not a header
+} fdu_http_header_t;
+
 typedef struct fdu_http_ops_t_ fdu_http_ops_t;
@@ -16,6 +16,9 @@
 typedef struct {
     fdu_http_parser_progress_t  progress;
     uint32_t                    content_loaded;
+    uint32_t                    parsed;         // with a header index, see below
+    uint32_t                    chunk_left;     // chunked content
+    uint8_t                     chunk_state;
 } fdu_http_parser_state_t;
 
 typedef struct {
@@ -23,9 +26,34 @@ typedef struct {
     fdu_http_version_t version;
     bool               closing;
     uint32_t           content_length;
+    bool               has_content_length;  // also when 0
+    bool               chunked;         // Transfer-Encoding: chunked
     unsigned char      content_type[64];
 } fdu_http_message_state_t;
 
+/* Header index. With one set, the parser doesn't modify the request:
+ * instead of calling parse_header() it records where the headers are, as
+ * offsets from the start of the request. *start stays at the start of the
+ * request, also after fdu_http_parse_request() returns true: the request is
+ * [*start, *start + parser_state.parsed) and the headers can be read until
+ * the next call, which moves *start past the request. Folded header lines
+ * can't be joined without moving data, they are rejected with 400.
+ */
+
+typedef struct {
+    uint32_t          name;             // offsets from the start of the request
+    uint32_t          name_length;
+    uint32_t          value;            // white space stripped
+    uint32_t          value_length;
+    fdu_http_header_t id;
+} fdu_http_header_field_t;
+
+typedef struct {
+    unsigned int            count;
+    fdu_http_header_field_t fields[MaxIndexedHeaders];
+    uint8_t                 known[fdu_http_header_count];     // 1 + the first field with the id, 0 if none
+} fdu_http_header_index_t;
+
 //
 
 typedef bool (*fdu_http_parse_request_url_func)(void* context,
@@ -35,8 +63,9 @@ typedef bool (*fdu_http_parse_request_url_func)(void* context,
 typedef bool (*fdu_http_parse_request_version_func)(void* context,
                                                     fdu_http_version_t version);
 typedef bool (*fdu_http_parse_request_header_func)(void* context,
-                                                   unsigned char* start,
-                                                   unsigned char* end);
+                                                   fdu_http_header_t id,
+                                                   unsigned char* name,     // as sent, not lowercased
+                                                   unsigned char* value);
 typedef bool (*fdu_http_parse_request_content_func)(void* context,
                                                     unsigned char* start,
                                                     unsigned char* end);
@@ -51,6 +80,7 @@ struct fdu_http_ops_t_ {
 typedef struct {
     void* context;
     const fdu_http_ops_t* http_ops;
+    fdu_http_header_index_t* header_index;
     //
     fdu_http_parser_state_t  parser_state;
     fdu_http_message_state_t message_state;
@@ -62,13 +92,55 @@ void fdu_clear_http_request_parser(fdu_http_request_parser_t*);
 void fdu_init_http_request_parser(fdu_http_request_parser_t*,
                                   void* context,
                                   const fdu_http_ops_t* http_ops);
+void fdu_set_http_header_index(fdu_http_request_parser_t*,
+                               fdu_http_header_index_t*);   // 0: parse in place, call parse_header()
+
+/* Pipelining. A call after a request is done starts the next one, from
+ * where the last one ended, without fdu_clear_http_request_parser(). That is
+ * *start, or *start + parser_state.parsed with a header index.
+ * The message state and the header index are cleared then, read them
+ * before.
+ *
+ * Responses can be made in any order but they have to be sent in the order
+ * of the requests. fdu_http_pipeline_add_request() gives each request an
+ * id, the response is stored with that id and fdu_http_pipeline_write()
+ * writes what's ready in order. After a closing response the rest are
+ * dropped. When MaxPipelinedRequests are waiting, add_request() returns
+ * false with nothing on the error stack: stop parsing until some responses
+ * are written.
+ */
+
+typedef struct {
+    unsigned char* data;                // malloc'ed, 0 until ready
+    uint32_t       size;
+    uint32_t       written;
+    bool           closing;
+} fdu_http_response_slot_t;
+
+typedef struct {
+    fdu_http_response_slot_t slots[MaxPipelinedRequests];
+    uint32_t                 first;     // the oldest not written
+    uint32_t                 next;      // id for the next request
+    bool                     closed;    // a closing response was written
+} fdu_http_pipeline_t;
 
 // request
 
+fdu_http_header_t fdu_http_header_id(const unsigned char* name,
+                                     unsigned int length);  // case-insensitive
+
 bool fdu_http_parse_request(fdu_http_request_parser_t* parser,
                             unsigned char**,
                             unsigned char**);  // start, end
 
+// the first field with the id or the name, 0 if there's none
+
+const fdu_http_header_field_t* fdu_http_find_header(const fdu_http_header_index_t*,
+                                                    fdu_http_header_t id);
+const fdu_http_header_field_t* fdu_http_find_header_by_name(const fdu_http_header_index_t*,
+                                                            const unsigned char* request,
+                                                            const char* name);
+
 // response
 
 extern const char* fdu_http_default_error_message;
@@ -78,3 +150,40 @@ bool fdu_http_conjure_error_response(fdu_http_request_parser_t* parser,
                                      const char* error_message,
                                      unsigned char**,
                                      const unsigned char*);  // start, end
+
+/* Chunked transfer encoding. Chunked request content is given to
+ * parse_content() piece by piece as it comes, it isn't limited by
+ * MaxContentLength (content_loaded counts it). With a header index the
+ * request stays in the buffer until the end, so the buffer limits it.
+ *
+ * For responses, fdu_http_write_chunk() writes one chunk, all or nothing,
+ * and fdu_http_chunk_capacity() tells how much data fits in one.
+ */
+
+uint32_t fdu_http_chunk_capacity(const unsigned char*,
+                                 const unsigned char*);     // start, end
+bool fdu_http_write_chunk(const unsigned char* data,
+                          uint32_t size,
+                          unsigned char**,
+                          const unsigned char*);            // start, end
+bool fdu_http_write_last_chunk(unsigned char**,
+                               const unsigned char*);       // start, end
+
+// pipelining
+
+void fdu_init_http_pipeline(fdu_http_pipeline_t*);
+void fdu_clear_http_pipeline(fdu_http_pipeline_t*);         // frees responses not written
+
+bool fdu_http_pipeline_add_request(fdu_http_pipeline_t*,
+                                   uint32_t* id);           // false, no error when full
+bool fdu_http_pipeline_set_response(fdu_http_pipeline_t*,
+                                    uint32_t id,
+                                    const unsigned char*,
+                                    const unsigned char*,   // start, end (copied)
+                                    bool closing);
+bool fdu_http_pipeline_write(fdu_http_pipeline_t*,
+                             unsigned char**,
+                             const unsigned char*);         // start, end
+
+uint32_t fdu_http_pipeline_pending(const fdu_http_pipeline_t*);    // requests not written
+bool fdu_http_pipeline_is_closed(const fdu_http_pipeline_t*);
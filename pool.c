@@ -0,0 +1,630 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "pool.h"
+#include "error_stack.h"
+#include "generic.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { this_error_context = fdu_context_pool };
+
+typedef struct pool_key_    pool_key;
+typedef struct pool_slot_   pool_slot;
+typedef struct pool_waiter_ pool_waiter;
+
+typedef enum {
+    slot_free,
+    slot_connecting,
+    slot_idle,
+    slot_busy,
+} pool_slot_state;
+
+struct pool_slot_ {
+    pool_key* key;
+    pool_slot_state state;
+    int fd;
+    unsigned int idle_ticks;
+    unsigned int connects;              // completed, tells if the callback has run
+};
+
+struct pool_waiter_ {
+    pool_waiter* next;
+    fdu_notify_connect_func callback;
+    void* context;
+};
+
+struct pool_key_ {
+    pool_key* next;
+    fdu_pool* pool;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    unsigned int options;
+
+    unsigned int open;                  // slots not free
+    unsigned int connecting;
+    bool starting;                      // in fdu_lazy_connect_inet(), see pool_connected()
+
+    pool_waiter* first_waiter;
+    pool_waiter* last_waiter;
+    unsigned int waiting;
+
+    pool_slot slots[];
+};
+
+struct fdu_pool_ {
+    pool_key* keys;
+
+    unsigned int max_per_key;
+    unsigned int idle_ticks;            // idle_msec in checks, 0 = never
+    fdd_timer_handle_t timer_handle;
+
+    // connects in progress and callbacks hold pointers, see release_pool().
+    // 'calls' counts the pool functions on the call stack, too: a connect
+    // may finish (and a callback free the pool) inside fdu_lazy_connect_inet(),
+    // the memory is released only when the outermost one returns.
+
+    unsigned int connecting;
+    unsigned int calls;
+    bool ticking;
+    bool freed;
+};
+
+// ------------------------------------------------------------
+
+static void release_pool(fdu_pool* pool)
+{
+    if (pool->connecting
+        || pool->calls)
+    {
+        return;
+    }
+
+    pool_key* key = pool->keys;
+
+    while (key) {
+        pool_key* next = key->next;
+
+        pool_waiter* waiter = key->first_waiter;
+
+        while (waiter) {
+            pool_waiter* next_waiter = waiter->next;
+            free(waiter);
+            waiter = next_waiter;
+        }
+
+        free(key);
+        key = next;
+    }
+
+    free(pool);
+}
+
+static void close_slot(pool_slot* slot)
+{
+    if (slot->fd >= 0)
+        fdu_safe_close(slot->fd);
+
+    slot->state = slot_free;
+    slot->fd    = -1;
+
+    --slot->key->open;
+}
+
+// =true: nothing has happened on an idle connection
+
+static bool slot_is_healthy(const pool_slot* slot)
+{
+    unsigned char byte;
+
+    const ssize_t bytes = recv(slot->fd, &byte, 1, MSG_PEEK|MSG_DONTWAIT);
+
+    return bytes < 0
+        && (errno == EAGAIN
+            || errno == EWOULDBLOCK);
+}
+
+static pool_waiter* pop_waiter(pool_key* key)
+{
+    pool_waiter* waiter = key->first_waiter;
+
+    if (waiter) {
+        if (!(key->first_waiter = waiter->next))
+            key->last_waiter = 0;
+
+        --key->waiting;
+    }
+
+    return waiter;
+}
+
+static bool call_waiter(fdu_pool* pool, pool_waiter* waiter, int fd, int error)
+{
+    fdu_notify_connect_func callback = waiter->callback;
+    void* context = waiter->context;
+
+    free(waiter);
+
+    ++pool->calls;
+    const bool ok = callback(context, fd, error);
+    --pool->calls;
+
+    return ok;
+}
+
+static bool start_connect(pool_key* key);
+
+// Hands idle connections to waiters and starts connects for the waiters no
+// connect is on its way for yet.
+
+static bool dispatch_key(pool_key* key)
+{
+    fdu_pool* const pool = key->pool;
+
+    bool ok = true;
+
+    ++pool->calls;
+
+    while (ok
+           && !pool->freed
+           && key->first_waiter)
+    {
+        pool_slot* idle = 0;
+
+        for (unsigned int i = 0; i < pool->max_per_key && !idle; ++i)
+        {
+            pool_slot* slot = &key->slots[i];
+
+            if (slot->state != slot_idle)
+                continue;
+
+            if (slot_is_healthy(slot))
+                idle = slot;
+            else
+                close_slot(slot);
+        }
+
+        if (idle) {
+            idle->state = slot_busy;
+            ok = call_waiter(pool, pop_waiter(key), idle->fd, 0);
+            continue;
+        }
+
+        if (key->waiting <= key->connecting
+            || key->open >= pool->max_per_key)
+        {
+            break;
+        }
+
+        ok = start_connect(key);
+    }
+
+    --pool->calls;
+
+    if (pool->freed)
+        release_pool(pool);
+
+    return ok;
+}
+
+static bool pool_connected(void* slot_v, int fd, int error)
+{
+    pool_slot* const slot = (pool_slot*) slot_v;
+    pool_key* const key   = slot->key;
+    fdu_pool* const pool  = key->pool;
+
+    --key->connecting;
+    --pool->connecting;
+
+    ++slot->connects;
+    slot->fd = fd;
+
+    if (pool->freed) {
+        close_slot(slot);
+        release_pool(pool);
+        return true;
+    }
+
+    bool ok = true;
+
+    ++pool->calls;
+
+    if (fd < 0
+        || error)
+    {
+        close_slot(slot);
+
+        // The waiter this connect was started for gets the error, unless a
+        // released connection has served it already. Waiters queued by the
+        // cap stay queued: the slot is free now, they get connects of their
+        // own. Inside start_connect() the dispatch loop there goes on.
+
+        if (key->waiting > key->connecting)
+            ok = call_waiter(pool, pop_waiter(key), -1, error ? error : ECONNREFUSED);
+
+        if (ok
+            && !pool->freed
+            && !key->starting)
+        {
+            ok = dispatch_key(key);
+        }
+    }
+    else {
+        slot->state      = slot_idle;
+        slot->idle_ticks = 0;
+
+        ok = dispatch_key(key);
+    }
+
+    --pool->calls;
+
+    if (pool->freed)
+        release_pool(pool);
+
+    return ok;
+}
+
+static bool start_connect(pool_key* key)
+{
+    fdu_pool* const pool = key->pool;
+
+    pool_slot* slot = 0;
+
+    for (unsigned int i = 0; i < pool->max_per_key && !slot; ++i)
+    {
+        if (key->slots[i].state == slot_free)
+            slot = &key->slots[i];
+    }
+
+    if (!slot) {
+        fde_push_consistency_failure("no free connection slot");
+        return false;
+    }
+
+    slot->state = slot_connecting;
+    slot->fd    = -1;
+
+    ++key->open;
+    ++key->connecting;
+    ++pool->connecting;
+
+    const unsigned int connects = slot->connects;
+
+    key->starting = true;
+
+    const bool started = fdu_lazy_connect_inet((const struct sockaddr*) &key->addr, key->addr_len,
+                                               &pool_connected, slot, key->options);
+
+    // the key is there even if a callback freed the pool, dispatch_key()
+    // holds it
+
+    key->starting = false;
+
+    if (started)
+        return true;
+
+    // false from the callback or the connect couldn't even be started
+
+    if (slot->connects == connects) {
+        --key->connecting;
+        --pool->connecting;
+
+        close_slot(slot);
+    }
+
+    return false;
+}
+
+static bool pool_tick(void* pool_v, int UNUSED(id))
+{
+    fdu_pool* const pool = (fdu_pool*) pool_v;
+
+    bool ok = true;
+
+    ++pool->calls;
+    pool->ticking = true;
+
+    for (pool_key* key = pool->keys; key && !pool->freed; key = key->next)
+    {
+        for (unsigned int i = 0; i < pool->max_per_key; ++i)
+        {
+            pool_slot* slot = &key->slots[i];
+
+            if (slot->state != slot_idle)
+                continue;
+
+            if (!slot_is_healthy(slot)
+                || (pool->idle_ticks
+                    && ++slot->idle_ticks >= pool->idle_ticks))
+            {
+                close_slot(slot);
+            }
+        }
+
+        // room for connects now
+
+        if (key->first_waiter
+            && !dispatch_key(key))
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    --pool->calls;
+    pool->ticking = false;
+
+    // freed from a callback, the timer is off the list while it runs
+
+    if (pool->freed) {
+        release_pool(pool);
+
+        fde_push_context(this_error_context);
+        fde_push_consistency_failure_id(fde_consistency_kill_recurring_timer);
+        return false;
+    }
+
+    return ok;
+}
+
+// ------------------------------------------------------------
+
+fdu_pool* fdu_new_pool(const unsigned int max_per_key,
+                       const unsigned int idle_msec,
+                       const unsigned int check_msec,
+                       const fdd_timer_handle_t timer_handle)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return 0;
+    //
+    if (!max_per_key
+        || (check_msec && !timer_handle)
+        || (idle_msec && !check_msec))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    fdu_pool* pool = malloc(sizeof(fdu_pool));
+
+    if (!pool) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    pool->keys         = 0;
+    pool->max_per_key  = max_per_key;
+    pool->idle_ticks   = idle_msec ? (idle_msec + check_msec - 1) / check_msec : 0;
+    pool->timer_handle = check_msec ? timer_handle : 0;
+    pool->connecting   = 0;
+    pool->calls        = 0;
+    pool->ticking      = false;
+    pool->freed        = false;
+
+    if (check_msec
+        && !fdd_add_timer_handle(&pool_tick, pool, 0, check_msec, check_msec, timer_handle))
+    {
+        free(pool);
+        return 0;
+    }
+
+    if (!fde_safe_pop_context(this_error_context, ectx)) {
+        fdd_cancel_timer(pool->timer_handle);
+        free(pool);
+        return 0;
+    }
+
+    return pool;
+}
+
+void fdu_free_pool(fdu_pool* pool)
+{
+    if (!pool
+        || pool->freed)
+    {
+        return;
+    }
+
+    pool->freed = true;
+
+    // the tick kills the timer itself
+
+    if (!pool->ticking)
+        fdd_cancel_timer(pool->timer_handle);
+
+    for (pool_key* key = pool->keys; key; key = key->next)
+    {
+        for (unsigned int i = 0; i < pool->max_per_key; ++i)
+        {
+            if (key->slots[i].state == slot_idle)
+                close_slot(&key->slots[i]);
+        }
+    }
+
+    release_pool(pool);
+}
+
+static pool_key* find_key(fdu_pool* pool,
+                          const struct sockaddr* addr,
+                          const socklen_t addr_len,
+                          const unsigned int options)
+{
+    for (pool_key* key = pool->keys; key; key = key->next)
+    {
+        if (key->addr_len == addr_len
+            && key->options == options
+            && !memcmp(&key->addr, addr, addr_len))
+        {
+            return key;
+        }
+    }
+
+    pool_key* key = malloc(sizeof(pool_key) + pool->max_per_key * sizeof(pool_slot));
+
+    if (!key) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    memset(&key->addr, 0, sizeof(key->addr));
+    memcpy(&key->addr, addr, addr_len);
+
+    key->pool         = pool;
+    key->addr_len     = addr_len;
+    key->options      = options;
+    key->open         = 0;
+    key->connecting   = 0;
+    key->starting     = false;
+    key->first_waiter = 0;
+    key->last_waiter  = 0;
+    key->waiting      = 0;
+
+    for (unsigned int i = 0; i < pool->max_per_key; ++i)
+    {
+        key->slots[i].key        = key;
+        key->slots[i].state      = slot_free;
+        key->slots[i].fd         = -1;
+        key->slots[i].idle_ticks = 0;
+        key->slots[i].connects   = 0;
+    }
+
+    key->next  = pool->keys;
+    pool->keys = key;
+
+    return key;
+}
+
+bool fdu_pool_acquire(fdu_pool* pool,
+                      const struct sockaddr* addr,
+                      const socklen_t addr_len,
+                      const unsigned int options,
+                      const fdu_notify_connect_func callback,
+                      void* const context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!pool
+        || pool->freed
+        || !addr
+        || !addr_len
+        || addr_len > sizeof(struct sockaddr_storage)
+        || !callback)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    pool_key* key;
+    pool_waiter* waiter;
+
+    if (!(key =find_key(pool, addr, addr_len, options)))
+        return false;
+
+    if (!(waiter = malloc(sizeof(pool_waiter)))) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    waiter->next     = 0;
+    waiter->callback = callback;
+    waiter->context  = context;
+
+    if (key->last_waiter)
+        key->last_waiter->next = waiter;
+    else
+        key->first_waiter = waiter;
+
+    key->last_waiter = waiter;
+    ++key->waiting;
+
+    // the pool may be freed by a callback
+
+    return dispatch_key(key)
+        && fde_pop_context(this_error_context, ectx);
+}
+
+bool fdu_pool_release(fdu_pool* pool, const int fd, const bool reusable)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!pool
+        || pool->freed
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    for (pool_key* key = pool->keys; key; key = key->next)
+    {
+        for (unsigned int i = 0; i < pool->max_per_key; ++i)
+        {
+            pool_slot* slot = &key->slots[i];
+
+            if (slot->state != slot_busy
+                || slot->fd != fd)
+            {
+                continue;
+            }
+
+            if (reusable) {
+                slot->state      = slot_idle;
+                slot->idle_ticks = 0;
+            }
+            else
+                close_slot(slot);
+
+            return dispatch_key(key)
+                && fde_pop_context(this_error_context, ectx);
+        }
+    }
+
+    fde_push_consistency_failure("fd not acquired from the pool");
+    return false;
+}
+
+unsigned int fdu_pool_idle(const fdu_pool* pool)
+{
+    if (!pool)
+        return 0;
+
+    unsigned int count = 0;
+
+    for (const pool_key* key = pool->keys; key; key = key->next)
+    {
+        for (unsigned int i = 0; i < pool->max_per_key; ++i)
+        {
+            if (key->slots[i].state == slot_idle)
+                ++count;
+        }
+    }
+
+    return count;
+}
+
+unsigned int fdu_pool_waiting(const fdu_pool* pool)
+{
+    if (!pool)
+        return 0;
+
+    unsigned int count = 0;
+
+    for (const pool_key* key = pool->keys; key; key = key->next)
+        count += key->waiting;
+
+    return count;
+}
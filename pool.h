@@ -0,0 +1,55 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include "pool.fwd.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/*
+  Outbound connection pool
+
+  'fdu_pool' keeps connected sockets for reuse. Connections are keyed by
+  address and fdu_lazy_connect_inet() options; at most 'max_per_key' are
+  open (connecting, idle or in use) per key.
+
+  fdu_pool_acquire() calls 'callback' with a connected fd: right away if
+  there is an idle one, otherwise when a new connect finishes or another
+  user releases one. Requests beyond the cap wait in FIFO order. If a new
+  connect fails, the waiter it was started for gets fd -1 and the error.
+  Requests waiting because of the cap stay queued and get connects of their
+  own in the freed slot.
+
+  fdu_pool_release() gives the fd back. With 'reusable' false (the protocol
+  state is unknown, the peer closed, ...) it is closed instead.
+
+  Every 'check_msec' the idle connections are checked with a non-blocking
+  MSG_PEEK: those closed by the peer, with an error, or with unexpected data
+  are closed. Connections idle for 'idle_msec' are closed as well. The same
+  check is done before an idle connection is handed out. The timer runs with
+  'timer_handle', see fdd_add_timer_handle().
+
+  Callbacks may acquire and release, and may free the pool.
+*/
+
+fdu_pool* fdu_new_pool(unsigned int max_per_key,
+                       unsigned int idle_msec,
+                       unsigned int check_msec,
+                       fdd_timer_handle_t timer_handle);
+void fdu_free_pool(fdu_pool*);          // closes all idle connections
+
+bool fdu_pool_acquire(fdu_pool*,
+                      const struct sockaddr* addr,
+                      socklen_t addr_len,
+                      unsigned int options,
+                      fdu_notify_connect_func callback,
+                      void* context);
+bool fdu_pool_release(fdu_pool*, int fd, bool reusable);
+
+unsigned int fdu_pool_idle(const fdu_pool*);
+unsigned int fdu_pool_waiting(const fdu_pool*);
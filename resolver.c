@@ -0,0 +1,1019 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+#include "resolver.h"
+#include "dispatcher.h"
+#include "error_stack.h"
+#include "generic.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { this_error_context = fdu_context_resolver };
+
+enum {
+    DnsPort         = 53,
+    DnsHeaderSize   = 12,
+    DnsMaxName      = 255,              // wire format
+    DnsMaxLabel     = 63,
+    DnsUdpSize      = 1232,             // advertised with EDNS0
+    DnsMaxMessage   = 65535,
+
+    DnsTypeA        = 1,
+    DnsTypeAAAA     = 28,
+    DnsTypeOPT      = 41,
+    DnsClassIN      = 1,
+
+    DnsFlagQR       = 0x8000,
+    DnsFlagTC       = 0x0200,
+    DnsFlagRD       = 0x0100,
+    DnsRcodeMask    = 0x000f,
+    DnsRcodeNoError = 0,
+    DnsRcodeNxDomain = 3,
+
+    DefaultTimeout  = 5000,             // msec, as with glibc
+    DefaultAttempts = 2,
+};
+
+enum {
+    PendingA    = FDU_RESOLVE_IPV4,
+    PendingAAAA = FDU_RESOLVE_IPV6,
+};
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} resolver_server;
+
+typedef struct {
+    bool used;
+    uint32_t stamp;                     // unique for every attempt, see query_timeout()
+    uint16_t id;                        // of the current attempt, random
+
+    unsigned int pending;               // PendingXXX not answered yet
+    unsigned int tries;
+    unsigned int first_server;
+    unsigned int server;
+    bool nxdomain;
+    bool failed;
+
+    fdu_resolver_notify_func notify;
+    void* context;
+
+    char name[DnsMaxName + 1];
+    unsigned char qname[DnsMaxName];
+    unsigned int qname_len;
+
+    fdu_resolver_answer answer;
+
+    // Every attempt has a socket of its own, connected to the server: the
+    // kernel picks a random source port and drops datagrams from anyone
+    // else. An answer is matched by the socket it comes from, then the id.
+
+    int udp_fd;
+    fdd_service_input udp_iserv;
+
+    // truncated answers are asked again over TCP
+
+    int tcp_fd;
+    unsigned int tcp_pending;
+    fdd_service_input tcp_iserv;
+    fdd_service_output tcp_oserv;
+    unsigned char* tcp_buffer;
+    unsigned int tcp_filled;
+} resolver_query;
+
+static struct {
+    bool active;
+
+    resolver_server servers[FDU_RESOLVER_MAX_SERVERS];
+    unsigned int server_count;
+    unsigned int next_server;
+
+    unsigned int timeout;
+    unsigned int attempts;
+
+    resolver_query* queries;
+    unsigned int in_flight;
+    uint32_t stamp;                     // the last one given, kept over shutdown
+
+    uint64_t random;
+} resolver;
+
+// ------------------------------------------------------------
+
+static uint16_t random_u16(void)
+{
+    // xorshift64
+
+    resolver.random ^= resolver.random << 13;
+    resolver.random ^= resolver.random >> 7;
+    resolver.random ^= resolver.random << 17;
+
+    return (uint16_t) (resolver.random >> 32);
+}
+
+static void put_u16(unsigned char* p, unsigned int value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static unsigned int get_u16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const unsigned char* p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// =0: invalid name
+
+static unsigned int encode_name(const char* name, unsigned char* qname)
+{
+    unsigned int length = 0;
+
+    while (*name)
+    {
+        const char* dot = strchr(name, '.');
+        const unsigned int label = dot ? (unsigned int) (dot - name) : strlen(name);
+
+        if (!label
+            || label > DnsMaxLabel
+            || length + 1 + label + 1 > DnsMaxName)
+        {
+            return 0;
+        }
+
+        qname[length++] = label;
+        memcpy(&qname[length], name, label);
+        length += label;
+
+        name += label;
+
+        if (*name == '.')
+            ++name;
+    }
+
+    if (!length)
+        return 0;
+
+    qname[length++] = 0;
+    return length;
+}
+
+static unsigned int build_query(const resolver_query* query, unsigned int type, unsigned char* packet)
+{
+    put_u16(&packet[0], query->id);
+    put_u16(&packet[2], DnsFlagRD);
+    put_u16(&packet[4], 1);             // questions
+    put_u16(&packet[6], 0);
+    put_u16(&packet[8], 0);
+    put_u16(&packet[10], 1);            // additional: OPT
+
+    unsigned char* p = &packet[DnsHeaderSize];
+
+    memcpy(p, query->qname, query->qname_len);
+    p += query->qname_len;
+
+    put_u16(p, type);
+    put_u16(p + 2, DnsClassIN);
+    p += 4;
+
+    // EDNS0, a bigger UDP payload saves going to TCP
+
+    *p++ = 0;
+    put_u16(p, DnsTypeOPT);
+    put_u16(p + 2, DnsUdpSize);
+    memset(p + 4, 0, 6);
+    p += 10;
+
+    return p - packet;
+}
+
+// <0: malformed
+
+static int skip_name(const unsigned char* packet, unsigned int size, unsigned int offset)
+{
+    while (offset < size)
+    {
+        const unsigned int label = packet[offset];
+
+        if (!label)
+            return offset + 1;
+
+        if ((label & 0xc0) == 0xc0)
+            return (offset + 2 <= size) ? (int) offset + 2 : -1;
+
+        if (label & 0xc0)
+            return -1;
+
+        offset += 1 + label;
+    }
+
+    return -1;
+}
+
+// ------------------------------------------------------------
+
+static void add_address(resolver_query* query, int family, const unsigned char* addr, uint32_t ttl)
+{
+    fdu_resolver_answer* answer = &query->answer;
+
+    if (answer->count >= FDU_RESOLVER_MAX_ADDRESSES)
+        return;
+
+    fdu_resolver_address* address = &answer->addresses[answer->count++];
+
+    address->family = family;
+    address->ttl    = ttl;
+
+    memset(address->addr, 0, sizeof(address->addr));
+    memcpy(address->addr, addr, (family == AF_INET) ? 4 : 16);
+
+    if (answer->count == 1
+        || ttl < answer->ttl)
+    {
+        answer->ttl = ttl;
+    }
+}
+
+static void close_udp(resolver_query* query)
+{
+    if (query->udp_fd >= 0) {
+        fdd_remove_input(query->udp_fd);
+        fdu_safe_close(query->udp_fd);
+    }
+
+    query->udp_fd = -1;
+}
+
+static void close_tcp(resolver_query* query)
+{
+    if (query->tcp_fd >= 0) {
+        fdd_remove_input(query->tcp_fd);
+        fdd_remove_output(query->tcp_fd);
+        fdu_safe_close(query->tcp_fd);
+    }
+
+    free(query->tcp_buffer);
+
+    query->tcp_fd      = -1;
+    query->tcp_pending = 0;
+    query->tcp_buffer  = 0;
+    query->tcp_filled  = 0;
+}
+
+static void finish_query(resolver_query* query, fdu_resolver_status status)
+{
+    fdu_resolver_answer answer = query->answer;
+    char name[DnsMaxName + 1];
+
+    strcpy(name, query->name);
+    answer.name = name;
+
+    if (answer.count)
+        answer.status = fdu_resolver_ok;
+    else if (status == fdu_resolver_ok)
+        answer.status = query->nxdomain ? fdu_resolver_nxdomain
+            : query->failed ? fdu_resolver_failure
+            : fdu_resolver_nodata;
+    else
+        answer.status = status;
+
+    fdu_resolver_notify_func notify = query->notify;
+    void* context = query->context;
+
+    // the slot is free before the callback, it may start new lookups
+
+    close_udp(query);
+    close_tcp(query);
+
+    query->used  = false;
+    query->stamp = ++resolver.stamp;
+
+    --resolver.in_flight;
+
+    notify(context, &answer);
+}
+
+static bool query_timeout(void* UNUSED(context), int id);
+static bool udp_readable(void* query_v, int fd);
+
+// =-1: no socket
+
+static int open_attempt(const resolver_server* server)
+{
+    const int fd = socket(server->addr.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (const struct sockaddr*) &server->addr, server->addr_len) < 0) {
+        fdu_safe_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// =false: no tries left
+
+static bool send_attempt(resolver_query* query)
+{
+    const unsigned int max_tries = resolver.attempts * resolver.server_count;
+
+    close_udp(query);
+    close_tcp(query);
+
+    while (query->tries < max_tries)
+    {
+        query->server = (query->first_server + query->tries) % resolver.server_count;
+        ++query->tries;
+        query->stamp = ++resolver.stamp;
+
+        query->id = random_u16();
+
+        const int fd = open_attempt(&resolver.servers[query->server]);
+
+        if (fd < 0)
+            continue;
+
+        unsigned char packet[DnsHeaderSize + DnsMaxName + 4 + 11];
+        bool sent = true;
+
+        if (query->pending & PendingA) {
+            const unsigned int size = build_query(query, DnsTypeA, packet);
+            sent = send(fd, packet, size, MSG_DONTWAIT) == (ssize_t) size;
+        }
+
+        if (sent
+            && query->pending & PendingAAAA)
+        {
+            const unsigned int size = build_query(query, DnsTypeAAAA, packet);
+            sent = send(fd, packet, size, MSG_DONTWAIT) == (ssize_t) size;
+        }
+
+        if (!sent
+            || !fdd_add_input(fd, &query->udp_iserv))
+        {
+            fdu_safe_close(fd);
+            continue;
+        }
+
+        query->udp_fd = fd;
+
+        const int timer_id = (int) ((query->stamp & 0x7fffff) << 8) | (int) (query - resolver.queries);
+
+        return fdd_add_timer(&query_timeout, 0, timer_id, resolver.timeout, 0);
+    }
+
+    return false;
+}
+
+static bool query_timeout(void* UNUSED(context), int id)
+{
+    if (!resolver.active)
+        return true;
+
+    resolver_query* query = &resolver.queries[id & 0xff];
+
+    if (!query->used
+        || (query->stamp & 0x7fffff) != ((uint32_t) id >> 8))
+    {
+        return true;                    // answered already
+    }
+
+    if (!send_attempt(query))
+        finish_query(query, fdu_resolver_timeout);
+
+    return true;
+}
+
+// ------------------------------------------------------------
+
+static bool tcp_connected(void* query_v, int fd);
+static bool tcp_readable(void* query_v, int fd);
+
+// each question with a length prefix
+
+static bool send_tcp_questions(resolver_query* query, unsigned int bits)
+{
+    unsigned char packet[2 * (2 + DnsHeaderSize + DnsMaxName + 4 + 11)];
+    unsigned int size = 0;
+
+    if (bits & PendingA) {
+        const unsigned int bytes = build_query(query, DnsTypeA, &packet[size + 2]);
+        put_u16(&packet[size], bytes);
+        size += 2 + bytes;
+    }
+
+    if (bits & PendingAAAA) {
+        const unsigned int bytes = build_query(query, DnsTypeAAAA, &packet[size + 2]);
+        put_u16(&packet[size], bytes);
+        size += 2 + bytes;
+    }
+
+    return send(query->tcp_fd, packet, size, MSG_DONTWAIT|MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+static void start_tcp(resolver_query* query)
+{
+    if (query->tcp_fd >= 0)
+        return;
+
+    const resolver_server* server = &resolver.servers[query->server];
+
+    const int fd = socket(server->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return;                         // the timeout takes care of it
+
+    if (connect(fd, (const struct sockaddr*) &server->addr, server->addr_len) < 0
+        && errno != EINPROGRESS)
+    {
+        fdu_safe_close(fd);
+        return;
+    }
+
+    query->tcp_fd = fd;
+
+    fdd_init_service_output(&query->tcp_oserv, query, &tcp_connected);
+    fdd_init_service_input(&query->tcp_iserv, query, &tcp_readable);
+
+    fdd_add_output(fd, &query->tcp_oserv);
+}
+
+static bool tcp_connected(void* query_v, int fd)
+{
+    resolver_query* query = (resolver_query*) query_v;
+
+    fdd_remove_output(fd);
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0
+        || error)
+    {
+        close_tcp(query);
+        return true;
+    }
+
+    // all truncated questions so far in one go, later ones are sent as
+    // they come, see handle_response()
+
+    if (!send_tcp_questions(query, query->tcp_pending)
+        || !(query->tcp_buffer = malloc(2 + DnsMaxMessage)))
+    {
+        close_tcp(query);
+        return true;
+    }
+
+    query->tcp_filled = 0;
+
+    return fdd_add_input(fd, &query->tcp_iserv);
+}
+
+static void handle_response(resolver_query* query, const unsigned char* packet, unsigned int size, bool tcp);
+
+static bool tcp_readable(void* query_v, int fd)
+{
+    resolver_query* query = (resolver_query*) query_v;
+
+    const ssize_t bytes = read(fd,
+                               &query->tcp_buffer[query->tcp_filled],
+                               2 + DnsMaxMessage - query->tcp_filled);
+
+    if (bytes <= 0) {
+        if (bytes < 0
+            && (errno == EAGAIN
+                || errno == EINTR))
+        {
+            return true;
+        }
+
+        close_tcp(query);
+        return true;
+    }
+
+    query->tcp_filled += bytes;
+
+    // complete messages, handle_response() may finish the query and free the buffer
+
+    while (query->used
+           && query->tcp_buffer
+           && query->tcp_filled >= 2)
+    {
+        const unsigned int length = get_u16(query->tcp_buffer);
+
+        if (query->tcp_filled < 2 + length)
+            break;
+
+        unsigned char message[DnsMaxMessage];
+
+        memcpy(message, &query->tcp_buffer[2], length);
+
+        query->tcp_filled -= 2 + length;
+        memmove(query->tcp_buffer, &query->tcp_buffer[2 + length], query->tcp_filled);
+
+        handle_response(query, message, length, true);
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------
+
+static void handle_response(resolver_query* query, const unsigned char* packet, unsigned int size, bool tcp)
+{
+    if (size < DnsHeaderSize
+        || get_u16(&packet[0]) != query->id)
+    {
+        return;
+    }
+
+    const unsigned int flags     = get_u16(&packet[2]);
+    const unsigned int questions = get_u16(&packet[4]);
+    const unsigned int answers   = get_u16(&packet[6]);
+
+    if (!(flags & DnsFlagQR)
+        || questions != 1)
+    {
+        return;
+    }
+
+    // the question must be ours
+
+    unsigned int offset = DnsHeaderSize;
+
+    if (offset + query->qname_len + 4 > size)
+        return;
+
+    for (unsigned int i = 0; i < query->qname_len; ++i)
+    {
+        if (tolower(packet[offset + i]) != tolower(query->qname[i]))
+            return;
+    }
+
+    offset += query->qname_len;
+
+    const unsigned int type = get_u16(&packet[offset]);
+    const unsigned int bit  = (type == DnsTypeA) ? PendingA : (type == DnsTypeAAAA) ? PendingAAAA : 0;
+
+    if (!(query->pending & bit))
+        return;
+
+    offset += 4;
+
+    // truncated: ask again over TCP, no such thing as truncated over TCP
+
+    if (flags & DnsFlagTC) {
+        if (!tcp) {
+            if (query->tcp_pending & bit)
+                return;
+
+            query->tcp_pending |= bit;
+
+            // already connected and asked, this one goes right after
+
+            if (!query->tcp_buffer)
+                start_tcp(query);
+            else if (!send_tcp_questions(query, bit))
+                close_tcp(query);       // the timeout takes care of it
+
+            return;
+        }
+
+        query->failed = true;
+    }
+    else switch (flags & DnsRcodeMask)
+    {
+    case DnsRcodeNoError:
+        for (unsigned int i = 0; i < answers; ++i)
+        {
+            const int end_of_name = skip_name(packet, size, offset);
+
+            if (end_of_name < 0
+                || (unsigned int) end_of_name + 10 > size)
+            {
+                break;
+            }
+
+            const unsigned char* rr = &packet[end_of_name];
+
+            const unsigned int rr_type   = get_u16(&rr[0]);
+            const unsigned int rr_class  = get_u16(&rr[2]);
+            const uint32_t ttl           = get_u32(&rr[4]);
+            const unsigned int rr_length = get_u16(&rr[8]);
+
+            offset = end_of_name + 10 + rr_length;
+
+            if (offset > size)
+                break;
+
+            // CNAMEs are followed by the server, the chain comes in the same section
+
+            if (rr_class != DnsClassIN
+                || rr_type != type)
+            {
+                continue;
+            }
+
+            if (type == DnsTypeA && rr_length == 4)
+                add_address(query, AF_INET, &rr[10], ttl);
+            else if (type == DnsTypeAAAA && rr_length == 16)
+                add_address(query, AF_INET6, &rr[10], ttl);
+        }
+        break;
+
+    case DnsRcodeNxDomain:
+        query->nxdomain = true;
+        break;
+
+    default:
+        // SERVFAIL, REFUSED, ... try the next server
+
+        if (send_attempt(query))
+            return;
+
+        query->failed = true;
+        finish_query(query, fdu_resolver_ok);
+        return;
+    }
+
+    query->pending     &= ~bit;
+    query->tcp_pending &= ~bit;
+
+    if (!query->tcp_pending)
+        close_tcp(query);
+
+    if (!query->pending)
+        finish_query(query, fdu_resolver_ok);
+}
+
+static bool udp_readable(void* query_v, int fd)
+{
+    resolver_query* query = (resolver_query*) query_v;
+
+    unsigned char packet[DnsMaxMessage];
+
+    // handle_response() may move on to the next attempt and close 'fd'
+
+    while (query->used
+           && query->udp_fd == fd)
+    {
+        const ssize_t bytes = recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // nothing listening there, on to the next server
+
+            if (errno == ECONNREFUSED
+                && !send_attempt(query))
+            {
+                query->failed = true;
+                finish_query(query, fdu_resolver_ok);
+            }
+
+            return true;                // EAGAIN
+        }
+
+        handle_response(query, packet, bytes, false);
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------
+
+static bool add_server(const struct sockaddr* addr, socklen_t addr_len)
+{
+    if (resolver.server_count == FDU_RESOLVER_MAX_SERVERS)
+        return true;                    // as with glibc, the rest are ignored
+
+    resolver_server* server = &resolver.servers[resolver.server_count];
+
+    // sockets are opened per attempt, see resolver_query
+
+    memset(&server->addr, 0, sizeof(server->addr));
+    memcpy(&server->addr, addr, addr_len);
+
+    server->addr_len = addr_len;
+
+    ++resolver.server_count;
+    return true;
+}
+
+static bool read_resolv_conf(const char* path)
+{
+    FILE* file = fopen(path, "r");
+
+    if (!file)
+        return true;                    // defaults
+
+    char line[256];
+    bool ok = true;
+
+    while (ok
+           && fgets(line, sizeof(line), file))
+    {
+        char* save = 0;
+        const char* keyword = strtok_r(line, " \t\r\n", &save);
+
+        if (!keyword
+            || keyword[0] == '#'
+            || keyword[0] == ';')
+        {
+            continue;
+        }
+
+        if (!strcmp(keyword, "nameserver"))
+        {
+            const char* address = strtok_r(0, " \t\r\n", &save);
+
+            struct sockaddr_in sa4;
+            struct sockaddr_in6 sa6;
+
+            memset(&sa4, 0, sizeof(sa4));
+            memset(&sa6, 0, sizeof(sa6));
+
+            if (!address)
+                continue;
+
+            if (inet_pton(AF_INET, address, &sa4.sin_addr) == 1) {
+                sa4.sin_family = AF_INET;
+                sa4.sin_port   = htons(DnsPort);
+                ok = add_server((struct sockaddr*) &sa4, sizeof(sa4));
+            }
+            else if (inet_pton(AF_INET6, address, &sa6.sin6_addr) == 1) {
+                sa6.sin6_family = AF_INET6;
+                sa6.sin6_port   = htons(DnsPort);
+                ok = add_server((struct sockaddr*) &sa6, sizeof(sa6));
+            }
+        }
+        else if (!strcmp(keyword, "options"))
+        {
+            const char* option;
+
+            while ((option = strtok_r(0, " \t\r\n", &save)))
+            {
+                if (!strncmp(option, "timeout:", 8) && atoi(option + 8) > 0)
+                    resolver.timeout = 1000 * atoi(option + 8);
+                else if (!strncmp(option, "attempts:", 9) && atoi(option + 9) > 0)
+                    resolver.attempts = atoi(option + 9);
+            }
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// ------------------------------------------------------------
+
+bool fdu_resolver_init(const char* resolv_conf)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (resolver.active) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (!(resolver.queries = calloc(FDU_RESOLVER_MAX_QUERIES, sizeof(resolver_query)))) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < FDU_RESOLVER_MAX_QUERIES; ++i)
+    {
+        resolver.queries[i].udp_fd = -1;
+        resolver.queries[i].tcp_fd = -1;
+    }
+
+    resolver.server_count = 0;
+    resolver.next_server  = 0;
+    resolver.timeout      = DefaultTimeout;
+    resolver.attempts     = DefaultAttempts;
+    resolver.in_flight    = 0;
+
+    if (getrandom(&resolver.random, sizeof(resolver.random), GRND_NONBLOCK) != sizeof(resolver.random))
+        resolver.random = (uint64_t) time(0) * 0x9e3779b97f4a7c15ull ^ (uint64_t) getpid();
+
+    if (!resolver.random)
+        resolver.random = 1;
+
+    resolver.active = true;
+
+    if (!read_resolv_conf(resolv_conf ? resolv_conf : "/etc/resolv.conf")) {
+        fdu_resolver_shutdown();
+        return false;
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_resolver_add_server(const struct sockaddr* addr, socklen_t addr_len)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!resolver.active
+        || !addr
+        || (addr->sa_family == AF_INET
+            ? addr_len < sizeof(struct sockaddr_in)
+            : (addr->sa_family != AF_INET6
+               || addr_len < sizeof(struct sockaddr_in6))))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    return add_server(addr, addr_len)
+        && fde_safe_pop_context(this_error_context, ectx);
+}
+
+bool fdu_resolver_set_timeout(unsigned int timeout_msec, unsigned int attempts)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!resolver.active
+        || !timeout_msec
+        || !attempts)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    resolver.timeout  = timeout_msec;
+    resolver.attempts = attempts;
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
+
+void fdu_resolver_shutdown(void)
+{
+    if (!resolver.active)
+        return;
+
+    // inactive first: a callback can't start a lookup in a slot already
+    // cancelled, and pending timers do nothing
+
+    resolver.active = false;
+
+    for (unsigned int i = 0; i < FDU_RESOLVER_MAX_QUERIES; ++i)
+    {
+        if (resolver.queries[i].used)
+            finish_query(&resolver.queries[i], fdu_resolver_cancelled);
+    }
+
+    free(resolver.queries);
+
+    resolver.queries      = 0;
+    resolver.server_count = 0;
+}
+
+bool fdu_resolver_is_active(void)
+{
+    return resolver.active;
+}
+
+unsigned int fdu_resolver_in_flight(void)
+{
+    return resolver.in_flight;
+}
+
+bool fdu_resolver_lookup(const char* name,
+                         unsigned int options,
+                         fdu_resolver_notify_func notify,
+                         void* context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(this_error_context)))
+        return false;
+    //
+    if (!resolver.active
+        || !name
+        || strlen(name) > DnsMaxName - 2
+        || !options
+        || (options & ~(FDU_RESOLVE_IPV4|FDU_RESOLVE_IPV6))
+        || !notify)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    // address literals are answered right away
+
+    {
+        fdu_resolver_answer answer;
+        unsigned char addr[16];
+
+        memset(&answer, 0, sizeof(answer));
+        answer.name = name;
+
+        if (inet_pton(AF_INET, name, addr) == 1) {
+            answer.addresses[0].family = AF_INET;
+            memcpy(answer.addresses[0].addr, addr, 4);
+        }
+        else if (inet_pton(AF_INET6, name, addr) == 1) {
+            answer.addresses[0].family = AF_INET6;
+            memcpy(answer.addresses[0].addr, addr, 16);
+        }
+
+        if (answer.addresses[0].family) {
+            const bool wanted = (answer.addresses[0].family == AF_INET)
+                ? options & FDU_RESOLVE_IPV4
+                : options & FDU_RESOLVE_IPV6;
+
+            answer.status = wanted ? fdu_resolver_ok : fdu_resolver_nodata;
+            answer.count  = wanted ? 1 : 0;
+
+            notify(context, &answer);
+            return fde_safe_pop_context(this_error_context, ectx);
+        }
+    }
+
+    unsigned char qname[DnsMaxName];
+    const unsigned int qname_len = encode_name(name, qname);
+
+    if (!qname_len) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    if (!resolver.server_count) {
+        fde_push_resource_failure("no nameservers");
+        return false;
+    }
+
+    resolver_query* query = 0;
+
+    for (unsigned int i = 0; i < FDU_RESOLVER_MAX_QUERIES && !query; ++i)
+    {
+        if (!resolver.queries[i].used)
+            query = &resolver.queries[i];
+    }
+
+    if (!query) {
+        fde_push_resource_failure_id(fde_resource_buffer_overflow);
+        return false;
+    }
+
+    query->used         = true;
+    query->pending      = options;
+    query->tries        = 0;
+    query->first_server = resolver.next_server++ % resolver.server_count;
+    query->nxdomain     = false;
+    query->failed       = false;
+    query->notify       = notify;
+    query->context      = context;
+    query->qname_len    = qname_len;
+    query->udp_fd       = -1;
+    query->tcp_fd       = -1;
+    query->tcp_pending  = 0;
+    query->tcp_buffer   = 0;
+    query->tcp_filled   = 0;
+
+    strcpy(query->name, name);
+    memcpy(query->qname, qname, qname_len);
+    memset(&query->answer, 0, sizeof(query->answer));
+
+    fdd_init_service_input(&query->udp_iserv, query, &udp_readable);
+
+    ++resolver.in_flight;
+
+    if (!send_attempt(query)) {
+        query->failed = true;
+        finish_query(query, fdu_resolver_ok);
+    }
+
+    return fde_safe_pop_context(this_error_context, ectx);
+}
@@ -0,0 +1,85 @@
+// Femc Driver
+// Copyright (C) 2020 Pauli Saksa
+//
+// Licensed under The MIT License, see file LICENSE.txt in this source tree.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+  Asynchronous DNS resolver
+
+  Queries are sent over UDP straight from the dispatcher, no helper
+  process. Every attempt uses a socket of its own (a random source port)
+  and a random 16-bit query id. fdu_resolver_init() reads the nameservers
+  and 'options timeout:n attempts:n' from resolv.conf (0 =
+  /etc/resolv.conf); fdu_resolver_add_server() adds more, e.g. with a port
+  other than 53.
+
+  fdu_resolver_lookup() sends A and/or AAAA queries for 'name' and calls
+  'notify_callback' once with the combined answer. Any number of queries
+  (up to FDU_RESOLVER_MAX_QUERIES) are in flight at a time. Each attempt is
+  given 'timeout' msec, then the next server is tried, for 'attempts' rounds
+  over all servers. Truncated answers are retried over TCP. Names are looked
+  up as given, there is no search list. Address literals are answered
+  before fdu_resolver_lookup() returns.
+
+  The answer and its addresses are valid until the callback returns.
+  fdu_resolver_shutdown() fails all pending queries with
+  fdu_resolver_cancelled.
+*/
+
+enum {
+    FDU_RESOLVER_MAX_QUERIES   = 256,
+    FDU_RESOLVER_MAX_ADDRESSES = 16,
+    FDU_RESOLVER_MAX_SERVERS   = 3,
+};
+
+enum {
+    FDU_RESOLVE_IPV4 = 1 << 0,
+    FDU_RESOLVE_IPV6 = 1 << 1,
+};
+
+typedef enum {
+    fdu_resolver_ok,
+    fdu_resolver_nxdomain,              // the name doesn't exist
+    fdu_resolver_nodata,                // no addresses of the requested family
+    fdu_resolver_timeout,
+    fdu_resolver_failure,               // SERVFAIL, REFUSED, malformed answers
+    fdu_resolver_cancelled,
+} fdu_resolver_status;
+
+typedef struct {
+    int family;                         // AF_INET or AF_INET6
+    unsigned char addr[16];
+    uint32_t ttl;
+} fdu_resolver_address;
+
+typedef struct {
+    const char* name;
+    fdu_resolver_status status;
+    uint32_t ttl;                       // smallest of the addresses
+    unsigned int count;
+    fdu_resolver_address addresses[FDU_RESOLVER_MAX_ADDRESSES];
+} fdu_resolver_answer;
+
+typedef void (*fdu_resolver_notify_func)(void* context, const fdu_resolver_answer* answer);
+
+//
+
+bool fdu_resolver_init(const char* resolv_conf);
+bool fdu_resolver_add_server(const struct sockaddr* addr, socklen_t addr_len);
+bool fdu_resolver_set_timeout(unsigned int timeout_msec, unsigned int attempts);
+void fdu_resolver_shutdown(void);
+
+bool fdu_resolver_is_active(void);
+
+bool fdu_resolver_lookup(const char* name,
+                         unsigned int options,          // FDU_RESOLVE_XXX
+                         fdu_resolver_notify_func notify_callback,
+                         void* context);
+
+unsigned int fdu_resolver_in_flight(void);
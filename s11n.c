@@ -14,6 +14,8 @@
 
 enum { this_error_context = fdu_context_s11n };
 
+enum { VarintMaximumSize = 10 };        // 64 bits in 7-bit groups
+
 // ------------------------------------------------------------
 
 static fdu_endianness_t fdu_endianness = fdu_big_endian;
@@ -243,6 +245,57 @@ bool fdu_s11n_read_uint64(uint64_t* value,
     return true;
 }
 
+bool fdu_s11n_read_varint(uint64_t* value,
+                          const unsigned char** datap,
+                          const unsigned char* const end)
+{
+    if (!value
+        || !datap
+        || !end
+        //
+        || !*datap
+        || *datap > end)
+    {
+        fde_push_context(this_error_context);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    // LEB128: 7 bits per byte, least significant first, high bit = more
+
+    const unsigned char* data = *datap;
+    uint64_t result = 0;
+
+    for (unsigned int i = 0; i < VarintMaximumSize; ++i)
+    {
+        if (data + i >= end) {
+            fde_push_context(this_error_context);
+            fde_push_resource_failure_id(fde_resource_buffer_underflow);
+            return false;
+        }
+
+        // the last byte has room for one bit only
+
+        if (i == VarintMaximumSize - 1
+            && data[i] > 1)
+        {
+            break;
+        }
+
+        result |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+
+        if (!(data[i] & 0x80)) {
+            *value  = result;
+            *datap += i + 1;
+            return true;
+        }
+    }
+
+    fde_push_context(this_error_context);
+    fde_push_data_corruption("varint too long");
+    return false;
+}
+
 bool fdu_s11n_read_float(float* value,
                          const unsigned char** datap,
                          const unsigned char* const end)
@@ -500,6 +553,51 @@ bool fdu_s11n_write_uint64(const uint64_t* value,
     return true;
 }
 
+unsigned int fdu_s11n_varint_size(uint64_t value)
+{
+    unsigned int size = 1;
+
+    while (value >>= 7)
+        ++size;
+
+    return size;
+}
+
+bool fdu_s11n_write_varint(const uint64_t* value,
+                           unsigned char** datap,
+                           const unsigned char* const end)
+{
+    if (!value
+        || !datap
+        || !end
+        //
+        || !*datap
+        || *datap > end)
+    {
+        fde_push_context(this_error_context);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    if ((unsigned int)(end - *datap) < fdu_s11n_varint_size(*value)) {
+        fde_push_context(this_error_context);
+        fde_push_resource_failure_id(fde_resource_buffer_overflow);
+        return false;
+    }
+
+    unsigned char* data = *datap;
+    uint64_t v = *value;
+
+    while (v >= 0x80) {
+        *data++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *data++ = v;
+
+    *datap = data;
+    return true;
+}
+
 bool fdu_s11n_write_float(const float* value,
                           unsigned char** datap,
                           const unsigned char* const end)
@@ -23,6 +23,7 @@ bool fdu_s11n_read_uint16(uint16_t*, const unsigned char**, const unsigned char*
 bool fdu_s11n_read_uint24(uint32_t*, const unsigned char**, const unsigned char*);
 bool fdu_s11n_read_uint32(uint32_t*, const unsigned char**, const unsigned char*);
 bool fdu_s11n_read_uint64(uint64_t*, const unsigned char**, const unsigned char*);
+bool fdu_s11n_read_varint(uint64_t*, const unsigned char**, const unsigned char*);    // LEB128
 
 bool fdu_s11n_read_float(float*, const unsigned char**, const unsigned char*);
 bool fdu_s11n_read_double(double*, const unsigned char**, const unsigned char*);
@@ -38,6 +39,9 @@ bool fdu_s11n_write_uint16(const uint16_t*, unsigned char**, const unsigned char
 bool fdu_s11n_write_uint24(const uint32_t*, unsigned char**, const unsigned char*);
 bool fdu_s11n_write_uint32(const uint32_t*, unsigned char**, const unsigned char*);
 bool fdu_s11n_write_uint64(const uint64_t*, unsigned char**, const unsigned char*);
+bool fdu_s11n_write_varint(const uint64_t*, unsigned char**, const unsigned char*);
+
+unsigned int fdu_s11n_varint_size(uint64_t);
 
 bool fdu_s11n_write_float(const float*, unsigned char**, const unsigned char*);
 bool fdu_s11n_write_double(const double*, unsigned char**, const unsigned char*);
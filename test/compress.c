@@ -0,0 +1,226 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+// fdu_compress on plain buffers, without a filter or a dispatcher:
+//
+//   round trip     deflate with sync flushes, inflate; everything before a
+//                  flush decodes before the stream is finished
+//   corrupt        garbage after a valid zlib header
+//   dictionary     a stream asking for a preset dictionary
+
+#include "../compress.h"
+#include "../error_stack.h"
+#include "../utils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+enum {
+    TextSize        = 200 * 1024,
+    FirstPartSize   = 10000,
+    ChunkSize       = 5000,
+    FlushBytes      = 16 * 1024,
+    StageSize       = 8192,
+    CompressedSize  = TextSize + 1024,
+};
+
+static unsigned char text[TextSize];
+static unsigned char stage[StageSize];
+static unsigned char compressed[CompressedSize];
+static unsigned char decompressed[TextSize];
+
+static unsigned int failures;
+
+// ------------------------------------------------------------
+
+static fdu_bufio_buffer plain_buffer(unsigned char* data, unsigned int size)
+{
+    fdu_bufio_buffer buffer;
+
+    memset(&buffer, 0, sizeof(buffer));
+
+    buffer.fd   = -1;
+    buffer.data = data;
+    buffer.size = size;
+
+    return buffer;
+}
+
+static void check(bool ok, const char* what)
+{
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+
+    if (!ok)
+        ++failures;
+}
+
+// 'bytes' of text through 'in' into 'out'
+
+static bool feed(fdu_compress* compress,
+                 fdu_bufio_buffer* in,
+                 fdu_bufio_buffer* out,
+                 const unsigned char* data,
+                 unsigned int bytes,
+                 bool flush)
+{
+    while (bytes || in->filled)
+    {
+        unsigned int chunk = in->size - in->filled;
+
+        if (chunk > bytes)
+            chunk = bytes;
+
+        memcpy(&in->data[in->filled], data, chunk);
+        in->filled += chunk;
+        data       += chunk;
+        bytes      -= chunk;
+
+        if (!fdu_compress_transform(in, out, flush || bytes, compress))
+            return false;
+    }
+
+    return true;
+}
+
+static bool inflate_all(fdu_compress* inflater,
+                        fdu_bufio_buffer* in,
+                        fdu_bufio_buffer* out)
+{
+    while (in->filled)
+    {
+        const unsigned int before = in->filled;
+
+        if (!fdu_compress_transform(in, out, false, inflater))
+            return false;
+
+        if (in->filled == before)
+            break;
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------
+
+static void round_trip(void)
+{
+    for (unsigned int i = 0; i < TextSize; ++i)
+        text[i] = "femc driver "[i % 12] + (i / 4096) % 3;
+
+    fdu_compress* deflater = fdu_new_compress(FDU_COMPRESS_DEFLATE, -1, FlushBytes);
+    fdu_compress* inflater = fdu_new_compress(FDU_COMPRESS_INFLATE, -1, 0);
+
+    if (!deflater
+        || !inflater)
+    {
+        fde_print_stack(stderr);
+        ++failures;
+        return;
+    }
+
+    fdu_bufio_buffer in   = plain_buffer(stage, sizeof(stage));
+    fdu_bufio_buffer wire = plain_buffer(compressed, sizeof(compressed));
+    fdu_bufio_buffer out  = plain_buffer(decompressed, sizeof(decompressed));
+
+    // the first part, flushed: the receiver gets all of it right away
+
+    bool ok = feed(deflater, &in, &wire, text, FirstPartSize, true)
+        && inflate_all(inflater, &wire, &out);
+
+    check(ok
+          && out.filled == FirstPartSize
+          && !memcmp(decompressed, text, FirstPartSize),
+          "flushed part decodes");
+
+    // the rest in chunks, then finished
+
+    for (unsigned int offset = FirstPartSize; ok && offset < TextSize; offset += ChunkSize)
+    {
+        const unsigned int bytes = (TextSize - offset < ChunkSize) ? TextSize - offset : ChunkSize;
+
+        ok = feed(deflater, &in, &wire, &text[offset], bytes, false);
+    }
+
+    fdu_compress_finish(deflater);
+
+    while (ok
+           && !fdu_compress_is_finished(deflater))
+    {
+        ok = fdu_compress_transform(&in, &wire, true, deflater);
+    }
+
+    ok = ok
+        && inflate_all(inflater, &wire, &out);
+
+    check(ok
+          && out.filled == TextSize
+          && !memcmp(decompressed, text, TextSize),
+          "round trip");
+
+    const fdu_compress_stats* stats = fdu_compress_get_stats(deflater);
+
+    check(stats->uncompressed == TextSize
+          && stats->flushes >= TextSize / FlushBytes
+          && fdu_compress_ratio(deflater) > 1,
+          "deflate statistics");
+
+    if (!ok)
+        fde_print_stack(stderr);
+
+    fdu_free_compress(deflater);
+    fdu_free_compress(inflater);
+}
+
+// the stage fails with data corruption only, nothing else on the stack
+
+static void corrupt(const char* what, const unsigned char* data, unsigned int size)
+{
+    fdu_compress* inflater = fdu_new_compress(FDU_COMPRESS_INFLATE, -1, 0);
+
+    if (!inflater) {
+        fde_print_stack(stderr);
+        ++failures;
+        return;
+    }
+
+    memcpy(stage, data, size);
+
+    fdu_bufio_buffer in  = plain_buffer(stage, sizeof(stage));
+    fdu_bufio_buffer out = plain_buffer(decompressed, sizeof(decompressed));
+
+    in.filled = size;
+
+    const fde_node_t* ectx = fde_push_context(fdu_context_compress);
+
+    const bool failed = !fdu_compress_transform(&in, &out, false, inflater);
+
+    check(failed
+          && fde_errors() == 1
+          && fde_get_last_error(fde_node_data_corruption_b),
+          what);
+
+    fde_reset_context(fdu_context_compress, ectx);
+    fde_pop_context(fdu_context_compress, ectx);
+
+    fdu_free_compress(inflater);
+}
+
+int main(void)
+{
+    round_trip();
+
+    static const unsigned char garbage[] = {
+        0x78, 0x9c, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+    static const unsigned char dictionary[] = {
+        0x78, 0x20, 0x00, 0x00, 0x00, 0x01,     // FDICT set, DICTID 1
+    };
+
+    corrupt("corrupt input", garbage, sizeof(garbage));
+    corrupt("preset dictionary", dictionary, sizeof(dictionary));
+
+    return failures ? 1 : 0;
+}
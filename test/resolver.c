@@ -0,0 +1,505 @@
+/* Femc Driver
+ * Copyright (C) 2020 Pauli Saksa
+ *
+ * Licensed under The MIT License, see file LICENSE.txt in this source tree.
+ */
+
+// fdu_resolver against two stub nameservers on localhost, served from the
+// same dispatcher:
+//
+//   a.test         A 10.0.0.1, no AAAA
+//   big.test       truncated over UDP, A 10.0.0.2 over TCP
+//   fail.test      SERVFAIL to the first query, A 10.0.0.3 to the next
+//   missing.test   NXDOMAIN
+//   timeout.test   never answered
+//   late.test      truncated over UDP, the AAAA answer late; A 10.0.0.4 over
+//                  TCP, answered after the AAAA one was truncated
+//
+// Then a lookup is cancelled by fdu_resolver_shutdown(), its callback
+// trying another one.
+
+#define _GNU_SOURCE
+
+#include "../dispatcher.h"
+#include "../error_stack.h"
+#include "../generic.h"
+#include "../resolver.h"
+#include "../utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum {
+    DnsHeaderSize   = 12,
+    DnsMaxMessage   = 65535,
+
+    DnsTypeA        = 1,
+    DnsTypeAAAA     = 28,
+
+    DnsFlagsAnswer  = 0x8180,           // QR, RD, RA
+    DnsFlagTC       = 0x0200,
+    DnsRcodeServFail = 2,
+    DnsRcodeNxDomain = 3,
+
+    StubServers     = 2,
+    TimeoutMsec     = 200,
+    LateMsec        = 50,               // the TCP connection is up by then
+    MaxRunMsec      = 5000,
+};
+
+typedef struct {
+    int udp_fd;
+    int tcp_fd;
+    struct sockaddr_in addr;
+    fdd_service_input udp_iserv;
+    fdd_service_input tcp_iserv;
+} stub_server;
+
+typedef struct {
+    int fd;
+    fdd_service_input iserv;
+    unsigned char buffer[2 + DnsMaxMessage];
+    unsigned int filled;
+} stub_connection;
+
+static stub_server stubs[StubServers];
+
+// a reply held back, see late.test
+
+typedef struct {
+    bool pending;                       // set by stub_answer()
+    bool tcp;
+    int fd;
+    struct sockaddr_in to;              // UDP
+    unsigned int size;
+    unsigned char reply[2 + DnsMaxMessage];
+} delayed_reply;
+
+static delayed_reply late_udp;          // the truncated AAAA answer
+static delayed_reply late_tcp = { .tcp = true };  // the A answer
+static unsigned int late_queries;       // over UDP
+
+static unsigned int fail_queries;
+static uint16_t fail_ports[2];          // source ports of the fail.test attempts
+
+static unsigned int lookups;
+static unsigned int failures;
+
+// ------------------------------------------------------------
+
+static void put_u16(unsigned char* p, unsigned int value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static unsigned int get_u16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static bool is_name(const unsigned char* qname, const char* wire)
+{
+    return !memcmp(qname, wire, strlen(wire) + 1);
+}
+
+// =0: no reply
+
+static unsigned int stub_answer(const unsigned char* query,
+                                unsigned int size,
+                                bool tcp,
+                                uint16_t port,
+                                unsigned char* reply)
+{
+    if (size < DnsHeaderSize + 5)
+        return 0;
+
+    // the question ends after the name, type and class
+
+    unsigned int end = DnsHeaderSize;
+
+    while (end < size && query[end])
+        end += 1 + query[end];
+
+    end += 1 + 4;
+
+    if (end > size)
+        return 0;
+
+    const unsigned char* qname = &query[DnsHeaderSize];
+    const unsigned int type    = get_u16(&query[end - 4]);
+
+    unsigned int flags = DnsFlagsAnswer;
+    unsigned char address[4] = { 10, 0, 0, 0 };
+
+    if (is_name(qname, "\x01" "a" "\x04" "test"))
+        address[3] = 1;
+    else if (is_name(qname, "\x03" "big" "\x04" "test")) {
+        if (tcp)
+            address[3] = 2;
+        else
+            flags |= DnsFlagTC;
+    }
+    else if (is_name(qname, "\x04" "fail" "\x04" "test")) {
+        if (fail_queries < 2)
+            fail_ports[fail_queries] = port;
+
+        if (!fail_queries++)
+            flags |= DnsRcodeServFail;
+        else
+            address[3] = 3;
+    }
+    else if (is_name(qname, "\x04" "late" "\x04" "test")) {
+        if (tcp) {
+            address[3] = 4;
+            late_tcp.pending = (type == DnsTypeA);
+        }
+        else {
+            flags |= DnsFlagTC;
+            late_udp.pending = (type == DnsTypeAAAA);
+            ++late_queries;
+        }
+    }
+    else if (is_name(qname, "\x07" "missing" "\x04" "test"))
+        flags |= DnsRcodeNxDomain;
+    else
+        return 0;                       // timeout.test
+
+    const bool answer = address[3] && type == DnsTypeA;
+
+    memcpy(reply, query, end);
+
+    put_u16(&reply[2], flags);
+    put_u16(&reply[6], answer ? 1 : 0);
+    put_u16(&reply[8], 0);
+    put_u16(&reply[10], 0);             // OPT dropped
+
+    if (!answer)
+        return end;
+
+    unsigned char* rr = &reply[end];
+
+    put_u16(&rr[0], 0xc000 | DnsHeaderSize);
+    put_u16(&rr[2], DnsTypeA);
+    put_u16(&rr[4], 1);                 // IN
+    put_u16(&rr[6], 0);
+    put_u16(&rr[8], 60);                // ttl
+    put_u16(&rr[10], sizeof(address));
+    memcpy(&rr[12], address, sizeof(address));
+
+    return end + 12 + sizeof(address);
+}
+
+static bool send_delayed(void* delayed_v, int UNUSED(id))
+{
+    delayed_reply* delayed = (delayed_reply*) delayed_v;
+
+    if (delayed->tcp)
+        send(delayed->fd, delayed->reply, delayed->size, MSG_NOSIGNAL);
+    else
+        sendto(delayed->fd, delayed->reply, delayed->size, 0,
+               (struct sockaddr*) &delayed->to, sizeof(delayed->to));
+
+    return true;
+}
+
+static bool hold_reply(delayed_reply* delayed,
+                       int fd,
+                       const unsigned char* reply,
+                       unsigned int size,
+                       fdd_msec_t msec)
+{
+    delayed->pending = false;
+    delayed->fd      = fd;
+    delayed->size    = size;
+
+    memcpy(delayed->reply, reply, size);
+
+    return fdd_add_timer(&send_delayed, delayed, 0, msec, 0);
+}
+
+static bool stub_udp_readable(void* UNUSED(context), int fd)
+{
+    unsigned char query[DnsMaxMessage];
+    unsigned char reply[DnsMaxMessage];
+
+    for (;;)
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+
+        const ssize_t bytes = recvfrom(fd, query, sizeof(query), MSG_DONTWAIT,
+                                       (struct sockaddr*) &from, &from_len);
+
+        if (bytes < 0)
+            return true;
+
+        const unsigned int size = stub_answer(query, bytes, false, ntohs(from.sin_port), reply);
+
+        if (late_udp.pending) {
+            late_udp.to = from;
+
+            if (!hold_reply(&late_udp, fd, reply, size, LateMsec))
+                return false;
+            continue;
+        }
+
+        if (size)
+            sendto(fd, reply, size, 0, (struct sockaddr*) &from, from_len);
+    }
+}
+
+static bool stub_tcp_readable(void* connection_v, int fd)
+{
+    stub_connection* connection = (stub_connection*) connection_v;
+
+    const ssize_t bytes = read(fd,
+                               &connection->buffer[connection->filled],
+                               sizeof(connection->buffer) - connection->filled);
+
+    if (bytes <= 0) {
+        if (bytes < 0
+            && errno == EAGAIN)
+        {
+            return true;
+        }
+
+        fdd_remove_input(fd);
+        fdu_safe_close(fd);
+        free(connection);
+        return true;
+    }
+
+    connection->filled += bytes;
+
+    while (connection->filled >= 2)
+    {
+        const unsigned int length = get_u16(connection->buffer);
+
+        if (connection->filled < 2 + length)
+            break;
+
+        unsigned char reply[2 + DnsMaxMessage];
+
+        const unsigned int size = stub_answer(&connection->buffer[2], length, true, 0, &reply[2]);
+
+        if (size) {
+            put_u16(reply, size);
+
+            if (!late_tcp.pending)
+                send(fd, reply, 2 + size, MSG_NOSIGNAL);
+            else if (!hold_reply(&late_tcp, fd, reply, 2 + size, 2 * LateMsec))
+                return false;
+        }
+
+        connection->filled -= 2 + length;
+        memmove(connection->buffer, &connection->buffer[2 + length], connection->filled);
+    }
+
+    return true;
+}
+
+static bool stub_tcp_accept(void* UNUSED(context), int fd)
+{
+    const int new_fd = accept4(fd, 0, 0, SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+    if (new_fd < 0)
+        return true;
+
+    stub_connection* connection = malloc(sizeof(stub_connection));
+
+    if (!connection) {
+        fdu_safe_close(new_fd);
+        return true;
+    }
+
+    connection->fd     = new_fd;
+    connection->filled = 0;
+
+    fdd_init_service_input(&connection->iserv, connection, &stub_tcp_readable);
+
+    return fdd_add_input(new_fd, &connection->iserv);
+}
+
+// UDP and TCP on the same port, as the resolver expects
+
+static bool open_stub(stub_server* stub)
+{
+    for (unsigned int tries = 0; tries < 10; ++tries)
+    {
+        memset(&stub->addr, 0, sizeof(stub->addr));
+
+        stub->addr.sin_family      = AF_INET;
+        stub->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        socklen_t addr_len = sizeof(stub->addr);
+
+        stub->udp_fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        stub->tcp_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+
+        if (stub->udp_fd >= 0
+            && stub->tcp_fd >= 0
+            && !bind(stub->udp_fd, (struct sockaddr*) &stub->addr, addr_len)
+            && !getsockname(stub->udp_fd, (struct sockaddr*) &stub->addr, &addr_len)
+            && !bind(stub->tcp_fd, (struct sockaddr*) &stub->addr, addr_len)
+            && !listen(stub->tcp_fd, 8))
+        {
+            fdd_init_service_input(&stub->udp_iserv, stub, &stub_udp_readable);
+            fdd_init_service_input(&stub->tcp_iserv, stub, &stub_tcp_accept);
+
+            return fdd_add_input(stub->udp_fd, &stub->udp_iserv)
+                && fdd_add_input(stub->tcp_fd, &stub->tcp_iserv);
+        }
+
+        fdu_safe_close(stub->udp_fd);
+        fdu_safe_close(stub->tcp_fd);
+    }
+
+    return false;
+}
+
+// ------------------------------------------------------------
+
+typedef struct {
+    const char* name;
+    unsigned int options;
+    fdu_resolver_status status;
+    unsigned int count;
+    unsigned char last_octet;           // of the first address
+} expectation;
+
+static const expectation expectations[] = {
+    { "a.test",       FDU_RESOLVE_IPV4|FDU_RESOLVE_IPV6, fdu_resolver_ok,       1, 1 },
+    { "big.test",     FDU_RESOLVE_IPV4,                  fdu_resolver_ok,       1, 2 },
+    { "fail.test",    FDU_RESOLVE_IPV4,                  fdu_resolver_ok,       1, 3 },
+    { "missing.test", FDU_RESOLVE_IPV4,                  fdu_resolver_nxdomain, 0, 0 },
+    { "timeout.test", FDU_RESOLVE_IPV4,                  fdu_resolver_timeout,  0, 0 },
+    { "late.test",    FDU_RESOLVE_IPV4|FDU_RESOLVE_IPV6, fdu_resolver_ok,       1, 4 },
+    { "127.0.0.1",    FDU_RESOLVE_IPV4,                  fdu_resolver_ok,       1, 1 },
+};
+
+enum { Expectations = sizeof(expectations) / sizeof(expectations[0]) };
+
+static void resolved(void* expectation_v, const fdu_resolver_answer* answer)
+{
+    const expectation* expected = (const expectation*) expectation_v;
+
+    const bool ok = answer->status == expected->status
+        && answer->count == expected->count
+        && (!answer->count
+            || (answer->addresses[0].family == AF_INET
+                && answer->addresses[0].addr[3] == expected->last_octet));
+
+    printf("%-14s %s (status %d, %u addresses)\n",
+           expected->name, ok ? "ok" : "FAILED", answer->status, answer->count);
+
+    if (!ok)
+        ++failures;
+
+    if (++lookups == Expectations)
+        fdd_shutdown();
+}
+
+// cancelled by the shutdown, a new lookup must not get a slot
+
+static unsigned int cancelled;
+static bool retried;
+
+static void cancel_retry(void* UNUSED(context), const fdu_resolver_answer* answer)
+{
+    if (answer->status == fdu_resolver_cancelled)
+        ++cancelled;
+
+    retried = fdu_resolver_lookup("a.test", FDU_RESOLVE_IPV4, &cancel_retry, 0);
+}
+
+int main(void)
+{
+    for (unsigned int i = 0; i < StubServers; ++i)
+    {
+        if (!open_stub(&stubs[i])) {
+            fprintf(stderr, "can't open a stub nameserver: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    if (!fdu_resolver_init("/dev/null")
+        || !fdu_resolver_set_timeout(TimeoutMsec, 1))
+    {
+        fde_print_stack(stderr);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < StubServers; ++i)
+    {
+        if (!fdu_resolver_add_server((struct sockaddr*) &stubs[i].addr, sizeof(stubs[i].addr))) {
+            fde_print_stack(stderr);
+            return 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < Expectations; ++i)
+    {
+        if (!fdu_resolver_lookup(expectations[i].name, expectations[i].options,
+                                 &resolved, (void*) &expectations[i]))
+        {
+            fde_print_stack(stderr);
+            return 1;
+        }
+    }
+
+    if (!fdd_main(MaxRunMsec)) {
+        fde_print_stack(stderr);
+        return 1;
+    }
+
+    if (lookups != Expectations) {
+        printf("%u lookups of %u finished\n", lookups, Expectations);
+        return 1;
+    }
+
+    // the retry went out from a socket of its own
+
+    if (fail_queries != 2
+        || fail_ports[0] == fail_ports[1])
+    {
+        printf("fail.test: %u queries, source ports %u and %u\n",
+               fail_queries, fail_ports[0], fail_ports[1]);
+        return 1;
+    }
+
+    // the late AAAA went over the open TCP connection, no second attempt
+
+    if (late_queries != 2) {
+        printf("late.test: %u queries over UDP\n", late_queries);
+        return 1;
+    }
+
+    if (!fdu_resolver_lookup("timeout.test", FDU_RESOLVE_IPV4, &cancel_retry, 0)) {
+        fde_print_stack(stderr);
+        return 1;
+    }
+
+    const fde_node_t* ectx = fde_push_context(fdu_context_resolver);
+
+    fdu_resolver_shutdown();
+
+    fde_reset_context(fdu_context_resolver, ectx);
+    fde_pop_context(fdu_context_resolver, ectx);
+
+    if (cancelled != 1
+        || retried
+        || fdu_resolver_in_flight())
+    {
+        printf("shutdown: %u cancelled, retry %s\n", cancelled, retried ? "started" : "rejected");
+        return 1;
+    }
+
+    return failures ? 1 : 0;
+}
@@ -4,22 +4,32 @@
  * Licensed under The MIT License, see file LICENSE.txt in this source tree.
  */
 
+#define _GNU_SOURCE
+
 #include "utils.h"
 #include "error_stack.h"
+#include "generic.h"
+#include "resolver.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef UNIX_PATH_MAX
@@ -41,6 +51,16 @@ fdu_memory_area init_memory_area_cont(unsigned char** beginp, const uint32_t siz
     return (fdu_memory_area){begin, end};
 }
 
+static uint64_t monotonic_usec(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*------------------------------------------------------------
  *
  * Buffered I/O services
@@ -52,15 +72,36 @@ enum {
     MaximumBufferSize = 1024*1024,
 };
 
+enum {
+    AdaptiveFirstShift  = 6,            // 1<<6  == MinimumBufferSize
+    AdaptiveLastShift   = 20,           // 1<<20 == MaximumBufferSize
+    AdaptiveClasses     = AdaptiveLastShift - AdaptiveFirstShift + 1,
+    AdaptivePoolDepth   = 16,           // free blocks kept per size class
+    AdaptiveSweepMsec   = 1000,
+};
+
+enum {
+    MmapDefaultWindow   = 64*1024*1024,
+    MmapMaximumWindow   = 1024*1024*1024,
+    MmapBurst           = 16,           // windows pumped before giving poll a turn
+    MmapFollowMsec      = 250,
+};
+
+enum {
+    ZeroCopyPollMsec    = 1,            // idle output waiting for completions
+};
+
 typedef enum {
     bufio_input,
     bufio_output,
+    bufio_mmap,
 } fdu_bufio_service_type;
 
 enum {  // cs = callstack
     bufio_cs_active     = 1,
     bufio_cs_closed     = 1 << 1,
     bufio_cs_freed      = 1 << 2,
+    bufio_cs_released   = 1 << 3,       // released while the mmap pump or zero-copy timer is pending
 };
 
 struct fdu_bufio_service_ {
@@ -78,981 +119,3366 @@ struct fdu_bufio_service_ {
 
     int close_errno;
     unsigned int callstack;
-};
 
-const unsigned int sizeof_fdu_bufio_service = sizeof(fdu_bufio_service);
+    // adaptive sizing, min_size == 0 for fixed-size buffers
 
-//
+    unsigned int min_size;
+    unsigned int max_size;
+    unsigned int peak_filled;
+    bool active;
 
-#define CALLSTACK   (service->callstack)
-#define CAN_XFER    (service->buffer.can_xfer)
-#define CONTEXT     (service->context)
-#define DATA        (service->buffer.data)
-#define FD          (service->buffer.fd)
-#define FILLED      (service->buffer.filled)
-#define NOTIFY      (service->notify)
-#define SIZE        (service->buffer.size)
+    fdu_bufio_service* adaptive_prev;
+    fdu_bufio_service* adaptive_next;
 
-static bool fdu_bufio_got_input(void* service_v, int fd)
-{
-    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+    // reads per input wakeup, see fdu_bufio_set_read_budget()
 
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_bufio)))
-        return false;
+    unsigned int read_budget_bytes;
+    unsigned int read_budget_reads;
+
+    // MSG_ZEROCOPY output, zc_base == 0 when not in use
     //
-    if (!service
-        || fd < 0)
-    {
-        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return false;
-    }
-    FDE_ASSERT( service->type == bufio_input , "invalid service type" , false );
-    FDE_ASSERT( fd == FD , "fd corrupted" , false );
-    FDE_ASSERT( FILLED <= SIZE , "filled > size (1)" , false );
+    // Sent bytes stay pinned in front of 'data' until the kernel has reported
+    // completion for every zero-copy send, then the buffer is compacted.
+    // Once half of the buffer is pinned, writes are copied until that
+    // happens. Completions come on the error queue, which select() doesn't
+    // tell apart from writability, so an idle output polls for them with a
+    // timer.
+
+    unsigned char* zc_base;
+    unsigned int zc_map_size;
+    unsigned int zc_capacity;
+    unsigned int zc_threshold;
+    unsigned int zc_pinned;
+    uint32_t zc_sent;
+    uint32_t zc_done;
+    bool zc_copied;
+    bool zc_timer;                      // completion poll timer pending
+
+    // watermarks, see fdu_bufio_set_watermarks()
     //
+    // Output side keeps the limits and 'bp_input', input side points back
+    // with 'bp_output'. A paused input is not registered to the dispatcher.
 
-    if (FILLED == SIZE) {
-        CAN_XFER = true;
+    fdu_bufio_service* bp_input;
+    fdu_bufio_service* bp_output;
+    unsigned int bp_high;
+    unsigned int bp_low;
+    bool bp_paused;
 
-        return fdd_remove_input(fd)
-            && fde_pop_context(fdu_context_bufio, ectx);
-    }
+    // memory-mapped file, see fdu_new_mmap_bufio()
+    //
+    // The mapping covers [mm_map_offset, mm_map_offset + mm_map_size) of the
+    // file, 'data' points to 'mm_position' in it.
+
+    unsigned char* mm_base;
+    uint64_t mm_map_offset;
+    uint64_t mm_map_size;
+    uint64_t mm_position;
+    uint64_t mm_notified;               // file offset notify has seen data up to
+    unsigned int mm_window;
+    unsigned int mm_burst;
+    bool mm_follow;
+    bool mm_timer;                      // pump timer pending
+};
 
-    const int i = read(fd, &DATA[FILLED], SIZE - FILLED);
+const unsigned int sizeof_fdu_bufio_service = sizeof(fdu_bufio_service);
 
-    if (CAN_XFER) {
-        CAN_XFER = false;
+// ----- adaptive buffer memory
+//
+// Adaptive bufios keep their data in power-of-two blocks. Released blocks are
+// kept in per-size free lists so that growing and shrinking busy connections
+// doesn't go through malloc every time.
 
-        if (!fdd_add_input(fd, &service->input_service))
-            return false;
-    }
+typedef struct bufio_pool_block_s {
+    struct bufio_pool_block_s* next;
+} bufio_pool_block;
 
-    bool lazy_close = false;
+static bufio_pool_block* bufio_pool[AdaptiveClasses];
+static unsigned int bufio_pool_count[AdaptiveClasses];
 
-    if (i > 0) {
-        FILLED += i;
+static fdu_bufio_service* adaptive_bufios = 0;
+static bool adaptive_sweep_running = false;
 
-        FDE_ASSERT_DEBUG( FILLED <= SIZE , "filled > size (2)" , false );
+static unsigned int bufio_size_class(unsigned int size)
+{
+    unsigned int shift = AdaptiveFirstShift;
 
-        if (NOTIFY) {
-            CALLSTACK |= bufio_cs_active;
+    while (shift < AdaptiveLastShift
+           && (1u << shift) < size)
+    {
+        ++shift;
+    }
 
-            lazy_close = (!NOTIFY(&service->buffer, CONTEXT)
-                          || (CALLSTACK & (bufio_cs_closed | bufio_cs_freed)));
+    return shift - AdaptiveFirstShift;
+}
 
-            CALLSTACK &= ~(bufio_cs_active | bufio_cs_closed);
-        }
-    }
-    else if (!i) {
-        lazy_close = true;
-    }
-    else if (errno != EINTR
-             && errno != EAGAIN)
-    {
-        // assert: i < 0 && errno == something_serious
+static unsigned char* bufio_pool_get(unsigned int size)
+{
+    const unsigned int sc = bufio_size_class(size);
 
-        lazy_close = true;
-        service->close_errno = errno;
-    }
+    if (bufio_pool[sc]) {
+        bufio_pool_block* block = bufio_pool[sc];
 
-    if (lazy_close)
-        fdu_bufio_close(&service->buffer);
+        bufio_pool[sc] = block->next;
+        --bufio_pool_count[sc];
 
-    return fde_safe_pop_context(fdu_context_bufio, ectx);
+        return (unsigned char*) block;
+    }
+
+    return malloc(1u << (sc + AdaptiveFirstShift));
 }
 
-static bool fdu_bufio_got_output(void* service_v, int fd)
+static void bufio_pool_put(unsigned char* data, unsigned int size)
 {
-    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+    if (!data)
+        return;
 
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_bufio)))
-        return false;
-    //
-    if (!service
-        || fd < 0)
-    {
-        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return false;
+    const unsigned int sc = bufio_size_class(size);
+
+    if (bufio_pool_count[sc] >= AdaptivePoolDepth) {
+        free(data);
+        return;
     }
-    FDE_ASSERT( service->type == bufio_output , "invalid service type" , false );
-    FDE_ASSERT( fd == FD , "fd corrupted" , false );
-    FDE_ASSERT( FILLED <= SIZE , "filled > size" , false );
-    //
 
-    if (!FILLED) {
-        CAN_XFER = true;
+    bufio_pool_block* block = (bufio_pool_block*) data;
 
-        return fdd_remove_output(fd)
-            && fde_pop_context(fdu_context_bufio, ectx);
-    }
+    block->next = bufio_pool[sc];
+    bufio_pool[sc] = block;
+    ++bufio_pool_count[sc];
+}
 
-    const int i = write(fd, DATA, FILLED);
+static bool bufio_resize(fdu_bufio_service* service, unsigned int new_size)
+{
+    FDE_ASSERT_DEBUG( service->min_size , "resizing fixed-size bufio" , false );
+    FDE_ASSERT_DEBUG( new_size >= service->buffer.filled , "resize would lose data" , false );
 
-    if (CAN_XFER) {
-        CAN_XFER = false;
+    unsigned char* const new_data = bufio_pool_get(new_size);
 
-        if (!fdd_add_output(fd, &service->output_service))
-            return false;
+    if (!new_data) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
     }
 
-    bool lazy_close = false;
+    if (service->buffer.filled)
+        memcpy(new_data, service->buffer.data, service->buffer.filled);
 
-    if (i > 0) {
-        FDE_ASSERT_DEBUG( (unsigned int)i <= FILLED , "i > filled" , false );
+    bufio_pool_put(service->buffer.data, service->buffer.size);
 
-        FILLED -= i;
+    service->buffer.data = new_data;
+    service->buffer.size = new_size;
 
-        if (FILLED)
-            memmove(DATA, &DATA[i], FILLED);
+    return true;
+}
 
-        if (NOTIFY) {
-            CALLSTACK |= bufio_cs_active;
+static bool bufio_can_grow(const fdu_bufio_service* service)
+{
+    return service->min_size
+        && service->buffer.size < service->max_size;
+}
 
-            lazy_close = (!NOTIFY(&service->buffer, CONTEXT)
-                          || (CALLSTACK & (bufio_cs_closed | bufio_cs_freed)));
+static bool bufio_grow(fdu_bufio_service* service, unsigned int needed)
+{
+    unsigned int new_size = service->buffer.size;
 
-            CALLSTACK &= ~(bufio_cs_active | bufio_cs_closed);
-        }
-    }
-    else if (errno == EPIPE) {
-        lazy_close = true;
-    }
-    else if (errno != EINTR
-             && errno != EAGAIN)
+    while (new_size < needed
+           && new_size < service->max_size)
     {
-        lazy_close = true;
-        service->close_errno = errno;
+        new_size <<= 1;
     }
 
-    if (lazy_close)
-        fdu_bufio_close(&service->buffer);
-
-    return fde_safe_pop_context(fdu_context_bufio, ectx);
+    return new_size == service->buffer.size
+        || bufio_resize(service, new_size);
 }
 
-// CALLSTACK undefined later
-#undef CAN_XFER
-#undef CONTEXT
-#undef DATA
-#undef FD
-#undef FILLED
-#undef NOTIFY
-#undef SIZE
-
-bool fdu_bufio_touch(fdu_bufio_buffer* buffer)
+static void bufio_release_service(fdu_bufio_service* service)
 {
-    fdu_bufio_service* service;
+    // the pump or the completion timer holds a pointer, it will finish the job
 
-    if (!buffer
-        || !(service = buffer->service)
-        || (service->type != bufio_input
-            && service->type != bufio_output))
+    if ((service->type == bufio_mmap && service->mm_timer)
+        || (service->zc_base && service->zc_timer))
     {
-        fde_push_context(fdu_context_bufio);
-        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return false;
+        service->callstack |= bufio_cs_released;
+        return;
     }
-    //
 
-    if (buffer->fd < 0)
-        return false;
-    if (!buffer->can_xfer)
-        return true;
+    if (service->mm_base)
+        munmap(service->mm_base, service->mm_map_size);
 
-    const fde_node_t* ectx;
+    if (service->min_size) {
+        if (service->adaptive_prev) service->adaptive_prev->adaptive_next = service->adaptive_next;
+        else                        adaptive_bufios = service->adaptive_next;
+        if (service->adaptive_next) service->adaptive_next->adaptive_prev = service->adaptive_prev;
 
-    if (!(ectx = fde_push_context(fdu_context_bufio)))
-        return false;
+        bufio_pool_put(service->buffer.data, service->buffer.size);
+    }
 
-    switch (service->type) {
-    case bufio_input:
-        if (buffer->filled < buffer->size)
-            fdu_bufio_got_input(service, buffer->fd);
-        break;
-    case bufio_output:
-        if (service->buffer.filled)
-            fdu_bufio_got_output(service, buffer->fd);
-        break;
+    // Pages still referenced by in-flight sends stay alive in the kernel, the
+    // mapping can be dropped any time.
 
-    default: return false;
-    }
+    if (service->zc_base)
+        munmap(service->zc_base, service->zc_map_size);
 
-    return fde_safe_pop_context(fdu_context_bufio, ectx);
+    free(service);
 }
 
-void fdu_bufio_close(fdu_bufio_buffer* buffer)
+static bool bufio_pause_input(fdu_bufio_service* input)
 {
-    fdu_bufio_service* service;
-
-    if (!buffer
-        || !(service = buffer->service)
-        || buffer->fd < 0)      // already closed
+    if (input->bp_paused
+        || input->buffer.fd < 0)
     {
-        return;
-    }
-
-    FDE_ASSERT( service->type == bufio_input
-                || service->type == bufio_output ,
-                "invalid service type" , );
-
-    if (CALLSTACK & bufio_cs_active) {
-        CALLSTACK |= bufio_cs_closed;
-        return;
+        return true;
     }
 
-    const int fd = buffer->fd;
+    input->bp_paused = true;
 
-    buffer->fd = -1;
+    // can_xfer: not registered anyway
+    return input->buffer.can_xfer
+        || fdd_remove_input(input->buffer.fd);
+}
 
-    const fde_node_t* ectx = fde_push_context(fdu_context_bufio);
+static bool bufio_resume_input(fdu_bufio_service* input)
+{
+    if (!input->bp_paused)
+        return true;
 
-    if (!buffer->can_xfer) {
-        switch (service->type) {
-        case bufio_input: fdd_remove_input(fd); break;
-        case bufio_output: fdd_remove_output(fd); break;
-        }
-    }
+    input->bp_paused = false;
 
-    //
+    if (input->buffer.fd < 0)
+        return true;
 
-    CALLSTACK |= bufio_cs_active;
+    // can_xfer: not registered, like after a pause. Full and can't grow, it
+    // waits for fdu_bufio_touch() after the user has made room.
 
-    service->close(&service->buffer, service->context, fd, service->close_errno);
+    if (input->buffer.can_xfer)
+    {
+        if (input->buffer.filled == input->buffer.size
+            && !bufio_can_grow(input))
+        {
+            return true;
+        }
 
-    const bool lazy_free = (CALLSTACK & bufio_cs_freed);
+        input->buffer.can_xfer = false;
+    }
 
-    CALLSTACK &= ~(bufio_cs_active | bufio_cs_freed);
+    return fdd_add_input(input->buffer.fd, &input->input_service);
+}
 
-    //
+static bool bufio_check_watermarks(fdu_bufio_service* output)
+{
+    fdu_bufio_service* const input = output->bp_input;
 
-    if (lazy_free)
-        free(service);
+    if (!input)
+        return true;
 
-    //
+    if (output->buffer.filled >= output->bp_high)
+        return bufio_pause_input(input);
+    if (output->buffer.filled <= output->bp_low)
+        return bufio_resume_input(input);
 
-    if (ectx)
-        fde_safe_pop_context(fdu_context_bufio, ectx);
+    return true;
 }
 
-void fdu_bufio_free(fdu_bufio_buffer* buffer)
+static void bufio_unlink_watermarks(fdu_bufio_service* service)
 {
-    fdu_bufio_service* service;
+    if (service->bp_input) {
+        bufio_resume_input(service->bp_input);
 
-    if (!buffer
-        || !(service = buffer->service))
-    {
-        return;
+        service->bp_input->bp_output = 0;
+        service->bp_input = 0;
     }
 
-    if (CALLSTACK & bufio_cs_active) {
-        CALLSTACK |= bufio_cs_freed;
-        return;
+    if (service->bp_output) {
+        service->bp_output->bp_input = 0;
+        service->bp_output = 0;
     }
+}
 
-    //
+static void bufio_consume(fdu_bufio_buffer* buffer, unsigned int bytes)
+{
+    fdu_bufio_service* const service = buffer->service;
 
-    if (fdu_bufio_is_closed(buffer)) {
-        free(service);
+    buffer->filled -= bytes;
+
+    if (service
+        && service->type == bufio_mmap)
+    {
+        // read-only view, just move it
+        buffer->data        += bytes;
+        buffer->size        -= bytes;
+        service->mm_position += bytes;
     }
-    else {
-        CALLSTACK |= bufio_cs_freed;
-        fdu_bufio_close(buffer);       
+    else if (buffer->filled) {
+        memmove(buffer->data, &buffer->data[bytes], buffer->filled);
     }
 }
 
-#undef CALLSTACK
-
-unsigned int fdu_bufio_transfer(fdu_bufio_buffer* dst,
-                                fdu_bufio_buffer* src)
+static bool bufio_zerocopy_reap(fdu_bufio_service* service, bool* released)
 {
-    if (!dst
-        || !src)
+    *released = false;
+
+    while (service->zc_done != service->zc_sent)
     {
-        return 0;
+        unsigned char control[128];
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(service->buffer.fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN
+                || errno == EINTR)
+            {
+                break;
+            }
+
+            fde_push_stdlib_error("recvmsg(MSG_ERRQUEUE)", errno);
+            return false;
+        }
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+             cm;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY
+                || ee.ee_errno != 0)
+            {
+                continue;
+            }
+
+            // [ee_info, ee_data] is an inclusive range of send counters
+            service->zc_done += ee.ee_data - ee.ee_info + 1;
+
+            // kernel had to copy anyway (e.g. loopback), stop paying for pinning
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                service->zc_copied = true;
+        }
+    }
+
+    if (service->zc_pinned
+        && service->zc_done == service->zc_sent)
+    {
+        if (service->buffer.filled)
+            memmove(service->zc_base, service->buffer.data, service->buffer.filled);
+
+        service->buffer.data = service->zc_base;
+        service->buffer.size = service->zc_capacity;
+        service->zc_pinned   = 0;
+
+        *released = true;
+    }
+
+    return true;
+}
+
+static bool fdu_bufio_got_output(void* service_v, int fd);
+
+static bool bufio_zerocopy_poll(void* service_v, int UNUSED(id))
+{
+    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+
+    service->zc_timer = false;
+
+    if (service->callstack & bufio_cs_released) {
+        bufio_release_service(service);
+        return true;
+    }
+
+    // with data waiting the output is registered, writes reap completions
+
+    if (service->buffer.fd < 0
+        || !service->zc_pinned
+        || service->buffer.filled)
+    {
+        return true;
+    }
+
+    return fdu_bufio_got_output(service, service->buffer.fd);
+}
+
+static bool bufio_zerocopy_schedule(fdu_bufio_service* service)
+{
+    if (service->zc_timer)
+        return true;
+
+    if (!fdd_add_timer(&bufio_zerocopy_poll, service, 0, ZeroCopyPollMsec, 0))
+        return false;
+
+    service->zc_timer = true;
+    return true;
+}
+
+static bool bufio_adaptive_sweep(void* UNUSED(context), int UNUSED(id))
+{
+    if (!adaptive_bufios) {
+        adaptive_sweep_running = false;
+
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_kill_recurring_timer);
+        return false;
+    }
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_bufio)))
+        return false;
+    //
+
+    for (fdu_bufio_service* service = adaptive_bufios;
+         service;
+         service = service->adaptive_next)
+    {
+        const unsigned int size = service->buffer.size;
+        unsigned int new_size   = size;
+
+        if (!service->active
+            && !service->buffer.filled)
+        {
+            // idle: give everything above the minimum back to the pool
+            new_size = service->min_size;
+        }
+        else if (service->peak_filled <= size / 4
+                 && size / 2 >= service->min_size)
+        {
+            new_size = size / 2;
+        }
+
+        // no memory for the smaller one, keep this buffer and go on
+
+        if (new_size < size
+            && new_size >= service->buffer.filled
+            && !bufio_resize(service, new_size))
+        {
+            fde_reset_context(fdu_context_bufio, ectx);
+        }
+
+        service->active      = false;
+        service->peak_filled = service->buffer.filled;
+    }
+
+    return fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+// ----- memory-mapped file input
+
+static bool bufio_mmap_pump(void* service_v, int id);
+
+static bool bufio_mmap_schedule(fdu_bufio_service* service, fdd_msec_t msec)
+{
+    if (service->mm_timer)
+        return true;
+
+    if (!fdd_add_timer(&bufio_mmap_pump, service, 0, msec, 0))
+        return false;
+
+    service->mm_timer = true;
+    return true;
+}
+
+static void bufio_mmap_unmap(fdu_bufio_service* service)
+{
+    if (service->mm_base)
+        munmap(service->mm_base, service->mm_map_size);
+
+    service->mm_base       = 0;
+    service->mm_map_size   = 0;
+    service->buffer.data   = 0;
+    service->buffer.size   = 0;
+    service->buffer.filled = 0;
+}
+
+// Maps the window starting from the page 'mm_position' is in. errno is set
+// on failure.
+
+static bool bufio_mmap_remap(fdu_bufio_service* service, const uint64_t file_size)
+{
+    const uint64_t page_mask  = ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    const uint64_t position   = service->mm_position;
+    const uint64_t map_offset = position & page_mask;
+
+    uint64_t map_size = file_size - map_offset;
+    if (map_size > service->mm_window)
+        map_size = service->mm_window;
+
+    unsigned char* const base = mmap(0, map_size, PROT_READ, MAP_SHARED,
+                                     service->buffer.fd, map_offset);
+    if (base == MAP_FAILED)
+        return false;
+
+    // advisory only, failure changes nothing
+    madvise(base, map_size, MADV_SEQUENTIAL);
+
+    bufio_mmap_unmap(service);
+
+    service->mm_base       = base;
+    service->mm_map_offset = map_offset;
+    service->mm_map_size   = map_size;
+
+    service->buffer.data   = base + (position - map_offset);
+    service->buffer.filled = map_offset + map_size - position;
+    service->buffer.size   = service->buffer.filled;
+
+    return true;
+}
+
+static bool bufio_mmap_pump(void* service_v, int UNUSED(id))
+{
+    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+
+    service->mm_timer = false;
+
+    if (service->callstack & bufio_cs_released) {
+        bufio_release_service(service);
+        return true;
+    }
+
+    if (service->buffer.fd < 0)
+        return true;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdb_context_storage_file_mmap)))
+        return false;
+    //
+
+    const uint64_t position = service->mm_position;
+    const uint64_t map_end  = service->mm_map_offset + service->mm_map_size;
+
+    struct stat st;
+    bool lazy_close = false;
+
+    if (fstat(service->buffer.fd, &st) < 0) {
+        lazy_close = true;
+        service->close_errno = errno;
+    }
+    else if (service->mm_map_size
+             && (uint64_t) st.st_size < map_end)
+    {
+        // truncated, touching the tail of the mapping would raise SIGBUS
+        bufio_mmap_unmap(service);
+
+        lazy_close = true;
+        service->close_errno = EIO;
+    }
+
+    const uint64_t file_size = lazy_close ? 0 : (uint64_t) st.st_size;
+
+    if (!lazy_close)
+    {
+        const uint64_t window_end = ((position & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1))
+                                     + service->mm_window);
+        const uint64_t wanted_end = (file_size < window_end) ? file_size : window_end;
+
+        if (wanted_end > map_end
+            && !bufio_mmap_remap(service, file_size))
+        {
+            lazy_close = true;
+            service->close_errno = errno;
+        }
+    }
+
+    if (!lazy_close
+        && position + service->buffer.filled > service->mm_notified)
+    {
+        service->mm_notified = position + service->buffer.filled;
+
+        if (service->notify) {
+            service->callstack |= bufio_cs_active;
+
+            if (!service->notify(&service->buffer, service->context)
+                || (service->callstack & (bufio_cs_closed | bufio_cs_freed)))
+            {
+                lazy_close = true;
+            }
+
+            service->callstack &= ~(bufio_cs_active | bufio_cs_closed);
+        }
+    }
+
+    if (!lazy_close)
+    {
+        const bool at_end = (service->mm_map_offset + service->mm_map_size >= file_size);
+
+        if (at_end
+            && !service->mm_follow)
+        {
+            lazy_close = true;          // EOF, data stays mapped until freed
+        }
+        else if (at_end) {
+            if (!bufio_mmap_schedule(service, MmapFollowMsec))
+                return false;
+        }
+        else if (service->mm_position > position) {
+            // Consumed, slide the window. Now and then let the dispatcher
+            // poll in between, this could otherwise go on for gigabytes.
+
+            const fdd_msec_t msec = (++service->mm_burst < MmapBurst) ? 0 : 1;
+
+            if (msec)
+                service->mm_burst = 0;
+
+            if (!bufio_mmap_schedule(service, msec))
+                return false;
+        }
+        // else: the window is full, fdu_bufio_touch() continues
+    }
+
+    if (lazy_close)
+        fdu_bufio_close(&service->buffer);
+
+    return fde_safe_pop_context(fdb_context_storage_file_mmap, ectx);
+}
+
+//
+
+#define CALLSTACK   (service->callstack)
+#define CAN_XFER    (service->buffer.can_xfer)
+#define CONTEXT     (service->context)
+#define DATA        (service->buffer.data)
+#define FD          (service->buffer.fd)
+#define FILLED      (service->buffer.filled)
+#define NOTIFY      (service->notify)
+#define SIZE        (service->buffer.size)
+
+static bool fdu_bufio_got_input(void* service_v, int fd)
+{
+    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_bufio)))
+        return false;
+    //
+    if (!service
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    FDE_ASSERT( service->type == bufio_input , "invalid service type" , false );
+    FDE_ASSERT( fd == FD , "fd corrupted" , false );
+    FDE_ASSERT( FILLED <= SIZE , "filled > size (1)" , false );
+    //
+
+    if (service->bp_paused)
+        return fde_safe_pop_context(fdu_context_bufio, ectx);
+
+    if (FILLED == SIZE) {
+        if (!bufio_can_grow(service)) {
+            CAN_XFER = true;
+
+            return fdd_remove_input(fd)
+                && fde_pop_context(fdu_context_bufio, ectx);
+        }
+
+        if (!bufio_grow(service, SIZE + 1))
+            return false;
+    }
+
+    // First read is a plain read(), any further ones (read budget) must not
+    // block even if the fd does.
+
+    unsigned int reads = 0;
+    unsigned int total = 0;
+    int i;
+
+    for (;;) {
+        const unsigned int space = SIZE - FILLED;
+
+        i = reads
+            ? recv(fd, &DATA[FILLED], space, MSG_DONTWAIT)
+            : read(fd, &DATA[FILLED], space);
+
+        if (!reads++
+            && CAN_XFER)
+        {
+            CAN_XFER = false;
+
+            if (!fdd_add_input(fd, &service->input_service))
+                return false;
+        }
+
+        if (i <= 0)
+            break;
+
+        FILLED += i;
+        total  += i;
+
+        FDE_ASSERT_DEBUG( FILLED <= SIZE , "filled > size (2)" , false );
+
+        if (service->min_size) {
+            service->active = true;
+            if (FILLED > service->peak_filled)
+                service->peak_filled = FILLED;
+
+            // read took all the space there was, expect more to come
+            if ((unsigned int)i == space
+                && bufio_can_grow(service)
+                && !bufio_grow(service, SIZE + 1))
+            {
+                return false;
+            }
+        }
+
+        if (reads >= service->read_budget_reads
+            || total >= service->read_budget_bytes
+            || FILLED == SIZE)
+        {
+            break;
+        }
+    }
+
+    bool lazy_close = false;
+
+    if (!i) {
+        lazy_close = true;
+    }
+    else if (i < 0
+             && errno != EINTR
+             && errno != EAGAIN
+             && errno != EWOULDBLOCK
+             && !(reads > 1 && errno == ENOTSOCK))
+    {
+        // assert: i < 0 && errno == something_serious
+
+        lazy_close = true;
+        service->close_errno = errno;
+    }
+
+    if (total
+        && NOTIFY)
+    {
+        CALLSTACK |= bufio_cs_active;
+
+        if (!NOTIFY(&service->buffer, CONTEXT)
+            || (CALLSTACK & (bufio_cs_closed | bufio_cs_freed)))
+        {
+            lazy_close = true;
+        }
+
+        CALLSTACK &= ~(bufio_cs_active | bufio_cs_closed);
+    }
+
+    // the usual notify moves data to the linked output, stop reading if it
+    // didn't all fit
+
+    if (!lazy_close
+        && service->bp_output
+        && !bufio_check_watermarks(service->bp_output))
+    {
+        return false;
+    }
+
+    if (lazy_close)
+        fdu_bufio_close(&service->buffer);
+
+    return fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+static bool fdu_bufio_got_output(void* service_v, int fd)
+{
+    fdu_bufio_service* service = (fdu_bufio_service*) service_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_bufio)))
+        return false;
+    //
+    if (!service
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    FDE_ASSERT( service->type == bufio_output , "invalid service type" , false );
+    FDE_ASSERT( fd == FD , "fd corrupted" , false );
+    FDE_ASSERT( FILLED <= SIZE , "filled > size" , false );
+    //
+
+    bool released = false;
+
+    if (service->zc_base
+        && !bufio_zerocopy_reap(service, &released))
+    {
+        return false;
+    }
+
+    if (!FILLED) {
+        // sends are waiting for completion and the user may be waiting for
+        // the space: poll with the timer, the socket stays writable
+
+        if (service->zc_pinned) {
+            if (!CAN_XFER) {
+                CAN_XFER = true;
+
+                if (!fdd_remove_output(fd))
+                    return false;
+            }
+
+            return bufio_zerocopy_schedule(service)
+                && fde_pop_context(fdu_context_bufio, ectx);
+        }
+
+        if (released && NOTIFY) {
+            CALLSTACK |= bufio_cs_active;
+
+            const bool lazy_close = (!NOTIFY(&service->buffer, CONTEXT)
+                                     || (CALLSTACK & (bufio_cs_closed | bufio_cs_freed)));
+
+            CALLSTACK &= ~(bufio_cs_active | bufio_cs_closed);
+
+            if (lazy_close) {
+                fdu_bufio_close(&service->buffer);
+                return fde_safe_pop_context(fdu_context_bufio, ectx);
+            }
+
+            if (FILLED)
+                return fde_safe_pop_context(fdu_context_bufio, ectx);
+        }
+
+        CAN_XFER = true;
+
+        return fdd_remove_output(fd)
+            && bufio_check_watermarks(service)
+            && fde_pop_context(fdu_context_bufio, ectx);
+    }
+
+    if (service->min_size) {
+        service->active = true;
+        if (FILLED > service->peak_filled)
+            service->peak_filled = FILLED;
+    }
+
+    // half of the buffer pinned: copy until the completions give it back
+
+    const bool zerocopy = (service->zc_base
+                           && !service->zc_copied
+                           && FILLED >= service->zc_threshold
+                           && service->zc_pinned < service->zc_capacity / 2);
+
+    bool pinned = zerocopy;
+
+    int i = zerocopy
+        ? send(fd, DATA, FILLED, MSG_ZEROCOPY)
+        : write(fd, DATA, FILLED);
+
+    // ENOBUFS: out of pinnable memory (optmem), copying still works
+    if (zerocopy
+        && i < 0
+        && errno == ENOBUFS)
+    {
+        pinned = false;
+        i = write(fd, DATA, FILLED);
+    }
+
+    if (CAN_XFER) {
+        CAN_XFER = false;
+
+        if (!fdd_add_output(fd, &service->output_service))
+            return false;
+    }
+
+    bool lazy_close = false;
+
+    if (i > 0) {
+        FDE_ASSERT_DEBUG( (unsigned int)i <= FILLED , "i > filled" , false );
+
+        FILLED -= i;
+
+        if (pinned) {
+            // sent bytes stay where they are until completion
+            ++service->zc_sent;
+            service->zc_pinned += i;
+
+            DATA += i;
+            SIZE -= i;
+        }
+        else if (FILLED)
+            memmove(DATA, &DATA[i], FILLED);
+
+        if (NOTIFY) {
+            CALLSTACK |= bufio_cs_active;
+
+            lazy_close = (!NOTIFY(&service->buffer, CONTEXT)
+                          || (CALLSTACK & (bufio_cs_closed | bufio_cs_freed)));
+
+            CALLSTACK &= ~(bufio_cs_active | bufio_cs_closed);
+        }
+
+        if (!lazy_close
+            && !bufio_check_watermarks(service))
+        {
+            return false;
+        }
+    }
+    else if (errno == EPIPE) {
+        lazy_close = true;
+    }
+    else if (errno != EINTR
+             && errno != EAGAIN)
+    {
+        lazy_close = true;
+        service->close_errno = errno;
+    }
+
+    if (lazy_close)
+        fdu_bufio_close(&service->buffer);
+
+    return fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+// CALLSTACK undefined later
+#undef CAN_XFER
+#undef CONTEXT
+#undef DATA
+#undef FD
+#undef FILLED
+#undef NOTIFY
+#undef SIZE
+
+bool fdu_bufio_touch(fdu_bufio_buffer* buffer)
+{
+    fdu_bufio_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || (service->type != bufio_input
+            && service->type != bufio_output
+            && service->type != bufio_mmap))
+    {
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (buffer->fd < 0)
+        return false;
+
+    if (service->type == bufio_mmap)
+        return bufio_mmap_schedule(service, 0);
+
+    const fde_node_t* ectx;
+
+    if (service->bp_input
+        || service->bp_paused)
+    {
+        if (!(ectx = fde_push_context(fdu_context_bufio)))
+            return false;
+
+        if (service->bp_input
+            && !bufio_check_watermarks(service))
+        {
+            return false;
+        }
+
+        fde_safe_pop_context(fdu_context_bufio, ectx);
+
+        if (service->bp_paused)         // still paused, the output resumes it at bp_low
+            return true;
+    }
+
+    if (!buffer->can_xfer)
+        return true;
+
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return false;
+
+    switch (service->type) {
+    case bufio_input:
+        if (buffer->filled < buffer->size
+            || bufio_can_grow(service))
+        {
+            fdu_bufio_got_input(service, buffer->fd);
+        }
+        break;
+    case bufio_output:
+        if (service->buffer.filled)
+            fdu_bufio_got_output(service, buffer->fd);
+        break;
+    case bufio_mmap:
+        break;
+
+    default: return false;
+    }
+
+    return fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+void fdu_bufio_close(fdu_bufio_buffer* buffer)
+{
+    fdu_bufio_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || buffer->fd < 0)      // already closed
+    {
+        return;
+    }
+
+    FDE_ASSERT( service->type == bufio_input
+                || service->type == bufio_output
+                || service->type == bufio_mmap ,
+                "invalid service type" , );
+
+    if (CALLSTACK & bufio_cs_active) {
+        CALLSTACK |= bufio_cs_closed;
+        return;
+    }
+
+    const int fd = buffer->fd;
+
+    buffer->fd = -1;
+
+    const fde_node_t* ectx = fde_push_context(fdu_context_bufio);
+
+    if (!buffer->can_xfer
+        && !service->bp_paused)
+    {
+        switch (service->type) {
+        case bufio_input: fdd_remove_input(fd); break;
+        case bufio_output: fdd_remove_output(fd); break;
+        case bufio_mmap: break;         // timer driven
+        }
+    }
+
+    service->bp_paused = false;
+    bufio_unlink_watermarks(service);
+
+    //
+
+    CALLSTACK |= bufio_cs_active;
+
+    service->close(&service->buffer, service->context, fd, service->close_errno);
+
+    const bool lazy_free = (CALLSTACK & bufio_cs_freed);
+
+    CALLSTACK &= ~(bufio_cs_active | bufio_cs_freed);
+
+    //
+
+    if (lazy_free)
+        bufio_release_service(service);
+
+    //
+
+    if (ectx)
+        fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+void fdu_bufio_close_error(fdu_bufio_buffer* buffer, const int error)
+{
+    if (!buffer
+        || !buffer->service
+        || buffer->fd < 0)
+    {
+        return;
+    }
+
+    buffer->service->close_errno = error;
+    fdu_bufio_close(buffer);
+}
+
+void fdu_bufio_free(fdu_bufio_buffer* buffer)
+{
+    fdu_bufio_service* service;
+
+    if (!buffer
+        || !(service = buffer->service))
+    {
+        return;
+    }
+
+    if (CALLSTACK & bufio_cs_active) {
+        CALLSTACK |= bufio_cs_freed;
+        return;
+    }
+
+    //
+
+    if (fdu_bufio_is_closed(buffer)) {
+        bufio_release_service(service);
+    }
+    else {
+        CALLSTACK |= bufio_cs_freed;
+        fdu_bufio_close(buffer);       
+    }
+}
+
+#undef CALLSTACK
+
+bool fdu_bufio_set_read_budget(fdu_bufio_buffer* buffer,
+                               unsigned int max_bytes,
+                               unsigned int max_reads)
+{
+    fdu_bufio_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || service->type != bufio_input)
+    {
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    service->read_budget_bytes = max_bytes ? max_bytes : UINT32_MAX;
+    service->read_budget_reads = max_reads ? max_reads : 1;
+
+    return true;
+}
+
+bool fdu_bufio_set_zerocopy(fdu_bufio_buffer* buffer, unsigned int threshold)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return false;
+    //
+    fdu_bufio_service* service;
+
+    if (!buffer
+        || !(service = buffer->service)
+        || service->type != bufio_output
+        || service->min_size            // adaptive buffers move around
+        || service->zc_base
+        || buffer->fd < 0
+        || !buffer->size)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    const int one = 1;
+
+    if (setsockopt(buffer->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        fde_push_stdlib_error("setsockopt(SO_ZEROCOPY)", errno);
+        return false;
+    }
+
+    // Pinned pages must not be handed back to malloc while the kernel may
+    // still read them, so the buffer gets its own mapping.
+
+    const long page_size = sysconf(_SC_PAGESIZE);
+    const unsigned int map_size = (buffer->size + page_size - 1) / page_size * page_size;
+
+    unsigned char* const base = mmap(0, map_size,
+                                     PROT_READ|PROT_WRITE,
+                                     MAP_PRIVATE|MAP_ANONYMOUS,
+                                     -1, 0);
+    if (base == MAP_FAILED) {
+        fde_push_stdlib_error("mmap", errno);
+        return false;
+    }
+
+    if (buffer->filled)
+        memcpy(base, buffer->data, buffer->filled);
+
+    buffer->data = base;
+
+    service->zc_base      = base;
+    service->zc_map_size  = map_size;
+    service->zc_capacity  = buffer->size;
+    service->zc_threshold = threshold;
+    service->zc_pinned    = 0;
+    service->zc_sent      = 0;
+    service->zc_done      = 0;
+    service->zc_copied    = false;
+    service->zc_timer     = false;
+
+    return fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+bool fdu_bufio_reserve(fdu_bufio_buffer* buffer, unsigned int bytes)
+{
+    fdu_bufio_service* service;
+
+    if (!buffer) {
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (buffer->size - buffer->filled >= bytes)
+        return true;
+
+    if (!(service = buffer->service)
+        || !bufio_can_grow(service))
+    {
+        return false;
+    }
+
+    // it can't grow that much
+
+    if ((uint64_t) buffer->filled + bytes > service->max_size)
+        return false;
+
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return false;
+
+    if (buffer->filled + bytes > service->peak_filled)
+        service->peak_filled = buffer->filled + bytes;
+
+    return bufio_grow(service, buffer->filled + bytes)
+        && fde_safe_pop_context(fdu_context_bufio, ectx)
+        && buffer->size - buffer->filled >= bytes;
+}
+
+bool fdu_bufio_set_watermarks(fdu_bufio_buffer* output,
+                              fdu_bufio_buffer* input,
+                              unsigned int high,
+                              unsigned int low)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return false;
+    //
+    fdu_bufio_service* os;
+    fdu_bufio_service* is = 0;
+
+    if (!output
+        || !(os = output->service)
+        || os->type != bufio_output
+        || output->fd < 0
+        || (input
+            && (!(is = input->service)
+                || is->type != bufio_input
+                || input->fd < 0
+                || !high
+                || low >= high)))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (os->bp_input)
+        bufio_unlink_watermarks(os);
+    if (is && is->bp_output)
+        bufio_unlink_watermarks(is);
+
+    if (!is)
+        return fde_safe_pop_context(fdu_context_bufio, ectx);
+
+    os->bp_input  = is;
+    os->bp_high   = high;
+    os->bp_low    = low;
+    is->bp_output = os;
+
+    return bufio_check_watermarks(os)
+        && fde_safe_pop_context(fdu_context_bufio, ectx);
+}
+
+bool fdu_bufio_consume(fdu_bufio_buffer* buffer, unsigned int bytes)
+{
+    if (!buffer
+        || bytes > buffer->filled)
+    {
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (bytes)
+        bufio_consume(buffer, bytes);
+
+    return true;
+}
+
+unsigned int fdu_bufio_transfer(fdu_bufio_buffer* dst,
+                                fdu_bufio_buffer* src)
+{
+    if (!dst
+        || !src)
+    {
+        return 0;
+    }
+
+    // grow an adaptive destination as far as it goes, a failed grow only
+    // means a smaller transfer
+
+    if (dst->size - dst->filled < src->filled
+        && dst->service
+        && dst->service->min_size)
+    {
+        const unsigned int room   = dst->service->max_size - dst->filled;
+        const unsigned int wanted = (src->filled < room) ? src->filled : room;
+
+        const fde_node_t* ectx;
+        if ((ectx =fde_push_context(fdu_context_bufio)))
+        {
+            if (!fdu_bufio_reserve(dst, wanted))
+                fde_reset_context(fdu_context_bufio, ectx);
+
+            fde_pop_context(fdu_context_bufio, ectx);
+        }
+    }
+
+    const unsigned int offer = src->filled;
+    const unsigned int space = dst->size - dst->filled;
+    const unsigned int bytes = (offer < space) ? offer : space;
+
+    if (!bytes)
+        return 0;
+
+    memcpy(&dst->data[dst->filled],
+           src->data,
+           bytes);
+
+    dst->filled += bytes;
+
+    bufio_consume(src, bytes);
+
+    if (dst->service
+        && dst->service->bp_input
+        && dst->filled >= dst->service->bp_high)
+    {
+        bufio_pause_input(dst->service->bp_input);
+    }
+
+    return bytes;
+}
+
+// ------------------------------------------------------------
+
+fdu_bufio_buffer* fdu_new_input_bufio(const int fd,
+                                      const unsigned int size,
+                                      void* const context,
+                                      const fdu_bufio_notify_func notify_callback,
+                                      const fdu_bufio_close_func close_callback)
+{
+    const size_t total_size = sizeof_fdu_bufio_service + size;
+
+    unsigned char* const allocated = malloc(total_size);
+
+    if (!allocated) {
+        fde_push_context(fdu_context_bufio);
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    unsigned char* counter = allocated;
+
+    const fdu_memory_area
+        service_memory  = init_memory_area_cont(&counter, sizeof_fdu_bufio_service),
+        buffer_memory   = init_memory_area_cont(&counter, size);
+
+    fdu_bufio_buffer* const bufio
+        = fdu_new_input_bufio_inplace(fd,
+                                      service_memory,
+                                      buffer_memory,
+                                      context,
+                                      notify_callback,
+                                      close_callback);
+
+    if (!bufio)
+        free(allocated);
+
+    return bufio;
+}
+
+fdu_bufio_buffer* fdu_new_output_bufio(const int fd,
+                                       const unsigned int size,
+                                       void* const context,
+                                       const fdu_bufio_notify_func notify_callback,
+                                       const fdu_bufio_close_func close_callback)
+{
+    const size_t total_size = sizeof_fdu_bufio_service + size;
+
+    unsigned char* const allocated = malloc(total_size);
+
+    if (!allocated) {
+        fde_push_context(fdu_context_bufio);
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    unsigned char* counter = allocated;
+
+    const fdu_memory_area
+        service_memory  = init_memory_area_cont(&counter, sizeof_fdu_bufio_service),
+        buffer_memory   = init_memory_area_cont(&counter, size);
+
+    fdu_bufio_buffer* const bufio
+        = fdu_new_output_bufio_inplace(fd,
+                                       service_memory,
+                                       buffer_memory,
+                                       context,
+                                       notify_callback,
+                                       close_callback);
+
+    if (!bufio)
+        free(allocated);
+
+    return bufio;
+}
+
+static fdu_bufio_buffer* fdu_new_bufio_adaptive(const fdu_bufio_service_type type,
+                                                const int fd,
+                                                unsigned int min_size,
+                                                unsigned int max_size,
+                                                void* const context,
+                                                const fdu_bufio_notify_func notify_callback,
+                                                const fdu_bufio_close_func close_callback)
+{
+    if (min_size < MinimumBufferSize) min_size = MinimumBufferSize;
+    if (max_size > MaximumBufferSize) max_size = MaximumBufferSize;
+
+    min_size = 1u << (bufio_size_class(min_size) + AdaptiveFirstShift);
+    max_size = 1u << (bufio_size_class(max_size) + AdaptiveFirstShift);
+
+    if (min_size > max_size) {
+        fde_push_context(fdu_context_bufio);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+
+    // sweep timer stops by itself if the bufio can't be created
+
+    if (!adaptive_sweep_running) {
+        if (!fdd_add_timer(&bufio_adaptive_sweep, 0, 0, AdaptiveSweepMsec, AdaptiveSweepMsec))
+            return 0;
+
+        adaptive_sweep_running = true;
+    }
+
+    unsigned char* const allocated = malloc(sizeof_fdu_bufio_service);
+    unsigned char* const data      = bufio_pool_get(min_size);
+
+    if (!allocated
+        || !data)
+    {
+        free(allocated);
+        bufio_pool_put(data, min_size);
+
+        fde_push_context(fdu_context_bufio);
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    // service is started with an empty buffer and the pool block is attached
+    // afterwards, no callbacks can happen in between
+
+    const fdu_memory_area
+        service_memory  = init_memory_area(allocated, sizeof_fdu_bufio_service),
+        buffer_memory   = init_memory_area(data, 0);
+
+    fdu_bufio_buffer* const bufio
+        = (type == bufio_input)
+        ? fdu_new_input_bufio_inplace(fd, service_memory, buffer_memory,
+                                      context, notify_callback, close_callback)
+        : fdu_new_output_bufio_inplace(fd, service_memory, buffer_memory,
+                                       context, notify_callback, close_callback);
+
+    if (!bufio) {
+        free(allocated);
+        bufio_pool_put(data, min_size);
+        return 0;
+    }
+
+    fdu_bufio_service* const service = bufio->service;
+
+    bufio->data = data;
+    bufio->size = min_size;
+
+    service->min_size      = min_size;
+    service->max_size      = max_size;
+    service->peak_filled   = 0;
+    service->active        = false;
+    service->adaptive_prev = 0;
+    service->adaptive_next = adaptive_bufios;
+
+    if (adaptive_bufios)
+        adaptive_bufios->adaptive_prev = service;
+    adaptive_bufios = service;
+
+    return bufio;
+}
+
+fdu_bufio_buffer* fdu_new_input_bufio_adaptive(const int fd,
+                                               const unsigned int min_size,
+                                               const unsigned int max_size,
+                                               void* const context,
+                                               const fdu_bufio_notify_func notify_callback,
+                                               const fdu_bufio_close_func close_callback)
+{
+    return fdu_new_bufio_adaptive(bufio_input, fd, min_size, max_size,
+                                  context, notify_callback, close_callback);
+}
+
+fdu_bufio_buffer* fdu_new_output_bufio_adaptive(const int fd,
+                                                const unsigned int min_size,
+                                                const unsigned int max_size,
+                                                void* const context,
+                                                const fdu_bufio_notify_func notify_callback,
+                                                const fdu_bufio_close_func close_callback)
+{
+    return fdu_new_bufio_adaptive(bufio_output, fd, min_size, max_size,
+                                  context, notify_callback, close_callback);
+}
+
+fdu_bufio_buffer* fdu_new_mmap_bufio(const int fd,
+                                     const uint64_t offset,
+                                     unsigned int window_size,
+                                     const unsigned int options,
+                                     void* const context,
+                                     const fdu_bufio_notify_func notify_callback,
+                                     const fdu_bufio_close_func close_callback)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdb_context_storage_file_mmap)))
+        return 0;
+    //
+    struct stat st;
+
+    if (fd < 0
+        || (options & ~FDU_MMAP_FOLLOW)
+        || window_size > MmapMaximumWindow)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        fde_push_stdlib_error("fstat", errno);
+        return 0;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    // at least two pages, so that a window always shows more than a page
+
+    const unsigned int page_size = sysconf(_SC_PAGESIZE);
+
+    if (!window_size)
+        window_size = MmapDefaultWindow;
+    if (window_size < 2 * page_size)
+        window_size = 2 * page_size;
+
+    window_size = (window_size + page_size - 1) / page_size * page_size;
+
+    fdu_bufio_service* const service = malloc(sizeof_fdu_bufio_service);
+
+    if (!service) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    service->type        = bufio_mmap;
+    service->context     = context;
+    service->notify      = notify_callback;
+    service->close       = close_callback;
+    service->callstack   = 0;
+    service->close_errno = 0;
+    service->min_size    = 0;
+    service->zc_base     = 0;
+    service->bp_input    = 0;
+    service->bp_output   = 0;
+    service->bp_paused   = false;
+
+    service->read_budget_bytes = UINT32_MAX;
+    service->read_budget_reads = 1;
+
+    service->mm_base       = 0;
+    service->mm_map_offset = offset & ~(uint64_t)(page_size - 1);
+    service->mm_map_size   = 0;
+    service->mm_position   = offset;
+    service->mm_notified   = offset;
+    service->mm_window     = window_size;
+    service->mm_burst      = 0;
+    service->mm_follow     = (options & FDU_MMAP_FOLLOW);
+    service->mm_timer      = false;
+
+    service->buffer.fd       = fd;
+    service->buffer.can_xfer = false;
+    service->buffer.data     = 0;
+    service->buffer.size     = 0;
+    service->buffer.filled   = 0;
+    service->buffer.service  = service;
+
+    if (bufio_mmap_schedule(service, 0)) {
+        if (fde_pop_context(fdb_context_storage_file_mmap, ectx))
+            return &service->buffer;    // <-- normal exit
+
+        // timer owns the service now
+        service->buffer.fd = -1;
+        service->callstack |= bufio_cs_released;
+        return 0;
+    }
+
+    free(service);
+    return 0;
+}
+
+fdu_bufio_buffer* fdu_new_input_bufio_inplace(const int fd,
+                                              const fdu_memory_area service_memory,
+                                              const fdu_memory_area buffer_memory,
+                                              void* const context,
+                                              const fdu_bufio_notify_func notify_callback,
+                                              const fdu_bufio_close_func close_callback)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return 0;
+    //
+    if (fd < 0
+        || !service_memory.begin
+        || !buffer_memory.begin
+        || service_memory.begin > service_memory.end
+        || buffer_memory.begin > buffer_memory.end)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    const unsigned int service_size = service_memory.end - service_memory.begin;
+    const unsigned int buffer_size  = buffer_memory.end - buffer_memory.begin;
+
+    if (service_size < sizeof_fdu_bufio_service
+        || (buffer_size
+            && buffer_size < MinimumBufferSize)
+        || buffer_size > MaximumBufferSize)
+    {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    fdu_bufio_service* service = (fdu_bufio_service*) service_memory.begin;
+
+    service->type        = bufio_input;
+    service->context     = context;
+    service->notify      = notify_callback;
+    service->close       = close_callback;
+    service->callstack   = 0;
+    service->close_errno = 0;
+    service->min_size    = 0;
+    service->zc_base     = 0;
+    service->bp_input    = 0;
+    service->bp_output   = 0;
+    service->bp_paused   = false;
+    service->mm_base     = 0;
+
+    service->read_budget_bytes = UINT32_MAX;
+    service->read_budget_reads = 1;
+
+    service->buffer.fd       = fd;
+    service->buffer.can_xfer = false;
+    service->buffer.data     = buffer_size ? buffer_memory.begin : 0;
+    service->buffer.size     = buffer_size;
+    service->buffer.filled   = 0;
+    service->buffer.service  = service;
+
+    fdd_init_service_input(&service->input_service,
+                           service,
+                           &fdu_bufio_got_input);
+
+    if (fdd_add_input(fd, &service->input_service)) {
+        if (fde_pop_context(fdu_context_bufio, ectx))
+            return &service->buffer;    // <-- normal exit
+
+        fdd_remove_input(fd);
+    }
+
+    return 0;
+}
+
+fdu_bufio_buffer* fdu_new_output_bufio_inplace(const int fd,
+                                               const fdu_memory_area service_memory,
+                                               const fdu_memory_area buffer_memory,
+                                               void* const context,
+                                               const fdu_bufio_notify_func notify_callback,
+                                               const fdu_bufio_close_func close_callback)
+{
+    const fde_node_t* ectx;
+    if (!(ectx = fde_push_context(fdu_context_bufio)))
+        return 0;
+    //
+    if (fd < 0
+        || !service_memory.begin
+        || !buffer_memory.begin
+        || service_memory.begin > service_memory.end
+        || buffer_memory.begin > buffer_memory.end)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return 0;
+    }
+    //
+
+    const unsigned int service_size = service_memory.end - service_memory.begin;
+    const unsigned int buffer_size  = buffer_memory.end - buffer_memory.begin;
+
+    if (service_size < sizeof_fdu_bufio_service
+        || (buffer_size
+            && buffer_size < MinimumBufferSize)
+        || buffer_size > MaximumBufferSize)
+    {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    fdu_bufio_service* service = (fdu_bufio_service*) service_memory.begin;
+
+    if (!service) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return 0;
+    }
+
+    service->type       = bufio_output;
+
+    service->context    = context;
+    service->notify     = notify_callback;
+    service->close      = close_callback;
+    service->callstack  = 0;
+    service->close_errno= 0;
+    service->min_size   = 0;
+    service->zc_base    = 0;
+    service->bp_input   = 0;
+    service->bp_output  = 0;
+    service->bp_paused  = false;
+    service->mm_base    = 0;
+
+    service->read_budget_bytes = UINT32_MAX;
+    service->read_budget_reads = 1;
+
+    service->buffer.fd          = fd;
+    service->buffer.can_xfer    = false;
+    service->buffer.data        = buffer_size ? buffer_memory.begin : 0;
+    service->buffer.size        = buffer_size;
+    service->buffer.filled      = 0;
+    service->buffer.service     = service;
+
+    fdd_init_service_output(&service->output_service,
+                            service,
+                            &fdu_bufio_got_output);
+
+    if (fdd_add_output(fd, &service->output_service)) {
+        if (fde_pop_context(fdu_context_bufio, ectx))
+            return &service->buffer;    // <-- normal exit
+
+        fdd_remove_output(fd);
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------------------
+ *
+ * Pending connect()
+ *
+ */
+
+typedef struct {
+    fdd_service_output oserv;
+    fdu_notify_connect_func connect_func;
+    void* context;
+} fdu_pending_connect_data;
+
+static bool fdu_pending_connect_callback(void* pcd_v,
+                                         int fd)
+{
+    fdu_pending_connect_data* pcd = (fdu_pending_connect_data*) pcd_v;
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_connect)))
+        return false;
+
+#ifdef FD_DEBUG
+    if (!pcd
+        || fd < 0)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+#endif
+    //
+
+    int connect_error;
+    socklen_t len = sizeof(connect_error);
+
+    if (!fdd_remove_output(fd))
+        return false;
+
+    // check the real status of connect() ...
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_error, &len) < 0) {
+        connect_error = -1;
+
+        fde_push_stdlib_error("getsockopt", errno);
+    }
+
+    // ... and return it with the given callback
+
+    fdu_notify_connect_func func = pcd->connect_func;
+    void* context = pcd->context;
+
+    free(pcd);
+
+    return func(context, fd, connect_error)
+        && fde_safe_pop_context(fdu_context_connect, ectx);
+}
+
+bool fdu_pending_connect(int fd, fdu_notify_connect_func callback, void* callback_context)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_connect)))
+        return false;
+
+    // allocate and initialize service
+
+    fdu_pending_connect_data* pcd = malloc(sizeof(fdu_pending_connect_data));
+
+    if (!pcd) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    fdd_init_service_output(&pcd->oserv,
+                            pcd,                                // context
+                            &fdu_pending_connect_callback);     // notify
+    pcd->connect_func   = callback;
+    pcd->context        = callback_context;
+
+    // start service
+
+    return fdd_add_output(fd, &pcd->oserv)
+        && fde_safe_pop_context(fdu_context_connect, ectx);
+}
+
+/*------------------------------------------------------------
+ *
+ * Non-blocking DNS lookup
+ *
+ */
+
+enum {
+    DnsNameSize         = 256,
+    DnsTtlUnknown       = UINT32_MAX,   // dns-service doesn't tell
+    DnsInFlightBuckets  = 64,
+    DnsMaxWorkers       = 16,
+    DnsMaxAttempts      = 3,            // workers one query may take down
+    DnsBufferSize       = 4096,
+    DnsCacheMaxEntries  = 1 << 20,
+};
+
+// dns-service protocol, see dns-service.c
+
+enum {
+    DnsRequestHeader    = 2 + 4 + 1,    // size, id, families
+    DnsReplyHeader      = 2 + 4 + 1 + 1,        // size, id, status, count
+    DnsAddressSize      = 1 + 4 + 16,   // family, ttl, address
+    DnsMaxReply         = DnsReplyHeader + FDU_RESOLVER_MAX_ADDRESSES * DnsAddressSize,
+};
+
+static const fdu_resolver_status dns_service_status[] = {
+    fdu_resolver_ok,
+    fdu_resolver_nxdomain,
+    fdu_resolver_nodata,
+    fdu_resolver_failure,
+};
+
+typedef struct fdu_dns_service_query_v1 {
+    struct fdu_dns_service_query_v1* next;
+    struct fdu_dns_service_query_v1* chain;     // in-flight table
+    struct fdu_dns_service_query_v1* waiters;   // same name, newest first
+
+    fdu_dnsserv_notify_func notify;     // 0: cache refresh
+    fdu_resolver_notify_func notify_answer;     // fdu_dnsserv_lookup_addresses()
+    void* context;
+
+    uint32_t id;                        // dns-service request
+    unsigned int families;              // FDU_RESOLVE_XXX
+    unsigned int attempts;
+
+    char name[DnsNameSize];
+} fdu_dns_service_query;
+
+// one dns-service process
+
+typedef struct {
+    fdd_service_input iserv;
+    fdd_service_output oserv;
+    int pid, fd_in, fd_out;
+    unsigned int index;
+
+    fdu_dns_service_query* head;        // sent, not yet answered
+    fdu_dns_service_query* tail;
+    unsigned int pending;               // >0: input is on
+
+    bool reading;                       // in fdu_dns_service_got_answer()
+    bool stopped;
+
+    unsigned char* out;                 // requests not yet written
+    unsigned int out_size;              // >0: output is on
+    unsigned int out_capacity;
+
+    unsigned int filled;
+    unsigned char buffer[DnsBufferSize];
+} fdu_dns_service;
+
+// -----
+
+static fdu_dns_service_query* free_dns_query_nodes = 0;
+
+static fdu_dns_service* dns_workers[DnsMaxWorkers];
+static unsigned int dns_worker_count = 1;
+static uint32_t dns_next_id = 0;
+
+static fdu_dns_service_query* dns_in_flight[DnsInFlightBuckets];
+
+// -----
+
+static fdu_dns_service_query* new_dns_query_node(const char* name, fdu_dnsserv_notify_func notify, void* ctx)
+{
+    fdu_dns_service_query* node;
+
+    if (!free_dns_query_nodes)
+        node = malloc(sizeof(fdu_dns_service_query));
+    else {
+        node = free_dns_query_nodes;
+        free_dns_query_nodes = free_dns_query_nodes->next;
+    }
+
+    if (!node)
+        return 0;
+
+    node->next = 0;
+    node->chain = 0;
+    node->waiters = 0;
+    node->notify = notify;
+    node->notify_answer = 0;
+    node->context = ctx;
+    node->id = 0;
+    node->families = FDU_RESOLVE_IPV4;
+    node->attempts = 0;
+
+    strcpy(node->name, name);
+
+    return node;
+}
+
+// -----
+
+static void free_dns_query_node(fdu_dns_service_query* tbd)
+{
+    tbd->next = free_dns_query_nodes;
+    free_dns_query_nodes = tbd;
+}
+
+/* -----
+ * Result cache, see fdu_dnsserv_set_cache(). Entries are hashed by name
+ * into chains and kept in LRU order, both linked by index. An empty
+ * 'address' is a cached failure.
+ */
+
+typedef struct {
+    char name[DnsNameSize];
+    char address[INET_ADDRSTRLEN];
+
+    uint64_t expires;                   // usec
+    bool used;
+    bool refreshing;
+
+    int chain;                          // next in the hash chain
+    int newer;
+    int older;
+} dns_cache_entry;
+
+static struct {
+    dns_cache_entry* entries;
+    int* buckets;
+    unsigned int size;
+    unsigned int bucket_mask;
+    unsigned int count;
+
+    int newest;
+    int oldest;
+
+    uint32_t default_ttl;               // seconds
+    uint32_t negative_ttl;
+    uint32_t failure_ttl;
+    uint32_t stale;
+
+    fdu_dnsserv_cache_stats stats;
+} dns_cache;
+
+static uint32_t dns_name_hash(const char* name)
+{
+    // FNV-1a, case-insensitive like DNS
+
+    uint32_t hash = 2166136261u;
+
+    for (; *name; ++name)
+        hash = (hash ^ (unsigned char) (*name | 0x20)) * 16777619u;
+
+    return hash;
+}
+
+static unsigned int dns_cache_hash(const char* name)
+{
+    return dns_name_hash(name) & dns_cache.bucket_mask;
+}
+
+static dns_cache_entry* dns_cache_find(const char* name)
+{
+    for (int i = dns_cache.buckets[dns_cache_hash(name)]; i >= 0; i = dns_cache.entries[i].chain)
+    {
+        if (!strcasecmp(dns_cache.entries[i].name, name))
+            return &dns_cache.entries[i];
+    }
+
+    return 0;
+}
+
+static void dns_cache_unlink(dns_cache_entry* entry)
+{
+    const int index = entry - dns_cache.entries;
+
+    // LRU
+
+    if (entry->newer >= 0) dns_cache.entries[entry->newer].older = entry->older;
+    else                   dns_cache.newest = entry->older;
+
+    if (entry->older >= 0) dns_cache.entries[entry->older].newer = entry->newer;
+    else                   dns_cache.oldest = entry->newer;
+
+    // hash chain
+
+    int* link = &dns_cache.buckets[dns_cache_hash(entry->name)];
+
+    while (*link != index)
+        link = &dns_cache.entries[*link].chain;
+
+    *link = entry->chain;
+}
+
+static void dns_cache_link(dns_cache_entry* entry)
+{
+    const int index = entry - dns_cache.entries;
+
+    entry->older = dns_cache.newest;
+    entry->newer = -1;
+
+    if (dns_cache.newest >= 0)
+        dns_cache.entries[dns_cache.newest].newer = index;
+    else
+        dns_cache.oldest = index;
+
+    dns_cache.newest = index;
+
+    int* bucket = &dns_cache.buckets[dns_cache_hash(entry->name)];
+
+    entry->chain = *bucket;
+    *bucket = index;
+}
+
+static void dns_cache_touch(dns_cache_entry* entry)
+{
+    if (dns_cache.newest == entry - dns_cache.entries)
+        return;
+
+    dns_cache_unlink(entry);
+    dns_cache_link(entry);
+}
+
+static void dns_cache_store(const char* name, const char* address, uint32_t ttl)
+{
+    if (!dns_cache.size)
+        return;
+
+    if (ttl == DnsTtlUnknown)
+        ttl = address ? dns_cache.default_ttl : dns_cache.negative_ttl;
+
+    dns_cache_entry* entry = dns_cache_find(name);
+
+    // a failed refresh keeps the stale address around
+
+    if (entry
+        && entry->refreshing
+        && !address
+        && entry->address[0])
+    {
+        entry->refreshing = false;
+        return;
+    }
+
+    if (!ttl) {
+        if (entry) {
+            dns_cache_unlink(entry);
+            entry->used = false;
+            --dns_cache.count;
+        }
+        return;
+    }
+
+    if (entry)
+        dns_cache_unlink(entry);
+    else if (dns_cache.count < dns_cache.size) {
+        for (entry = dns_cache.entries; entry->used; ++entry)
+            ;
+        ++dns_cache.count;
+    }
+    else {
+        entry = &dns_cache.entries[dns_cache.oldest];
+        dns_cache_unlink(entry);
+        ++dns_cache.stats.evictions;
+    }
+
+    strcpy(entry->name, name);
+    strcpy(entry->address, address ? address : "");
+
+    entry->expires    = monotonic_usec() + (uint64_t) ttl * 1000000;
+    entry->used       = true;
+    entry->refreshing = false;
+
+    dns_cache_link(entry);
+}
+
+/* -----
+ * Queries in flight, one per name. Later lookups of the same name wait on
+ * the first one and get its answer.
+ */
+
+static fdu_dns_service_query* dns_in_flight_find(const char* name)
+{
+    fdu_dns_service_query* node = dns_in_flight[dns_name_hash(name) % DnsInFlightBuckets];
+
+    while (node && strcasecmp(node->name, name))
+        node = node->chain;
+
+    return node;
+}
+
+static void dns_in_flight_add(fdu_dns_service_query* node)
+{
+    fdu_dns_service_query** bucket = &dns_in_flight[dns_name_hash(node->name) % DnsInFlightBuckets];
+
+    node->chain = *bucket;
+    *bucket = node;
+}
+
+static void dns_in_flight_remove(fdu_dns_service_query* node)
+{
+    fdu_dns_service_query** link = &dns_in_flight[dns_name_hash(node->name) % DnsInFlightBuckets];
+
+    while (*link && *link != node)
+        link = &(*link)->chain;
+
+    if (*link)
+        *link = node->chain;
+}
+
+// -----
+
+static void dns_query_notify(fdu_dns_service_query* node, const char* address)
+{
+    dns_in_flight_remove(node);
+
+    // waiters are newest first, answer in the order of lookups
+
+    fdu_dns_service_query* waiters = 0;
+
+    while (node->waiters) {
+        fdu_dns_service_query* next = node->waiters->next;
+        node->waiters->next = waiters;
+        waiters = node->waiters;
+        node->waiters = next;
+    }
+
+    node->next = waiters;
+
+    // nodes are freed before the callbacks, they may look up again
+
+    while (node) {
+        fdu_dns_service_query* current = node;
+        node = node->next;
+
+        fdu_dnsserv_notify_func notify = current->notify;
+        void* context = current->context;
+
+        free_dns_query_node(current);
+
+        if (notify)
+            notify(context, address);
+    }
+}
+
+static void dns_query_done(fdu_dns_service_query* node, const char* address, uint32_t ttl)
+{
+    dns_cache_store(node->name, address, ttl);
+
+    dns_query_notify(node, address);
+}
+
+// -----
+
+static bool fdu_dns_service_got_answer(void* context, int fd);
+static bool fdu_dns_service_flush(void* context, int fd);
+
+// -----
+
+static bool fdu_dns_service_start(unsigned int index)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
+    //
+
+    int pid = 0;
+    int fds_read[2] = {-1, -1};
+    int fds_write[2] = {-1, -1};
+
+    // create pipes for communication
+
+    if (pipe(fds_read) != 0
+        || pipe(fds_write) != 0)
+    {
+        fde_push_stdlib_error("pipe", errno);
+
+        if (fds_read[0] >= 0) fdu_safe_close(fds_read[0]);
+        if (fds_read[1] >= 0) fdu_safe_close(fds_read[1]);
+        if (fds_write[0] >= 0) fdu_safe_close(fds_write[0]);
+        if (fds_write[1] >= 0) fdu_safe_close(fds_write[1]);
+        return false;
+    }
+
+    // spawn process
+
+    if ((pid =vfork()) < 0) {
+        fde_push_stdlib_error("vfork", errno);
+
+        fdu_safe_close(fds_read[0]);
+        fdu_safe_close(fds_read[1]);
+        fdu_safe_close(fds_write[0]);
+        fdu_safe_close(fds_write[1]);
+        return false;
+    }
+    else if (pid == 0) // child
+    {
+        fdu_safe_close(fds_read[0]);
+        fdu_safe_close(fds_write[1]);
+
+        if (fdu_move_fd(fds_write[0], STDIN_FILENO)
+            && fdu_move_fd(fds_read[1], STDOUT_FILENO))
+        {
+            execl("./dns-service", "dns-service", (char*) 0);
+        }
+
+        _exit(-1);
+    }
+
+    // parent
+
+    fdu_safe_close(fds_read[1]);
+    fdu_safe_close(fds_write[0]);
+
+    /* verify operation:
+     * dns-service fails a request with an empty name, id 0 here
+     */
+
+    {
+        const uint16_t request_size = DnsRequestHeader - 2;
+        unsigned char request[DnsRequestHeader] = { 0 };
+        unsigned char reply[DnsReplyHeader];
+        uint16_t reply_size;
+
+        memcpy(request, &request_size, 2);
+
+        if (write(fds_write[1], request, DnsRequestHeader) != DnsRequestHeader
+            || read(fds_read[0], reply, DnsReplyHeader) != DnsReplyHeader
+            || (memcpy(&reply_size, reply, 2), reply_size != DnsReplyHeader - 2)
+            || reply[7] != 0)
+        {
+            fde_push_resource_failure("dns_service:startup test");
+
+            fdu_safe_close(fds_read[0]);
+            fdu_safe_close(fds_write[1]);
+
+            kill(pid, SIGKILL);
+            waitpid(pid, 0, 0);
+            return false;
+        }
+    }
+
+    // requests are buffered, see fdu_dns_service_flush()
+
+    int flags;
+
+    if ((flags =fcntl(fds_write[1], F_GETFL)) == -1
+        || fcntl(fds_write[1], F_SETFL, flags|O_NONBLOCK) == -1)
+    {
+        fde_push_stdlib_error("fcntl", errno);
+
+        fdu_safe_close(fds_read[0]);
+        fdu_safe_close(fds_write[1]);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+        return false;
+    }
+
+    // init the worker
+
+    fdu_dns_service* worker = malloc(sizeof(fdu_dns_service));
+
+    if (!worker) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+
+        fdu_safe_close(fds_read[0]);
+        fdu_safe_close(fds_write[1]);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+        return false;
+    }
+
+    fdd_init_service_input(&worker->iserv, worker, &fdu_dns_service_got_answer);
+    fdd_init_service_output(&worker->oserv, worker, &fdu_dns_service_flush);
+
+    worker->pid     = pid;
+    worker->fd_in   = fds_read[0];
+    worker->fd_out  = fds_write[1];
+    worker->index   = index;
+    worker->head    = 0;
+    worker->tail    = 0;
+    worker->pending = 0;
+    worker->reading = false;
+    worker->stopped = false;
+    worker->out     = 0;
+    worker->out_size     = 0;
+    worker->out_capacity = 0;
+    worker->filled  = 0;
+
+    dns_workers[index] = worker;
+
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+}
+
+// returns the queries the worker had, unanswered
+
+static fdu_dns_service_query* fdu_dns_service_stop(fdu_dns_service* worker)
+{
+    const fde_node_t* ectx = fde_push_context(fdu_context_dnsserv);
+
+    //
+
+    if (kill(worker->pid, SIGKILL) < 0)
+        fde_push_stdlib_error("kill", errno);
+
+    if (worker->pending)
+        fdd_remove_input(worker->fd_in);
+    if (worker->out_size)
+        fdd_remove_output(worker->fd_out);
+
+    free(worker->out);
+    worker->out = 0;
+    worker->out_size = 0;
+
+    fdu_safe_close(worker->fd_in);
+    fdu_safe_close(worker->fd_out);
+
+    if (waitpid(worker->pid, 0, 0) < 0)
+        fde_push_stdlib_error("waitpid", errno);
+
+    fdu_dns_service_query* queries = worker->head;
+
+    dns_workers[worker->index] = 0;
+
+    // fdu_dns_service_got_answer() is still using it
+
+    if (worker->reading) {
+        worker->head    = 0;
+        worker->tail    = 0;
+        worker->pending = 0;
+        worker->stopped = true;
+    }
+    else
+        free(worker);
+
+    if (ectx)
+        fde_safe_pop_context(fdu_context_dnsserv, ectx);
+
+    return queries;
+}
+
+// -----
+
+static fdu_dns_service* fdu_dns_service_pick(void)
+{
+    // the least loaded, a new one rather than a busy one
+
+    fdu_dns_service* best = 0;
+    int free_index = -1;
+
+    for (unsigned int i = 0; i < dns_worker_count; ++i)
+    {
+        fdu_dns_service* worker = dns_workers[i];
+
+        if (!worker) {
+            if (free_index < 0)
+                free_index = i;
+        }
+        else if (!best
+                 || worker->pending < best->pending)
+        {
+            best = worker;
+        }
+    }
+
+    if ((best && !best->pending)
+        || free_index < 0)
+    {
+        return best;
+    }
+
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return 0;
+
+    if (fdu_dns_service_start(free_index)) {
+        fde_pop_context(fdu_context_dnsserv, ectx);
+        return dns_workers[free_index];
+    }
+
+    // a busy worker will do, forget the failed start
+
+    if (best
+        && fde_reset_context(fdu_context_dnsserv, ectx))
+    {
+        fde_pop_context(fdu_context_dnsserv, ectx);
+    }
+
+    return best;
+}
+
+// the first IPv4 address, as fdu_dnsserv_lookup() gives
+
+static void fdu_dnsserv_resolved(void* node_v, const fdu_resolver_answer* answer)
+{
+    fdu_dns_service_query* node = (fdu_dns_service_query*) node_v;
+
+    char address[INET_ADDRSTRLEN];
+    const char* result = 0;
+    uint32_t ttl = 0;
+
+    for (unsigned int i = 0; i < answer->count && !result; ++i)
+    {
+        if (answer->addresses[i].family == AF_INET) {
+            result = inet_ntop(AF_INET, answer->addresses[i].addr, address, sizeof(address));
+            ttl    = answer->addresses[i].ttl;
+        }
+    }
+
+    // The same for both backends: NXDOMAIN and no address are kept for
+    // 'negative_ttl', failures (timeout, SERVFAIL, a lost worker) for
+    // 'failure_ttl'.
+
+    if (!result
+        && answer->status != fdu_resolver_nxdomain
+        && answer->status != fdu_resolver_nodata)
+    {
+        ttl = dns_cache.failure_ttl;
+    }
+    else if (!result)
+        ttl = DnsTtlUnknown;
+
+    dns_query_done(node, result, ttl);
+}
+
+static void fdu_dns_service_answered(fdu_dns_service_query* node, const fdu_resolver_answer* answer)
+{
+    if (!node->notify_answer) {
+        fdu_dnsserv_resolved(node, answer);
+        return;
+    }
+
+    node->notify_answer(node->context, answer);
+
+    free_dns_query_node(node);
+}
+
+static void fdu_dns_service_failed(fdu_dns_service_query* node)
+{
+    fdu_resolver_answer answer;
+
+    answer.name   = node->name;
+    answer.status = fdu_resolver_failure;
+    answer.ttl    = 0;
+    answer.count  = 0;
+
+    fdu_dns_service_answered(node, &answer);
+}
+
+// -----
+
+static bool fdu_dns_service_send(fdu_dns_service_query* node)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
+    //
+
+    fdu_dns_service* worker = fdu_dns_service_pick();
+
+    if (!worker) {
+        fde_push_resource_failure("dns_service:startup");
+        return false;
+    }
+
+    // the request goes to the output buffer, all of those made before
+    // the next dispatcher round are written at once
+
+    const unsigned int name_len = strlen(node->name);
+    const unsigned int size     = DnsRequestHeader + name_len;
+
+    if (worker->out_size + size > worker->out_capacity)
+    {
+        const unsigned int capacity = (worker->out_capacity ? worker->out_capacity * 2 : DnsBufferSize) + size;
+        unsigned char* out = realloc(worker->out, capacity);
+
+        if (!out) {
+            fde_push_resource_failure_id(fde_resource_memory_allocation);
+            return false;
+        }
+
+        worker->out          = out;
+        worker->out_capacity = capacity;
+    }
+
+    if ((!worker->out_size
+         && !fdd_add_output(worker->fd_out, &worker->oserv))
+        || (!worker->head
+            && !fdd_add_input(worker->fd_in, &worker->iserv)))
+    {
+        return false;
+    }
+
+    // Nothing fails after this: a queued node belongs to the worker, the
+    // caller frees the node only when this returns false.
+
+    node->id = ++dns_next_id;
+
+    const uint16_t frame_size = size - 2;
+    unsigned char* request = worker->out + worker->out_size;
+
+    memcpy(request,     &frame_size, 2);
+    memcpy(request + 2, &node->id,   4);
+    request[6] = node->families;
+    memcpy(request + DnsRequestHeader, node->name, name_len);
+
+    worker->out_size += size;
+
+    // add it to the list
+
+    node->next = 0;
+
+    if (worker->tail) worker->tail->next = node;
+    else              worker->head = node;
+
+    worker->tail = node;
+    ++worker->pending;
+
+    fde_pop_context(fdu_context_dnsserv, ectx);
+    return true;
+}
+
+// a worker died: give its queries to the others, or to its replacement
+
+static void fdu_dns_service_lost(fdu_dns_service* worker)
+{
+    fdu_dns_service_query* queries = fdu_dns_service_stop(worker);
+
+    while (queries) {
+        fdu_dns_service_query* current = queries;
+        queries = queries->next;
+
+        if (++current->attempts >= DnsMaxAttempts
+            || !fdu_dns_service_send(current))
+        {
+            fdu_dns_service_failed(current);
+        }
+    }
+}
+
+// -----
+
+static bool fdu_dns_service_flush(void* context, int fd)
+{
+    //
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
+    //
+    fdu_dns_service* worker = (fdu_dns_service*) context;
+
+    if (!worker
+        || dns_workers[worker->index] != worker)
+    {
+        fde_push_consistency_failure("context is not a dns_service worker");
+        return false;
+    }
+    //
+
+    const int i = write(fd, worker->out, worker->out_size);
+
+    if (i < 0) {
+        if (errno != EINTR
+            && errno != EAGAIN)
+        {
+            fdu_dns_service_lost(worker);
+        }
+
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    }
+
+    worker->out_size -= i;
+
+    if (worker->out_size)
+        memmove(worker->out, worker->out + i, worker->out_size);
+    else
+        fdd_remove_output(fd);
+
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+}
+
+static bool fdu_dns_service_got_answer(void* context, int fd)
+{
+    //
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
+    //
+    fdu_dns_service* worker = (fdu_dns_service*) context;
+
+    if (!worker
+        || dns_workers[worker->index] != worker)
+    {
+        fde_push_consistency_failure("context is not a dns_service worker");
+        return false;
+    }
+    //
+
+    const int i = read(fd, worker->buffer + worker->filled, DnsBufferSize - worker->filled);
+    if (i <= 0) {
+        fdu_dns_service_lost(worker);
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
     }
 
-    const unsigned int offer = src->filled;
-    const unsigned int space = dst->size - dst->filled;
-    const unsigned int bytes = (offer < space) ? offer : space;
+    worker->filled += i;
+    worker->reading = true;
+
+    //
+
+    unsigned int consumed = 0;
+    bool broken = false;
+
+    while (!worker->stopped
+           && worker->filled - consumed >= DnsReplyHeader)
+    {
+        const unsigned char* reply = worker->buffer + consumed;
+
+        uint16_t size;
+        uint32_t id;
 
-    if (!bytes)
-        return 0;
+        memcpy(&size, reply,     2);
+        memcpy(&id,   reply + 2, 4);
 
-    memcpy(&dst->data[dst->filled],
-           src->data,
-           bytes);
+        const unsigned int count = reply[7];
 
-    dst->filled += bytes;
-    src->filled -= bytes;
+        if (size + 2u > DnsMaxReply
+            || size + 2u != DnsReplyHeader + count * DnsAddressSize
+            || reply[6] >= sizeof(dns_service_status) / sizeof(dns_service_status[0]))
+        {
+            broken = true;
+            break;
+        }
 
-    if (src->filled)
-        memmove(src->data, &src->data[bytes], src->filled);
+        if (worker->filled - consumed < size + 2u)
+            break;
 
-    return bytes;
-}
+        consumed += size + 2;
 
-// ------------------------------------------------------------
+        //
 
-fdu_bufio_buffer* fdu_new_input_bufio(const int fd,
-                                      const unsigned int size,
-                                      void* const context,
-                                      const fdu_bufio_notify_func notify_callback,
-                                      const fdu_bufio_close_func close_callback)
-{
-    const size_t total_size = sizeof_fdu_bufio_service + size;
+        fdu_dns_service_query* previous = 0;
+        fdu_dns_service_query* current  = worker->head;
 
-    unsigned char* const allocated = malloc(total_size);
+        while (current && current->id != id) {
+            previous = current;
+            current  = current->next;
+        }
 
-    if (!allocated) {
-        fde_push_context(fdu_context_bufio);
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return 0;
-    }
+        // not asked from this worker, its replies can't be trusted any more
 
-    unsigned char* counter = allocated;
+        if (!current) {
+            broken = true;
+            break;
+        }
 
-    const fdu_memory_area
-        service_memory  = init_memory_area_cont(&counter, sizeof_fdu_bufio_service),
-        buffer_memory   = init_memory_area_cont(&counter, size);
+        if (previous) previous->next = current->next;
+        else          worker->head   = current->next;
 
-    fdu_bufio_buffer* const bufio
-        = fdu_new_input_bufio_inplace(fd,
-                                      service_memory,
-                                      buffer_memory,
-                                      context,
-                                      notify_callback,
-                                      close_callback);
+        if (worker->tail == current)
+            worker->tail = previous;
 
-    if (!bufio)
-        free(allocated);
+        if (!--worker->pending) {
+            fdd_remove_input(worker->fd_in);
 
-    return bufio;
-}
+            // fdu_dnsserv_set_workers() asked for less
 
-fdu_bufio_buffer* fdu_new_output_bufio(const int fd,
-                                       const unsigned int size,
-                                       void* const context,
-                                       const fdu_bufio_notify_func notify_callback,
-                                       const fdu_bufio_close_func close_callback)
-{
-    const size_t total_size = sizeof_fdu_bufio_service + size;
+            if (worker->index >= dns_worker_count)
+                fdu_dns_service_stop(worker);
+        }
 
-    unsigned char* const allocated = malloc(total_size);
+        // getaddrinfo() doesn't tell TTLs, dns-service gives DnsTtlUnknown
 
-    if (!allocated) {
-        fde_push_context(fdu_context_bufio);
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return 0;
+        fdu_resolver_answer answer;
+
+        answer.name   = current->name;
+        answer.status = dns_service_status[reply[6]];
+        answer.ttl    = DnsTtlUnknown;
+        answer.count  = count;
+
+        for (unsigned int a = 0; a < count; ++a)
+        {
+            const unsigned char* address = reply + DnsReplyHeader + a * DnsAddressSize;
+            fdu_resolver_address* to = &answer.addresses[a];
+
+            to->family = (address[0] == 6) ? AF_INET6 : AF_INET;
+            memcpy(&to->ttl, address + 1,  4);
+            memcpy(to->addr, address + 5, 16);
+
+            if (to->ttl < answer.ttl)
+                answer.ttl = to->ttl;
+        }
+
+        fdu_dns_service_answered(current, &answer);
     }
 
-    unsigned char* counter = allocated;
+    worker->reading = false;
 
-    const fdu_memory_area
-        service_memory  = init_memory_area_cont(&counter, sizeof_fdu_bufio_service),
-        buffer_memory   = init_memory_area_cont(&counter, size);
+    if (worker->stopped) {
+        free(worker);
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    }
 
-    fdu_bufio_buffer* const bufio
-        = fdu_new_output_bufio_inplace(fd,
-                                       service_memory,
-                                       buffer_memory,
-                                       context,
-                                       notify_callback,
-                                       close_callback);
+    worker->filled -= consumed;
+    if (worker->filled)
+        memmove(worker->buffer, worker->buffer + consumed, worker->filled);
 
-    if (!bufio)
-        free(allocated);
+    if (broken)
+        fdu_dns_service_lost(worker);
 
-    return bufio;
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
 }
 
-fdu_bufio_buffer* fdu_new_input_bufio_inplace(const int fd,
-                                              const fdu_memory_area service_memory,
-                                              const fdu_memory_area buffer_memory,
-                                              void* const context,
-                                              const fdu_bufio_notify_func notify_callback,
-                                              const fdu_bufio_close_func close_callback)
+// -----
+
+bool fdu_dnsserv_set_workers(unsigned int count)
 {
     const fde_node_t* ectx;
-    if (!(ectx = fde_push_context(fdu_context_bufio)))
-        return 0;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
     //
-    if (fd < 0
-        || !service_memory.begin
-        || !buffer_memory.begin
-        || service_memory.begin > service_memory.end
-        || buffer_memory.begin > buffer_memory.end)
+    if (!count
+        || count > DnsMaxWorkers)
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return 0;
+        return false;
     }
     //
 
-    const unsigned int service_size = service_memory.end - service_memory.begin;
-    const unsigned int buffer_size  = buffer_memory.end - buffer_memory.begin;
+    dns_worker_count = count;
 
-    if (service_size < sizeof_fdu_bufio_service
-        || (buffer_size
-            && buffer_size < MinimumBufferSize)
-        || buffer_size > MaximumBufferSize)
+    // idle ones over the limit go now, busy ones when they're done
+
+    for (unsigned int i = count; i < DnsMaxWorkers; ++i)
     {
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return 0;
+        if (dns_workers[i]
+            && !dns_workers[i]->pending)
+        {
+            fdu_dns_service_stop(dns_workers[i]);
+        }
     }
 
-    fdu_bufio_service* service = (fdu_bufio_service*) service_memory.begin;
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+}
 
-    service->type        = bufio_input;
-    service->context     = context;
-    service->notify      = notify_callback;
-    service->close       = close_callback;
-    service->callstack   = 0;
-    service->close_errno = 0;
+static bool dnsserv_query(const char* name, fdu_dnsserv_notify_func notify, void* ctx);
 
-    service->buffer.fd       = fd;
-    service->buffer.can_xfer = false;
-    service->buffer.data     = buffer_size ? buffer_memory.begin : 0;
-    service->buffer.size     = buffer_size;
-    service->buffer.filled   = 0;
-    service->buffer.service  = service;
+bool fdu_dnsserv_set_cache(unsigned int max_entries,
+                           unsigned int default_ttl,
+                           unsigned int negative_ttl,
+                           unsigned int failure_ttl,
+                           unsigned int stale)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
+    //
+    if (max_entries > DnsCacheMaxEntries) {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
 
-    fdd_init_service_input(&service->input_service,
-                           service,
-                           &fdu_bufio_got_input);
+    free(dns_cache.entries);
+    free(dns_cache.buckets);
 
-    if (fdd_add_input(fd, &service->input_service)) {
-        if (fde_pop_context(fdu_context_bufio, ectx))
-            return &service->buffer;    // <-- normal exit
+    memset(&dns_cache, 0, sizeof(dns_cache));
 
-        fdd_remove_input(fd);
+    dns_cache.newest = -1;
+    dns_cache.oldest = -1;
+
+    if (!max_entries)
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+
+    unsigned int buckets = 16;
+
+    while (buckets < 2 * max_entries)
+        buckets *= 2;
+
+    dns_cache.entries = calloc(max_entries, sizeof(dns_cache_entry));
+    dns_cache.buckets = malloc(buckets * sizeof(int));
+
+    if (!dns_cache.entries
+        || !dns_cache.buckets)
+    {
+        free(dns_cache.entries);
+        free(dns_cache.buckets);
+        dns_cache.entries = 0;
+        dns_cache.buckets = 0;
+
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
     }
 
-    return 0;
+    memset(dns_cache.buckets, 0xff, buckets * sizeof(int));
+
+    dns_cache.size         = max_entries;
+    dns_cache.bucket_mask  = buckets - 1;
+    dns_cache.default_ttl  = default_ttl;
+    dns_cache.negative_ttl = negative_ttl;
+    dns_cache.failure_ttl  = failure_ttl;
+    dns_cache.stale        = stale;
+
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
 }
 
-fdu_bufio_buffer* fdu_new_output_bufio_inplace(const int fd,
-                                               const fdu_memory_area service_memory,
-                                               const fdu_memory_area buffer_memory,
-                                               void* const context,
-                                               const fdu_bufio_notify_func notify_callback,
-                                               const fdu_bufio_close_func close_callback)
+void fdu_dnsserv_get_cache_stats(fdu_dnsserv_cache_stats* stats)
+{
+    *stats = dns_cache.stats;
+    stats->entries = dns_cache.count;
+}
+
+bool fdu_dnsserv_lookup(const char* name, fdu_dnsserv_notify_func notify, void* ctx)
 {
     const fde_node_t* ectx;
-    if (!(ectx = fde_push_context(fdu_context_bufio)))
-        return 0;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
+        return false;
     //
-    if (fd < 0
-        || !service_memory.begin
-        || !buffer_memory.begin
-        || service_memory.begin > service_memory.end
-        || buffer_memory.begin > buffer_memory.end)
+
+    const unsigned int name_len = name ? strlen(name) : 0;
+
+    if (!name
+        || name_len <= 2
+        || name_len >= DnsNameSize
+        || !notify)
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return 0;
+        return false;
     }
     //
 
-    const unsigned int service_size = service_memory.end - service_memory.begin;
-    const unsigned int buffer_size  = buffer_memory.end - buffer_memory.begin;
+    dns_cache_entry* entry;
 
-    if (service_size < sizeof_fdu_bufio_service
-        || (buffer_size
-            && buffer_size < MinimumBufferSize)
-        || buffer_size > MaximumBufferSize)
+    if (dns_cache.size
+        && (entry = dns_cache_find(name)))
     {
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return 0;
-    }
+        const uint64_t now = monotonic_usec();
 
-    fdu_bufio_service* service = (fdu_bufio_service*) service_memory.begin;
+        if (now < entry->expires) {
+            ++dns_cache.stats.hits;
+            dns_cache_touch(entry);
 
-    if (!service) {
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return 0;
-    }
+            notify(ctx, entry->address[0] ? entry->address : 0);
+            return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+        }
 
-    service->type       = bufio_output;
+        // stale: answer now, refresh in the background
 
-    service->context    = context;
-    service->notify     = notify_callback;
-    service->close      = close_callback;
+        if (entry->address[0]
+            && now < entry->expires + (uint64_t) dns_cache.stale * 1000000)
+        {
+            ++dns_cache.stats.stale_hits;
+            dns_cache_touch(entry);
 
-    service->buffer.fd          = fd;
-    service->buffer.can_xfer    = false;
-    service->buffer.data        = buffer_size ? buffer_memory.begin : 0;
-    service->buffer.size        = buffer_size;
-    service->buffer.filled      = 0;
-    service->buffer.service     = service;
+            char address[INET_ADDRSTRLEN];
+            strcpy(address, entry->address);
 
-    fdd_init_service_output(&service->output_service,
-                            service,
-                            &fdu_bufio_got_output);
+            if (!entry->refreshing) {
+                entry->refreshing = true;
 
-    if (fdd_add_output(fd, &service->output_service)) {
-        if (fde_pop_context(fdu_context_bufio, ectx))
-            return &service->buffer;    // <-- normal exit
+                if (!dnsserv_query(name, 0, 0)) {
+                    entry->refreshing = false;
+                    return false;
+                }
+            }
 
-        fdd_remove_output(fd);
+            notify(ctx, address);
+            return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+        }
     }
 
-    return 0;
-}
-
-/*------------------------------------------------------------
- *
- * Pending connect()
- *
- */
+    if (dns_cache.size)
+        ++dns_cache.stats.misses;
 
-typedef struct {
-    fdd_service_output oserv;
-    fdu_notify_connect_func connect_func;
-    void* context;
-} fdu_pending_connect_data;
+    return dnsserv_query(name, notify, ctx)
+        && fde_safe_pop_context(fdu_context_dnsserv, ectx);
+}
 
-static bool fdu_pending_connect_callback(void* pcd_v,
-                                         int fd)
+bool fdu_dnsserv_lookup_addresses(const char* name,
+                                  unsigned int options,
+                                  fdu_resolver_notify_func notify,
+                                  void* ctx)
 {
-    fdu_pending_connect_data* pcd = (fdu_pending_connect_data*) pcd_v;
-
     const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_connect)))
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
         return false;
+    //
 
-#ifdef FD_DEBUG
-    if (!pcd
-        || fd < 0)
+    const unsigned int name_len = name ? strlen(name) : 0;
+
+    if (!name
+        || !name_len
+        || name_len >= DnsNameSize
+        || !(options & (FDU_RESOLVE_IPV4|FDU_RESOLVE_IPV6))
+        || !notify)
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
         return false;
     }
-#endif
-    //
+    //
+
+    if (fdu_resolver_is_active())
+    {
+        return fdu_resolver_lookup(name, options, notify, ctx)
+            && fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    }
+
+    fdu_dns_service_query* node = new_dns_query_node(name, 0, ctx);
+
+    if (!node) {
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    node->notify_answer = notify;
+    node->families      = options & (FDU_RESOLVE_IPV4|FDU_RESOLVE_IPV6);
+
+    if (!fdu_dns_service_send(node)) {
+        free_dns_query_node(node);
+        return false;
+    }
 
-    int connect_error;
-    socklen_t len = sizeof(connect_error);
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+}
 
-    if (!fdd_remove_output(fd))
+static bool dnsserv_query(const char* name, fdu_dnsserv_notify_func notify, void* ctx)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
         return false;
 
-    // check the real status of connect() ...
+    // the same name already in flight, wait for its answer
 
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_error, &len) < 0) {
-        connect_error = -1;
+    fdu_dns_service_query* leader = dns_in_flight_find(name);
 
-        fde_push_stdlib_error("getsockopt", errno);
+    if (leader)
+    {
+        fdu_dns_service_query* node = new_dns_query_node(name, notify, ctx);
+
+        if (!node) {
+            fde_push_resource_failure_id(fde_resource_memory_allocation);
+            return false;
+        }
+
+        node->next = leader->waiters;
+        leader->waiters = node;
+
+        ++dns_cache.stats.coalesced;
+
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
     }
 
-    // ... and return it with the given callback
+    // the native resolver replaces dns-service once it has been started
 
-    fdu_notify_connect_func func = pcd->connect_func;
-    void* context = pcd->context;
+    if (fdu_resolver_is_active())
+    {
+        fdu_dns_service_query* node = new_dns_query_node(name, notify, ctx);
 
-    free(pcd);
+        if (!node) {
+            fde_push_resource_failure_id(fde_resource_memory_allocation);
+            return false;
+        }
 
-    return func(context, fd, connect_error)
-        && fde_safe_pop_context(fdu_context_connect, ectx);
-}
+        // literals are answered right away, the node is gone after that
 
-bool fdu_pending_connect(int fd, fdu_notify_connect_func callback, void* callback_context)
-{
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_connect)))
-        return false;
+        dns_in_flight_add(node);
 
-    // allocate and initialize service
+        if (!fdu_resolver_lookup(name, FDU_RESOLVE_IPV4, &fdu_dnsserv_resolved, node)) {
+            dns_in_flight_remove(node);
+            free_dns_query_node(node);
+            return false;
+        }
 
-    fdu_pending_connect_data* pcd = malloc(sizeof(fdu_pending_connect_data));
+        return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    }
 
-    if (!pcd) {
+    // dns-service
+
+    fdu_dns_service_query* new_query = new_dns_query_node(name, notify, ctx);
+
+    if (!new_query) {
         fde_push_resource_failure_id(fde_resource_memory_allocation);
         return false;
     }
 
-    fdd_init_service_output(&pcd->oserv,
-                            pcd,                                // context
-                            &fdu_pending_connect_callback);     // notify
-    pcd->connect_func   = callback;
-    pcd->context        = callback_context;
+    if (!fdu_dns_service_send(new_query)) {
+        free_dns_query_node(new_query);
+        return false;
+    }
 
-    // start service
+    dns_in_flight_add(new_query);
 
-    return fdd_add_output(fd, &pcd->oserv)
-        && fde_safe_pop_context(fdu_context_connect, ectx);
+    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
 }
 
 /*------------------------------------------------------------
  *
- * Non-blocking DNS lookup
+ * Auto-accept connection (aac)
  *
  */
 
-typedef struct fdu_dns_service_query_v1 {
-    struct fdu_dns_service_query_v1* next;
-
-    fdu_dnsserv_notify_func notify;
-    void* context;
-} fdu_dns_service_query;
+enum {
+    AacDefaultBudget    = 64,
+    AacMinimumSources   = 64,           // hash table slots
+    AacSourceSize       = 16,           // IPv6, IPv4 as mapped
+    AacToken            = 1000000,      // token bucket fixed point, per usec
+};
 
 typedef struct {
-    fdd_service_input iserv;
-    int pid, fd_in, fd_out;
-
-    fdu_dns_service_query* head;
-    fdu_dns_service_query* tail;
-} fdu_dns_service;
-
-// -----
-
-static fdu_dns_service_query* free_dns_query_nodes = 0;
-static fdu_dns_service* dns_service = 0;
+    unsigned char addr[AacSourceSize];
+    unsigned int count;                 // =0: empty slot
+} aac_source;
 
-// -----
+typedef struct {
+    unsigned char addr[AacSourceSize];
+    bool tracked;
+} aac_fd_source;
 
-static fdu_dns_service_query* new_dns_query_node(fdu_dnsserv_notify_func notify, void* ctx)
-{
-    fdu_dns_service_query* node;
+struct aac_service_s {
+    fdd_service_input listening_service;
+    fdd_notify_func callback;
+    fdu_aac_peer_func peer_callback;
+    void* callback_context;
+    int server_fd;
+    unsigned int budget;
+    bool accepting;
+    bool paused;                        // rate limited, waiting for the timer
+    bool closed;
 
-    if (!free_dns_query_nodes)
-        node = malloc(sizeof(fdu_dns_service_query));
-    else {
-        node = free_dns_query_nodes;
-        free_dns_query_nodes = free_dns_query_nodes->next;
-    }
+    // admission, see fdu_aac_set_admission()
 
-    if (!node)
-        return 0;
+    unsigned int rate;                  // connections per second, 0 = no limit
+    uint64_t tokens;                    // in 1/AacToken connections
+    uint64_t max_tokens;
+    uint64_t refilled;                  // usec
+    unsigned int per_source;            // 0 = no limit
+    unsigned int admission_options;
 
-    node->next = 0;
-    node->notify = notify;
-    node->context = ctx;
+    aac_source* sources;                // open addressing, linear probing
+    unsigned int sources_size;          // power of two
+    unsigned int sources_used;
 
-    return node;
-}
+    aac_fd_source* fd_sources;          // indexed by fd
+    unsigned int fd_sources_size;
 
-// -----
+    fdu_aac_stats stats;
+};
 
-static void free_dns_query_node(fdu_dns_service_query* tbd)
+static void aac_free_service(aac_service_t* service)
 {
-    tbd->next = free_dns_query_nodes;
-    free_dns_query_nodes = tbd;
+    free(service->sources);
+    free(service->fd_sources);
+    free(service);
 }
 
-// -----
+// ----- token bucket
 
-static void fdu_dns_service_shutdown(void)
+static bool aac_take_token(aac_service_t* service)
 {
-    const fde_node_t* ectx = fde_push_context(fdu_context_dnsserv);
-
-    //
-
-    const int old_pid = dns_service->pid;
-
-    if (kill(dns_service->pid, SIGKILL) < 0)
-        fde_push_stdlib_error("kill", errno);
+    if (!service->rate)
+        return true;
 
-    if (dns_service->head) {
-        fdd_remove_input(dns_service->fd_in);
+    const uint64_t now = monotonic_usec();
 
-        while (dns_service->head) {
-            fdu_dns_service_query* tbd = dns_service->head;
-            dns_service->head = dns_service->head->next;
+    if (now > service->refilled) {
+        service->tokens += (now - service->refilled) * service->rate;
 
-            tbd->notify(tbd->context, 0);
+        if (service->tokens > service->max_tokens)
+            service->tokens = service->max_tokens;
 
-            free_dns_query_node(tbd);
-        }
+        service->refilled = now;
     }
 
-    fdu_safe_close(dns_service->fd_in);
-    fdu_safe_close(dns_service->fd_out);
+    if (service->tokens < AacToken)
+        return false;
 
-    free(dns_service);
-    dns_service = 0;
+    service->tokens -= AacToken;
+    return true;
+}
 
-    if (waitpid(old_pid, 0, 0) < -1)
-        fde_push_stdlib_error("waitpid", errno);
+static fdd_msec_t aac_token_wait(const aac_service_t* service)
+{
+    const uint64_t missing = AacToken - service->tokens;
 
-    if (ectx)
-        fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    // rounded up, the timer may fire a bit early
+
+    return (missing + 1000 * (uint64_t) service->rate - 1) / (1000 * (uint64_t) service->rate) + 1;
 }
 
-// -----
+// ----- per-source counts
 
-static bool fdu_dns_service_got_answer(void* context, int fd)
+static bool aac_source_key(const struct sockaddr* addr, unsigned char* key)
 {
-    //
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
-        return false;
-    //
-    if (context != dns_service) {
-        fde_push_consistency_failure("context != dns_service");
-        return false;
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6*) addr)->sin6_addr, AacSourceSize);
+        return true;
     }
-    //
 
-    enum { buffer_size = 256 };
+    if (addr->sa_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(&key[12], &((const struct sockaddr_in*) addr)->sin_addr, 4);
+        return true;
+    }
 
-    static char buffer[buffer_size];
-    static int filled = 0;
+    return false;
+}
 
-    const int i = read(fd, buffer + filled, buffer_size - filled);
-    if (i <= 0) {
-        fde_push_stdlib_error("pipe", errno);
-        fdu_dns_service_shutdown();
-        return false;
-    }
+static unsigned int aac_source_hash(const unsigned char* key)
+{
+    uint64_t high, low;
 
-    filled += i;
+    memcpy(&high, key, 8);
+    memcpy(&low, &key[8], 8);
 
-    //
+    const uint64_t mixed = (high ^ (low * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
 
-    char* ptr             = buffer;
-    const char* const end = buffer + filled;
+    return (unsigned int) (mixed >> 32);
+}
 
-    char* entry    = 0;          // start of entry
-    char* consumed = buffer;     // start of next entry
+static aac_source* aac_find_source(aac_service_t* service, const unsigned char* key)
+{
+    const unsigned int mask = service->sources_size - 1;
 
-    while ((ptr =memchr(ptr, '\n', end - ptr)))
+    for (unsigned int i = aac_source_hash(key) & mask; ; i = (i + 1) & mask)
     {
-        *ptr++   = 0;
-        entry    = consumed;
-        consumed = ptr;
+        aac_source* source = &service->sources[i];
 
-        if (!dns_service->head)
+        if (!source->count
+            || !memcmp(source->addr, key, AacSourceSize))
         {
-#ifdef FD_DEBUG
-            fde_push_consistency_failure("DNS query node list empty");
-            return false;
-#else
-            continue;
-#endif
-        }
-
-        fdu_dns_service_query* current = dns_service->head;
-
-        fdu_dnsserv_notify_func local_notify = current->notify;
-        void* local_context = current->context;
-
-        dns_service->head = dns_service->head->next;
-        if (!dns_service->head) {
-            dns_service->tail = 0;
-
-            fdd_remove_input(dns_service->fd_in);
+            return source;
         }
+    }
+}
 
-        free_dns_query_node(current);
+static bool aac_grow_sources(aac_service_t* service)
+{
+    const unsigned int old_size = service->sources_size;
+    aac_source* const old       = service->sources;
 
-        //
+    const unsigned int new_size = old_size ? 2 * old_size : AacMinimumSources;
 
-        local_notify(local_context, *entry ? entry : 0);
+    if (!(service->sources = calloc(new_size, sizeof(aac_source)))) {
+        service->sources = old;
+        return false;
     }
 
-    if (consumed
-        && consumed > buffer)
+    service->sources_size = new_size;
+
+    for (unsigned int i = 0; i < old_size; ++i)
     {
-        filled -= (consumed-buffer);
-        if (filled)
-            memmove(buffer, consumed, filled);
+        if (old[i].count)
+            *aac_find_source(service, old[i].addr) = old[i];
     }
 
-    FDE_ASSERT_DEBUG( filled == end - consumed , "pointer math is corrupted" , false );
-
-    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    free(old);
+    return true;
 }
 
-// -----
-
-static bool fdu_dns_service_start(void)
+static void aac_remove_source(aac_service_t* service, aac_source* source)
 {
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
-        return false;
-    //
+    // backward shift deletion, no tombstones
 
-    int pid = 0;
-    int fds_read[2] = {-1, -1};
-    int fds_write[2] = {-1, -1};
+    const unsigned int mask = service->sources_size - 1;
 
-    // create pipes for communication
+    unsigned int hole = source - service->sources;
 
-    if (pipe(fds_read) != 0
-        || pipe(fds_write) != 0)
+    for (unsigned int i = (hole + 1) & mask; service->sources[i].count; i = (i + 1) & mask)
     {
-        fde_push_stdlib_error("pipe", errno);
-
-        if (fds_read[0] >= 0) fdu_safe_close(fds_read[0]);
-        if (fds_read[1] >= 0) fdu_safe_close(fds_read[1]);
-        if (fds_write[0] >= 0) fdu_safe_close(fds_write[0]);
-        if (fds_write[1] >= 0) fdu_safe_close(fds_write[1]);
-        return false;
-    }
-
-    // spawn process
-
-    if ((pid =vfork()) < 0) {
-        fde_push_stdlib_error("vfork", errno);
+        const unsigned int home = aac_source_hash(service->sources[i].addr) & mask;
 
-        fdu_safe_close(fds_read[0]);
-        fdu_safe_close(fds_read[1]);
-        fdu_safe_close(fds_write[0]);
-        fdu_safe_close(fds_write[1]);
-        return false;
-    }
-    else if (pid == 0) // child
-    {
-        fdu_safe_close(fds_read[0]);
-        fdu_safe_close(fds_write[1]);
+        // can the entry at 'i' move back to the hole?
 
-        if (fdu_move_fd(fds_write[0], STDIN_FILENO)
-            && fdu_move_fd(fds_read[1], STDOUT_FILENO))
-        {
-            execl("./dns-service", "dns-service", (char*) 0);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            service->sources[hole] = service->sources[i];
+            hole = i;
         }
-
-        _exit(-1);
     }
 
-    // parent
+    service->sources[hole].count = 0;
+    --service->sources_used;
+}
 
-    fdu_safe_close(fds_read[1]);
-    fdu_safe_close(fds_write[0]);
+// =true: admitted and counted
 
-    /* verify operation:
-     * dns-service replies to invalid requests with empty line, so
-     * simple '\n' should be replied with '\n'
-     */
+// Out of memory only costs the connection, the service stays up.
+
+typedef enum {
+    aac_admitted,
+    aac_over_source_cap,
+    aac_out_of_memory,
+} aac_admission;
 
+static void aac_release_fd(aac_service_t* service, int fd)
+{
+    if ((unsigned int) fd >= service->fd_sources_size
+        || !service->fd_sources[fd].tracked)
     {
-        char buffer[2];
+        return;
+    }
 
-        if (write(fds_write[1], "\n", 1) != 1
-            || read(fds_read[0], buffer, 1) != 1
-            || buffer[0] != '\n')
-        {
-            fde_push_resource_failure("dns_service:startup test");
+    service->fd_sources[fd].tracked = false;
 
-            fdu_safe_close(fds_read[0]);
-            fdu_safe_close(fds_write[1]);
+    aac_source* source = aac_find_source(service, service->fd_sources[fd].addr);
 
-            kill(pid, SIGKILL);
-            waitpid(pid, 0, 0);
-            return false;
-        }
+    if (source->count
+        && !--source->count)
+    {
+        aac_remove_source(service, source);
     }
+}
 
-    // init dns_service struct
+static aac_admission aac_admit_source(aac_service_t* service, int fd, const struct sockaddr* addr)
+{
+    unsigned char key[AacSourceSize];
 
-    dns_service = malloc(sizeof(fdu_dns_service));
+    // the fd number is reused, the old connection is gone even if
+    // fdu_aac_closed() wasn't called for it
 
-    if (!dns_service) {
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        fdu_dns_service_shutdown();
-        return false;
+    aac_release_fd(service, fd);
+
+    if (!service->per_source
+        || !aac_source_key(addr, key))
+    {
+        return aac_admitted;
     }
 
-    fdd_init_service_input(&dns_service->iserv, dns_service, &fdu_dns_service_got_answer);
+    aac_source* source = aac_find_source(service, key);
 
-    dns_service->head   = 0;
-    dns_service->tail   = 0;
-    dns_service->pid    = pid;
-    dns_service->fd_in  = fds_read[0];
-    dns_service->fd_out = fds_write[1];
+    if (source->count >= service->per_source)
+        return aac_over_source_cap;
 
-    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
-}
+    // fd table for fdu_aac_closed()
 
-bool fdu_dnsserv_lookup(const char* name, fdu_dnsserv_notify_func notify, void* ctx)
-{
-    const fde_node_t* ectx;
-    if (!(ectx =fde_push_context(fdu_context_dnsserv)))
-        return false;
-    //
+    if ((unsigned int) fd >= service->fd_sources_size) {
+        unsigned int new_size = service->fd_sources_size ? service->fd_sources_size : 64;
 
-    const unsigned int name_len = name ? strlen(name) : 0;
+        while (new_size <= (unsigned int) fd)
+            new_size *= 2;
 
-    if (!name
-        || name_len <= 2
-        || !notify)
-    {
-        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return false;
-    }
+        aac_fd_source* fd_sources = realloc(service->fd_sources, new_size * sizeof(aac_fd_source));
 
-    //
+        if (!fd_sources)
+            return aac_out_of_memory;
 
-    if (!dns_service
-        && !fdu_dns_service_start()
-        && !dns_service)
-    {
-        fde_push_resource_failure("dns_service:startup");
-        return false;
+        memset(&fd_sources[service->fd_sources_size], 0,
+               (new_size - service->fd_sources_size) * sizeof(aac_fd_source));
+
+        service->fd_sources      = fd_sources;
+        service->fd_sources_size = new_size;
     }
 
-    // send dns-name to dns-service
+    if (!source->count) {
+        if (2 * (service->sources_used + 1) > service->sources_size) {
+            if (!aac_grow_sources(service))
+                return aac_out_of_memory;
 
-    enum { tmp_buffer_size = 255 };
+            source = aac_find_source(service, key);
+        }
 
-    if (name_len >= tmp_buffer_size) {
-        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
-        return false;
+        memcpy(source->addr, key, AacSourceSize);
+        ++service->sources_used;
     }
 
-    unsigned char buffer[tmp_buffer_size +1];
-
-    memcpy(buffer, name, name_len);
-    buffer[name_len] = '\n';
+    ++source->count;
 
-    const bool write_ok = fdu_safe_write(dns_service->fd_out, buffer, buffer + name_len + 1);
+    memcpy(service->fd_sources[fd].addr, key, AacSourceSize);
+    service->fd_sources[fd].tracked = true;
 
-    //
+    return aac_admitted;
+}
 
-    if (!write_ok) {
-        fde_push_resource_failure("dns_service:write");
-        fdu_dns_service_shutdown();
-        return false;
-    }
+// ----- pausing for the rate limit
 
-    // create new query
+static bool fdu_aac_new_connection(void* service_v, int server_fd);
 
-    fdu_dns_service_query* new_query = new_dns_query_node(notify, ctx);
+static bool aac_resume(void* service_v, int UNUSED(id))
+{
+    aac_service_t* service = (aac_service_t*) service_v;
 
-    if (!new_query) {
-        fde_push_resource_failure_id(fde_resource_memory_allocation);
-        return false;
+    service->paused = false;
+
+    if (service->closed) {
+        aac_free_service(service);
+        return true;
     }
 
-    // add it to the list
+    return fdd_add_input(service->server_fd, &service->listening_service);
+}
 
-    if (dns_service->tail)
-    {
-        dns_service->tail->next = new_query;
-        dns_service->tail = new_query;
-    }
-    else {
-        dns_service->head = new_query;
-        dns_service->tail = new_query;
+static bool aac_pause(aac_service_t* service)
+{
+    ++service->stats.deferred;
 
-        fdd_add_input(dns_service->fd_in, &dns_service->iserv);
+    if (!fdd_remove_input(service->server_fd)
+        || !fdd_add_timer(&aac_resume, service, 0, aac_token_wait(service), 0))
+    {
+        return false;
     }
 
-    return fde_safe_pop_context(fdu_context_dnsserv, ectx);
+    service->paused = true;
+    return true;
 }
 
-/*------------------------------------------------------------
- *
- * Auto-accept connection (aac)
- *
- */
-
-struct aac_service_s {
-    fdd_service_input listening_service;
-    fdd_notify_func callback;
-    void* callback_context;
-    int server_fd;
-};
+// -----
 
 static bool fdu_aac_new_connection(void* service_v,
                                    int server_fd)
@@ -1064,40 +3490,125 @@ static bool fdu_aac_new_connection(void* service_v,
         return false;
     //
 
-    int new_socket;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
 
- retry:
-    new_socket = accept(server_fd, 0, 0);
+    const bool want_addr = (service->peer_callback
+                            || service->per_source);
+
+    bool ok = true;
 
-    if (new_socket < 0) {
-        if (errno == EINTR
-            || errno == EAGAIN)
+    service->accepting = true;
+
+    for (unsigned int accepted = 0;
+         ok && !service->closed && accepted < service->budget;
+         )
+    {
+        bool admit = aac_take_token(service);
+
+        if (!admit
+            && !(service->admission_options & FDU_AAC_REJECT))
         {
-            goto retry;
+            ok = aac_pause(service);
+            break;
         }
 
-        fde_push_stdlib_error("accept", errno);
+        addr_len = sizeof(addr);
 
-        fdd_remove_input(server_fd);
-        fdu_safe_close(server_fd);
-        free(service);
-        return false;
+        const int new_socket = accept4(server_fd,
+                                       want_addr ? (struct sockaddr*) &addr : 0,
+                                       want_addr ? &addr_len : 0,
+                                       SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+        if (new_socket < 0) {
+            // an unused token goes back
+
+            if (admit
+                && service->rate
+                && (service->tokens += AacToken) > service->max_tokens)
+            {
+                service->tokens = service->max_tokens;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN
+                || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+
+            // the connection died in the queue, the listening socket is fine
+
+            if (errno == ECONNABORTED
+                || errno == EPROTO
+                || errno == EPERM)
+            {
+                continue;
+            }
+
+            fde_push_stdlib_error("accept4", errno);
+
+            fdd_remove_input(server_fd);
+            fdu_safe_close(server_fd);
+            aac_free_service(service);
+            return false;
+        }
+
+        ++accepted;
+
+        // rejected before anything is allocated for the connection
+
+        if (!admit) {
+            ++service->stats.rejected_rate;
+            fdu_safe_close(new_socket);
+            continue;
+        }
+
+        const aac_admission admission = want_addr
+            ? aac_admit_source(service, new_socket, (struct sockaddr*) &addr)
+            : aac_admitted;
+
+        if (admission != aac_admitted) {
+            if (admission == aac_over_source_cap) ++service->stats.rejected_source;
+            else                                  ++service->stats.rejected_memory;
+
+            fdu_safe_close(new_socket);
+            continue;
+        }
+
+        ++service->stats.accepted;
+
+        ok = service->peer_callback
+            ? service->peer_callback(service->callback_context, new_socket,
+                                     (struct sockaddr*) &addr, addr_len)
+            : service->callback(service->callback_context, new_socket);
+    }
+
+    service->accepting = false;
+
+    if (service->closed
+        && !service->paused)
+    {
+        aac_free_service(service);
     }
 
-    return service->callback(service->callback_context, new_socket)
+    return ok
         && fde_pop_context(fdu_context_aac, ectx);
 }
 
-aac_service_t* fdu_auto_accept_connection(int server_fd,
-                                          fdd_notify_func callback,
-                                          void* callback_context)
+static aac_service_t* new_auto_accept(int server_fd,
+                                      fdd_notify_func callback,
+                                      fdu_aac_peer_func peer_callback,
+                                      void* callback_context)
 {
     const fde_node_t* ectx;
     if (!(ectx =fde_push_context(fdu_context_aac)))
         return 0;
     //
     if (server_fd < 0
-        || !callback)
+        || (!callback && !peer_callback))
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
         fdu_safe_close(server_fd);
@@ -1105,6 +3616,19 @@ aac_service_t* fdu_auto_accept_connection(int server_fd,
     }
     //
 
+    // accept4() loops until EAGAIN
+
+    int flags;
+
+    if ((flags =fcntl(server_fd, F_GETFL)) == -1
+        || ((flags & O_NONBLOCK) == 0
+            && fcntl(server_fd, F_SETFL, flags|O_NONBLOCK) == -1))
+    {
+        fde_push_stdlib_error("fcntl", errno);
+        fdu_safe_close(server_fd);
+        return 0;
+    }
+
     aac_service_t* service = malloc(sizeof(aac_service_t));
 
     if (!service) {
@@ -1114,15 +3638,34 @@ aac_service_t* fdu_auto_accept_connection(int server_fd,
     }
 
     service->callback         = callback;
+    service->peer_callback    = peer_callback;
     service->callback_context = callback_context;
     service->server_fd        = server_fd;
+    service->budget           = AacDefaultBudget;
+    service->accepting        = false;
+    service->paused           = false;
+    service->closed           = false;
+
+    service->rate              = 0;
+    service->tokens            = 0;
+    service->max_tokens        = 0;
+    service->refilled          = 0;
+    service->per_source        = 0;
+    service->admission_options = 0;
+    service->sources           = 0;
+    service->sources_size      = 0;
+    service->sources_used      = 0;
+    service->fd_sources        = 0;
+    service->fd_sources_size   = 0;
+
+    memset(&service->stats, 0, sizeof(service->stats));
 
     fdd_init_service_input(&service->listening_service,
                            service,
                            &fdu_aac_new_connection);
 
     if (!fdd_add_input(server_fd, &service->listening_service)) {
-        free(service);
+        aac_free_service(service);
         fdu_safe_close(server_fd);
         return 0;
     }
@@ -1131,21 +3674,136 @@ aac_service_t* fdu_auto_accept_connection(int server_fd,
     return service;
 }
 
+aac_service_t* fdu_auto_accept_connection(int server_fd,
+                                          fdd_notify_func callback,
+                                          void* callback_context)
+{
+    return new_auto_accept(server_fd, callback, 0, callback_context);
+}
+
+aac_service_t* fdu_auto_accept_connection_peer(int server_fd,
+                                               fdu_aac_peer_func callback,
+                                               void* callback_context)
+{
+    return new_auto_accept(server_fd, 0, callback, callback_context);
+}
+
+bool fdu_aac_set_budget(aac_service_t* service, unsigned int budget)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_aac)))
+        return false;
+    //
+    if (!service
+        || !budget)
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    service->budget = budget;
+
+    return fde_safe_pop_context(fdu_context_aac, ectx);
+}
+
+bool fdu_aac_set_admission(aac_service_t* service,
+                           unsigned int rate,
+                           unsigned int burst,
+                           unsigned int per_source,
+                           unsigned int options)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_aac)))
+        return false;
+    //
+    if (!service
+        || service->closed
+        || (rate && !burst)
+        || (options & ~FDU_AAC_REJECT))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    // sources counted so far stay, new limits apply from the next accept
+
+    service->rate              = rate;
+    service->max_tokens        = (uint64_t) burst * AacToken;
+    service->tokens            = service->max_tokens;
+    service->refilled          = monotonic_usec();
+    service->per_source        = per_source;
+    service->admission_options = options;
+
+    if (per_source
+        && !service->sources
+        && !aac_grow_sources(service))
+    {
+        service->per_source = 0;
+
+        fde_push_resource_failure_id(fde_resource_memory_allocation);
+        return false;
+    }
+
+    return fde_safe_pop_context(fdu_context_aac, ectx);
+}
+
+bool fdu_aac_closed(aac_service_t* service, int fd)
+{
+    if (!service
+        || fd < 0)
+    {
+        fde_push_context(fdu_context_aac);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+
+    aac_release_fd(service, fd);
+
+    return true;
+}
+
+void fdu_aac_get_stats(const aac_service_t* service, fdu_aac_stats* stats)
+{
+    if (!service
+        || !stats)
+    {
+        return;
+    }
+
+    *stats = service->stats;
+    stats->sources = service->sources_used;
+}
+
 bool fdu_close_auto_accept(aac_service_t* service)
 {
     const fde_node_t* ectx;
     if (!(ectx =fde_push_context(fdu_context_aac)))
         return false;
     //
-    if (!service) {
+    if (!service
+        || service->closed)
+    {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
         return false;
     }
     //
 
-    fdd_remove_input(service->server_fd);
+    if (!service->paused)
+        fdd_remove_input(service->server_fd);
+
     fdu_safe_close(service->server_fd);
-    free(service);
+
+    // called from the accept loop or waiting for the resume timer, freed there
+
+    if (service->accepting
+        || service->paused)
+    {
+        service->closed = true;
+    }
+    else
+        aac_free_service(service);
 
     return fde_safe_pop_context(fdu_context_aac, ectx);
 }
@@ -1318,7 +3976,63 @@ bool fdu_signalfd_close(fdu_signalfd_service* service)
  *
  */
 
-int fdu_listen_inet4(unsigned short port, unsigned int options)
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT 30
+#endif
+
+enum {
+    DefaultBacklog     = 64,
+    DeferAcceptSeconds = 10,
+};
+
+static bool set_socket_option(int fd, int level, int name, int value, const char* what)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        fde_push_stdlib_error(what, errno);
+        return false;
+    }
+
+    return true;
+}
+
+static int socket_type(unsigned int protocol)
+{
+    return (protocol == FDU_SOCKET_DGRAM) ? SOCK_DGRAM
+        : (protocol == FDU_SOCKET_SEQPACKET) ? SOCK_SEQPACKET
+        : SOCK_STREAM;
+}
+
+bool fdu_set_tcp_options(int fd, unsigned int options)
+{
+    const fde_node_t* ectx;
+    if (!(ectx =fde_push_context(fdu_context_connect)))
+        return false;
+    //
+    if (fd < 0
+        || (options & ~(FDU_SOCKET_NODELAY
+                        |FDU_SOCKET_QUICKACK)))
+    {
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return false;
+    }
+    //
+
+    if (options & FDU_SOCKET_NODELAY
+        && !set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(TCP_NODELAY)"))
+    {
+        return false;
+    }
+
+    if (options & FDU_SOCKET_QUICKACK
+        && !set_socket_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "setsockopt(TCP_QUICKACK)"))
+    {
+        return false;
+    }
+
+    return fde_safe_pop_context(fdu_context_connect, ectx);
+}
+
+int fdu_listen_inet(unsigned short port, unsigned int options, unsigned int backlog)
 {
     const fde_node_t* ectx;
     if (!(ectx =fde_push_context(fdu_context_listen)))
@@ -1331,24 +4045,36 @@ int fdu_listen_inet4(unsigned short port, unsigned int options)
         || (options & ~(FDU_SOCKET_PROTOCOL_MASK
                         |FDU_SOCKET_LOCAL
                         |FDU_SOCKET_NOREUSE
-                        |FDU_SOCKET_BROADCAST))
+                        |FDU_SOCKET_BROADCAST
+                        |FDU_SOCKET_IPV6
+                        |FDU_SOCKET_V6ONLY
+                        |FDU_SOCKET_FASTOPEN
+                        |FDU_SOCKET_DEFER_ACCEPT
+                        |FDU_SOCKET_NODELAY))
         || (protocol != FDU_SOCKET_STREAM
             && protocol != FDU_SOCKET_DGRAM
             && protocol != FDU_SOCKET_SEQPACKET)
         || (options & FDU_SOCKET_BROADCAST
-            && (options & FDU_SOCKET_LOCAL
-                || protocol != FDU_SOCKET_DGRAM)))
+            && (options & (FDU_SOCKET_LOCAL|FDU_SOCKET_IPV6)
+                || protocol != FDU_SOCKET_DGRAM))
+        || (options & FDU_SOCKET_V6ONLY
+            && !(options & FDU_SOCKET_IPV6))
+        || (options & (FDU_SOCKET_FASTOPEN
+                       |FDU_SOCKET_DEFER_ACCEPT
+                       |FDU_SOCKET_NODELAY)
+            && protocol != FDU_SOCKET_STREAM))
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
         return -1;
     }
 
+    if (!backlog)
+        backlog = DefaultBacklog;
+
     // open socket
 
-    const int socketfd = socket(PF_INET,
-                                (protocol == FDU_SOCKET_DGRAM) ? SOCK_DGRAM
-                                : (protocol == FDU_SOCKET_SEQPACKET) ? SOCK_SEQPACKET
-                                : SOCK_STREAM,
+    const int socketfd = socket((options & FDU_SOCKET_IPV6) ? PF_INET6 : PF_INET,
+                                socket_type(protocol),
                                 0);
 
     if (socketfd < 0) {
@@ -1358,43 +4084,76 @@ int fdu_listen_inet4(unsigned short port, unsigned int options)
 
     // optionally set SO_REUSEADDR for faster restart
 
-    if (!(options & FDU_SOCKET_NOREUSE))
+    if (!(options & FDU_SOCKET_NOREUSE)
+        && !set_socket_option(socketfd, SOL_SOCKET, SO_REUSEADDR, 1, "setsockopt(SO_REUSEADDR)"))
     {
-        int parameter = 1;
-        if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR,
-                       &parameter, sizeof(parameter)) < 0)
-        {
-            fde_push_stdlib_error("setsockopt(SO_REUSEADDR)", errno);
-            fdu_safe_close(socketfd);
-            return -1;
-        }
+        fdu_safe_close(socketfd);
+        return -1;
     }
 
     // optionally set SO_BROADCAST
 
-    if (options & FDU_SOCKET_BROADCAST)
+    if (options & FDU_SOCKET_BROADCAST
+        && !set_socket_option(socketfd, SOL_SOCKET, SO_BROADCAST, 1, "setsockopt(SO_BROADCAST)"))
     {
-        int parameter = 1;
-        if (setsockopt(socketfd, SOL_SOCKET, SO_BROADCAST,
-                       &parameter, sizeof(parameter)) < 0)
-        {
-            fde_push_stdlib_error("setsockopt(SO_BROADCAST)", errno);
-            fdu_safe_close(socketfd);
-            return -1;
-        }
+        fdu_safe_close(socketfd);
+        return -1;
+    }
+
+    // IPv6 sockets accept IPv4 too unless asked otherwise, whatever the system default
+
+    if (options & FDU_SOCKET_IPV6
+        && !set_socket_option(socketfd, IPPROTO_IPV6, IPV6_V6ONLY,
+                              (options & FDU_SOCKET_V6ONLY) ? 1 : 0,
+                              "setsockopt(IPV6_V6ONLY)"))
+    {
+        fdu_safe_close(socketfd);
+        return -1;
+    }
+
+    // TCP options, inherited by the accepted sockets
+
+    if ((options & FDU_SOCKET_NODELAY
+         && !set_socket_option(socketfd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(TCP_NODELAY)"))
+        || (options & FDU_SOCKET_DEFER_ACCEPT
+            && !set_socket_option(socketfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, DeferAcceptSeconds,
+                                  "setsockopt(TCP_DEFER_ACCEPT)"))
+        || (options & FDU_SOCKET_FASTOPEN
+            && !set_socket_option(socketfd, IPPROTO_TCP, TCP_FASTOPEN, backlog,
+                                  "setsockopt(TCP_FASTOPEN)")))
+    {
+        fdu_safe_close(socketfd);
+        return -1;
     }
 
     // bind
 
     {
-        struct sockaddr_in sa;
+        struct sockaddr_storage ss;
+        socklen_t ss_len;
 
-        memset(&sa, 0, sizeof(struct sockaddr_in));
-        sa.sin_family      = AF_INET;
-        sa.sin_port        = htons(port);
-        sa.sin_addr.s_addr = (options & FDU_SOCKET_LOCAL) ? htonl(INADDR_LOOPBACK) : INADDR_ANY;
+        memset(&ss, 0, sizeof(ss));
 
-        if (bind(socketfd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+        if (options & FDU_SOCKET_IPV6) {
+            struct sockaddr_in6* sa = (struct sockaddr_in6*) &ss;
+
+            sa->sin6_family = AF_INET6;
+            sa->sin6_port   = htons(port);
+            sa->sin6_addr   = (options & FDU_SOCKET_LOCAL) ? in6addr_loopback : in6addr_any;
+
+            ss_len = sizeof(struct sockaddr_in6);
+        }
+        else {
+            struct sockaddr_in* sa = (struct sockaddr_in*) &ss;
+
+            sa->sin_family      = AF_INET;
+            sa->sin_port        = htons(port);
+            sa->sin_addr.s_addr = (options & FDU_SOCKET_LOCAL) ? htonl(INADDR_LOOPBACK) : INADDR_ANY;
+
+            ss_len = sizeof(struct sockaddr_in);
+        }
+
+        if (bind(socketfd, (struct sockaddr*) &ss, ss_len) < 0) {
             fde_push_stdlib_error("bind", errno);
             fdu_safe_close(socketfd);
             return -1;
@@ -1404,7 +4163,7 @@ int fdu_listen_inet4(unsigned short port, unsigned int options)
     // listen
 
     if (protocol != FDU_SOCKET_DGRAM) {
-        if (listen(socketfd, 64) == -1) {
+        if (listen(socketfd, backlog) == -1) {
             fde_push_stdlib_error("listen", errno);
             fdu_safe_close(socketfd);
             return -1;
@@ -1419,6 +4178,17 @@ int fdu_listen_inet4(unsigned short port, unsigned int options)
     return socketfd;
 }
 
+int fdu_listen_inet4(unsigned short port, unsigned int options)
+{
+    if (options & (FDU_SOCKET_IPV6|FDU_SOCKET_V6ONLY)) {
+        fde_push_context(fdu_context_listen);
+        fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
+        return -1;
+    }
+
+    return fdu_listen_inet(port, options, 0);
+}
+
 int fdu_listen_unix(const char* path, unsigned int options)
 {
     const fde_node_t* ectx = 0;
@@ -1487,10 +4257,11 @@ int fdu_listen_unix(const char* path, unsigned int options)
     return socketfd;
 }
 
-bool fdu_lazy_connect(struct sockaddr_in* addr,
-                      fdu_notify_connect_func connect_func,
-                      void* context,
-                      unsigned int options)
+bool fdu_lazy_connect_inet(const struct sockaddr* addr,
+                           socklen_t addr_len,
+                           fdu_notify_connect_func connect_func,
+                           void* context,
+                           unsigned int options)
 {
     const fde_node_t* ectx;
     if (!(ectx =fde_push_context(fdu_context_connect)))
@@ -1501,20 +4272,29 @@ bool fdu_lazy_connect(struct sockaddr_in* addr,
 
     if (!addr
         || !connect_func
-        || options & ~FDU_SOCKET_PROTOCOL_MASK
+        || (addr->sa_family == AF_INET
+            ? addr_len < sizeof(struct sockaddr_in)
+            : (addr->sa_family != AF_INET6
+               || addr_len < sizeof(struct sockaddr_in6)))
+        || options & ~(FDU_SOCKET_PROTOCOL_MASK
+                       |FDU_SOCKET_FASTOPEN
+                       |FDU_SOCKET_NODELAY
+                       |FDU_SOCKET_QUICKACK)
         || (protocol != FDU_SOCKET_STREAM
             && protocol != FDU_SOCKET_DGRAM
-            && protocol != FDU_SOCKET_SEQPACKET))
+            && protocol != FDU_SOCKET_SEQPACKET)
+        || (options & (FDU_SOCKET_FASTOPEN
+                       |FDU_SOCKET_NODELAY
+                       |FDU_SOCKET_QUICKACK)
+            && protocol != FDU_SOCKET_STREAM))
     {
         fde_push_consistency_failure_id(fde_consistency_invalid_arguments);
         return false;
     }
     //
 
-    int socketfd = socket(PF_INET,
-                          (protocol == FDU_SOCKET_DGRAM) ? SOCK_DGRAM
-                          : (protocol == FDU_SOCKET_SEQPACKET) ? SOCK_SEQPACKET
-                          : SOCK_STREAM,
+    int socketfd = socket((addr->sa_family == AF_INET6) ? PF_INET6 : PF_INET,
+                          socket_type(protocol),
                           0);
     if (socketfd < 0) {
         fde_push_stdlib_error("socket", errno);
@@ -1539,15 +4319,33 @@ bool fdu_lazy_connect(struct sockaddr_in* addr,
         }
     }
 
+    // TCP options. With TCP_FASTOPEN_CONNECT and a cookie from the server
+    // connect() returns at once and the SYN goes out with the first write,
+    // carrying the data. Without a cookie it's EINPROGRESS as usual.
+
+    if ((options & (FDU_SOCKET_NODELAY|FDU_SOCKET_QUICKACK)
+         && !fdu_set_tcp_options(socketfd, options & (FDU_SOCKET_NODELAY|FDU_SOCKET_QUICKACK)))
+        || (options & FDU_SOCKET_FASTOPEN
+            && !set_socket_option(socketfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+                                  "setsockopt(TCP_FASTOPEN_CONNECT)")))
+    {
+        fdu_safe_close(socketfd);
+        return false;
+    }
+
     // the actual connect
 
     int connect_errno  = 0;
     bool close_succeed = true;
 
-    if (connect(socketfd, (struct sockaddr*) addr, sizeof(struct sockaddr_in)) != 0) {
+    if (connect(socketfd, addr, addr_len) != 0) {
         if (errno == EINPROGRESS) {
-            fdu_pending_connect(socketfd, connect_func, context);
-            return true;
+            if (!fdu_pending_connect(socketfd, connect_func, context)) {
+                fdu_safe_close(socketfd);
+                return false;
+            }
+
+            return fde_pop_context(fdu_context_connect, ectx);
         }
         connect_errno = errno;
 
@@ -1560,6 +4358,15 @@ bool fdu_lazy_connect(struct sockaddr_in* addr,
         && fde_pop_context(fdu_context_connect, ectx);
 }
 
+bool fdu_lazy_connect(struct sockaddr_in* addr,
+                      fdu_notify_connect_func connect_func,
+                      void* context,
+                      unsigned int options)
+{
+    return fdu_lazy_connect_inet((const struct sockaddr*) addr, sizeof(struct sockaddr_in),
+                                 connect_func, context, options);
+}
+
 // ------------------------------------------------------------
 
 bool fdu_safe_read(int fd, unsigned char* start, const unsigned char* const end)
@@ -6,9 +6,11 @@
 #pragma once
 
 #include "dispatcher.h"
+#include "resolver.h"
 #include "utils.fwd.h"
 
 #include <signal.h>
+#include <sys/socket.h>
 
 struct fdu_memory_area_ {
     unsigned char* begin;
@@ -34,13 +36,57 @@ fdu_memory_area init_memory_area_cont(unsigned char** begin_counter, uint32_t si
   CLOSED STATE: When the service changes to closed state, 'close_callback' is
   called. This can happen either during 'notify_callback' or by user calling
   'fdu_bufio_close'. In closed state fd is set to <0 and callbacks will no
-  longer be called.
+  longer be called. fdu_bufio_close_error() closes with an error code for
+  'close_callback', for protocol errors found by the user (EPROTO etc.)
 
   FREED: Whenever the user is finished with the buffer, fdu_bufio_free() should
   be called to release the service resources. (Doesn't apply to inplace-bufios.)
 
   The user is always responsible for closing fd. The bufio service will only do
   read/write operations on it, never close/shutdown.
+
+  ADAPTIVE: Bufios created with fdu_new_*put_bufio_adaptive() start with
+  'min_size' bytes and double their buffer (up to 'max_size') whenever a read
+  fills all the space there is, or when fdu_bufio_reserve() asks for more.
+  Buffers that stay lightly used shrink back, and idle empty buffers are
+  returned to 'min_size'. Sizes are rounded up to powers of two. Resizing moves
+  'data', so pointers to it must not be kept over fdu_bufio_reserve(),
+  fdu_bufio_transfer() or returning to the dispatcher.
+
+  READ BUDGET: By default an input bufio does one read() per wakeup. With
+  fdu_bufio_set_read_budget() it keeps reading (without blocking) until the
+  socket runs dry, the buffer is full, or 'max_reads' reads or 'max_bytes'
+  bytes have been done. 'notify_callback' is called once for the whole batch.
+  Zero means "no limit" for 'max_bytes' and "one read" for 'max_reads'.
+
+  ZERO-COPY: fdu_bufio_set_zerocopy() switches an output bufio (not adaptive)
+  to send(MSG_ZEROCOPY) whenever at least 'threshold' bytes are waiting;
+  smaller writes are copied as usual. Sent bytes stay pinned in the buffer, so
+  'data' moves forward and 'size' shrinks until the kernel reports completion
+  on the socket error queue. Once half of the buffer is pinned, writes are
+  copied until completions give the space back. If the kernel reports it had
+  to copy anyway, the bufio falls back to plain writes. Only TCP and UDP
+  sockets qualify.
+
+  WATERMARKS: fdu_bufio_set_watermarks() links an input bufio to the output
+  bufio its data is moved to. Whenever 'filled' of the output reaches 'high'
+  the input stops reading (fdu_bufio_touch() on it does nothing), and reading
+  resumes once the output has drained down to 'low'. The levels are checked
+  after input notify, fdu_bufio_touch() and fdu_bufio_transfer() on the
+  output and after every write. Closing either side removes the link. A zero
+  'input' removes the link of 'output'.
+
+  MMAP: fdu_new_mmap_bufio() presents a regular file, starting from 'offset',
+  as an input bufio without read() calls. 'data' points straight into a
+  read-only mapping of at most 'window_size' bytes (default 64MB), 'size'
+  equals 'filled' and the user must not write there. Data is consumed with
+  fdu_bufio_consume() (or fdu_bufio_transfer()); the window slides forward as
+  data is consumed and the next part of the file is notified. If nothing is
+  consumed, the window stays full until fdu_bufio_touch(). At the end of the
+  file the bufio closes, the data stays mapped until fdu_bufio_free(). With
+  FDU_MMAP_FOLLOW it instead keeps polling for the file to grow. A file that
+  is truncated below the mapping closes the bufio with EIO; truncating it
+  while 'data' is being read raises SIGBUS, as with any mapping.
 */
 
 typedef struct fdu_bufio_service_ fdu_bufio_service;
@@ -72,9 +118,18 @@ static inline bool fdu_bufio_is_empty(fdu_bufio_buffer* bufio) { return !bufio->
 
 bool fdu_bufio_touch(fdu_bufio_buffer*);
 void fdu_bufio_close(fdu_bufio_buffer*);
+void fdu_bufio_close_error(fdu_bufio_buffer*, int error);
 void fdu_bufio_free(fdu_bufio_buffer*);
 
 unsigned int fdu_bufio_transfer(fdu_bufio_buffer*, fdu_bufio_buffer*);
+bool fdu_bufio_consume(fdu_bufio_buffer*, unsigned int bytes);      // drop from the front
+bool fdu_bufio_reserve(fdu_bufio_buffer*, unsigned int bytes);  // =true: 'bytes' of free space
+bool fdu_bufio_set_read_budget(fdu_bufio_buffer*, unsigned int max_bytes, unsigned int max_reads);
+bool fdu_bufio_set_zerocopy(fdu_bufio_buffer*, unsigned int threshold);
+bool fdu_bufio_set_watermarks(fdu_bufio_buffer* output,
+                              fdu_bufio_buffer* input,
+                              unsigned int high,
+                              unsigned int low);
 
 //
 
@@ -90,6 +145,30 @@ fdu_bufio_buffer* fdu_new_output_bufio(int fd,
                                        fdu_bufio_notify_func notify_callback,
                                        fdu_bufio_close_func close_callback);
 
+fdu_bufio_buffer* fdu_new_input_bufio_adaptive(int fd,
+                                               unsigned int min_size,
+                                               unsigned int max_size,
+                                               void* context,
+                                               fdu_bufio_notify_func notify_callback,
+                                               fdu_bufio_close_func close_callback);
+
+fdu_bufio_buffer* fdu_new_output_bufio_adaptive(int fd,
+                                                unsigned int min_size,
+                                                unsigned int max_size,
+                                                void* context,
+                                                fdu_bufio_notify_func notify_callback,
+                                                fdu_bufio_close_func close_callback);
+
+enum { FDU_MMAP_FOLLOW = 0x1 };                         // keep waiting for more data at EOF
+
+fdu_bufio_buffer* fdu_new_mmap_bufio(int fd,
+                                     uint64_t offset,
+                                     unsigned int window_size,  // 0 = default
+                                     unsigned int options,
+                                     void* context,
+                                     fdu_bufio_notify_func notify_callback,
+                                     fdu_bufio_close_func close_callback);
+
 fdu_bufio_buffer* fdu_new_input_bufio_inplace(int fd,
                                               fdu_memory_area service_memory,
                                               fdu_memory_area buffer_memory,
@@ -120,9 +199,56 @@ bool fdu_pending_connect(int fd, fdu_notify_connect_func callback, void* context
  *
  */
 
+// Runs ./dns-service as a helper process, or uses the native resolver (see
+// resolver.h) if fdu_resolver_init() has been called.
+//
+// fdu_dnsserv_set_workers() allows up to 'count' (1-16) dns-service
+// processes. They are started as needed, each lookup goes to the one with
+// the fewest queries waiting, and answers come back in any order. A worker
+// that dies is replaced and its queries are sent again; a query that takes
+// down three workers fails.
+//
+// fdu_dnsserv_set_cache() puts a cache of up to 2^20 names in front, the
+// least recently used one is dropped when full. Answers are kept for their
+// TTL ('default_ttl' seconds when dns-service is used, it doesn't tell),
+// NXDOMAIN and names without an address for 'negative_ttl' seconds, and
+// failures (timeouts, SERVFAIL, a lost worker) for 'failure_ttl' seconds,
+// 0 = not at all. Both backends do the same. For 'stale' seconds after
+// expiry the old address is still given out while a refresh runs in the
+// background. Hits call the callback before fdu_dnsserv_lookup() returns.
+//
+// Lookups of a name that is already being queried don't query again, they
+// get the same answer when it arrives, in the order they were made.
+//
+// fdu_dnsserv_lookup_addresses() gives all IPv4 and/or IPv6 addresses of the
+// name (FDU_RESOLVE_XXX), e.g. to try them in turn. It goes past the cache.
+// Names are at most 255 bytes, the DNS limit, for both lookups.
+// dns-service doesn't know TTLs, they are UINT32_MAX.
+
 typedef void (*fdu_dnsserv_notify_func)(void* context, const char* address);    // address can be 0
 
+typedef struct {
+    uint64_t hits;
+    uint64_t stale_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t coalesced;                 // joined a query in flight
+    unsigned int entries;
+} fdu_dnsserv_cache_stats;
+
 bool fdu_dnsserv_lookup(const char* name, fdu_dnsserv_notify_func callback, void* context);
+bool fdu_dnsserv_lookup_addresses(const char* name,
+                                  unsigned int options,          // FDU_RESOLVE_XXX
+                                  fdu_resolver_notify_func callback,
+                                  void* context);
+
+bool fdu_dnsserv_set_cache(unsigned int max_entries,    // 0 = no cache
+                           unsigned int default_ttl,
+                           unsigned int negative_ttl,
+                           unsigned int failure_ttl,
+                           unsigned int stale);
+void fdu_dnsserv_get_cache_stats(fdu_dnsserv_cache_stats* stats);
+bool fdu_dnsserv_set_workers(unsigned int count);
 
 /*------------------------------------------------------------
  *
@@ -130,9 +256,50 @@ bool fdu_dnsserv_lookup(const char* name, fdu_dnsserv_notify_func callback, void
  *
  */
 
+/*
+  Every wakeup accepts connections until the backlog is empty or 'budget'
+  (default 64) connections have been accepted; the rest are picked up on the
+  next round. The listening socket is set non-blocking, new sockets are
+  created with O_NONBLOCK and FD_CLOEXEC. The callback may close the service.
+
+  ADMISSION: fdu_aac_set_admission() limits accepts to 'rate' per second
+  with bursts of 'burst' (token bucket) and open connections to 'per_source'
+  per peer IP address (0 = no limit). Over the rate, accepting stops until
+  the next token is due and the connections wait in the backlog; with
+  FDU_AAC_REJECT they are accepted and closed right away instead. Over the
+  per-source cap connections are always closed. Either way the callback is
+  not called, so nothing is allocated for them. With a per-source cap the
+  user must call fdu_aac_closed() when closing an accepted connection.
+*/
+
 typedef struct aac_service_s aac_service_t;
 
+enum { FDU_AAC_REJECT = 0x1 };
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t rejected_rate;
+    uint64_t rejected_source;
+    uint64_t rejected_memory;           // no memory for per-source tracking
+    uint64_t deferred;                  // times accepting stopped for the rate
+    unsigned int sources;               // peer addresses with connections open
+} fdu_aac_stats;
+
+typedef bool (*fdu_aac_peer_func)(void* context,
+                                  int fd,
+                                  const struct sockaddr* addr,
+                                  socklen_t addr_len);
+
 aac_service_t* fdu_auto_accept_connection(int fd, fdd_notify_func callback, void* callback_context);
+aac_service_t* fdu_auto_accept_connection_peer(int fd, fdu_aac_peer_func callback, void* callback_context);
+bool fdu_aac_set_budget(aac_service_t* service, unsigned int budget);
+bool fdu_aac_set_admission(aac_service_t* service,
+                           unsigned int rate,                   // per second, 0 = no limit
+                           unsigned int burst,
+                           unsigned int per_source,             // 0 = no limit
+                           unsigned int options);
+bool fdu_aac_closed(aac_service_t* service, int fd);
+void fdu_aac_get_stats(const aac_service_t* service, fdu_aac_stats* stats);
 bool fdu_close_auto_accept(aac_service_t* service);
 
 /*------------------------------------------------------------
@@ -177,9 +344,22 @@ enum {
     FDU_SOCKET_LOCAL         = 1<<2,
     FDU_SOCKET_NOREUSE       = 1<<3,
     FDU_SOCKET_BROADCAST     = 1<<4,
+
+    // fdu_listen_inet():
+    FDU_SOCKET_IPV6          = 1<<5,    // dual-stack unless V6ONLY
+    FDU_SOCKET_V6ONLY        = 1<<6,
+    FDU_SOCKET_DEFER_ACCEPT  = 1<<7,    // wake up when the first data arrives
+
+    // fdu_listen_inet() & fdu_lazy_connect_inet(), stream only:
+    FDU_SOCKET_FASTOPEN      = 1<<8,    // TCP_FASTOPEN / TCP_FASTOPEN_CONNECT
+    FDU_SOCKET_NODELAY       = 1<<9,    // inherited by accepted sockets
+
+    // fdu_lazy_connect_inet() & fdu_set_tcp_options():
+    FDU_SOCKET_QUICKACK      = 1<<10,
 };
 
 int fdu_listen_inet4(unsigned short port, unsigned int options);
+int fdu_listen_inet(unsigned short port, unsigned int options, unsigned int backlog);  // backlog 0 = 64
 int fdu_listen_unix(const char* path, unsigned int options);
 // >=0 (fd)
 
@@ -189,8 +369,19 @@ bool fdu_lazy_connect(struct sockaddr_in*,              // IPv4 address
                       fdu_notify_connect_func,          // call when rdy
                       void*,                            // context
                       unsigned int);                    // options
+bool fdu_lazy_connect_inet(const struct sockaddr*,      // IPv4 or IPv6 address
+                           socklen_t,
+                           fdu_notify_connect_func,
+                           void*,
+                           unsigned int);
 // =true : callback will be called
 // =false: connect attempt failed instantly
+// With FDU_SOCKET_FASTOPEN and a TFO cookie cached for the server, the
+// callback is called right away and the handshake starts with the first
+// write. Without a cookie connect() goes on as usual and the callback is
+// called when the socket becomes writable.
+
+bool fdu_set_tcp_options(int fd, unsigned int options); // NODELAY, QUICKACK
 
 // ------------------------------------------------------------
 